@@ -12,6 +12,8 @@
 
 #include "attract.h"
 #include "computer.h"
+#include "frame.h"
+#include "ring.h"
 
 #define SERIAL_FORMAT   (SERIAL_8N1)
 #define USB             Serial
@@ -35,10 +37,20 @@ int drawingMemory[LEDS_PER_STRIP * 6];
 const int config = WS2811_RBG | WS2811_800kHz;
 OctoWS2811 leds(LEDS_PER_STRIP, displayMemory, drawingMemory, config);
 
-unsigned long lastMillis = 0;
+FrameScheduler frames;
+
+// Ring forwarding (see ring.h): Runs from ringTimer, not loop()
+Ring ring;
+IntervalTimer ringTimer;
+int ringTxIdle = 0;	// availableForWrite() with nothing queued
+
+// Station 0 only: Next time sync line (see timesync.h)
+uint32_t syncDue = 0;
 //uint16_t millisSinceSensor = ULTRASONIC_INTERVAL_MS;
 
 // Arduino Uno: 19200 baud works, 57600 definitely does not.
+// The ring starts here, then station 0 steps it up as far as the
+// cables allow (see linkrate.h). USB ignores it.
 const int BAUD_RATE = 9600;
 
 /*
@@ -85,26 +97,73 @@ void test_serial_string(String str)
 	}
 }
 
-void serial_input(uint8_t b, bool isUsb) {
-	LineResult result;
+// Timer interrupt: Pass bytes downstream as soon as they arrive
+void ring_isr() {
+	ring_pump(&ring, USB, RINGSERIAL, RINGSERIAL);
+}
+
+// This station's copy of the bytes, parsed between frames.
+// Stops near deadline (see queue_drain()); the rest waits.
+void serial_input(uint32_t deadline) {
+	// From Serial: From the laptop/programmer
+	queue_drain(&ring.local[k_port_usb], computer_input_from_usb, deadline);
+
+	// From UPSTREAM: From the microprocessor 1 higher
+	queue_drain(&ring.local[k_port_upstream], computer_input_from_upstream, deadline);
+
+	telemetry.bytes_forwarded = ring.forwarded;
+	telemetry.usb_overflows = ring.local[k_port_usb].overflows;
+	telemetry.upstream_overflows = ring.local[k_port_upstream].overflows;
+	telemetry.backlog_max = max(ring.local[k_port_usb].backlog_max, ring.local[k_port_upstream].backlog_max);
+}
+
+// Station 0: Send its time downstream. Only between lines, and with
+// nothing queued ahead, so the line leaves right away and the
+// receivers' delay estimate holds. Otherwise, try next frame.
+void send_time_sync() {
+	char line[SYNC_LINE_LEN];
 
-	if (isUsb) {
-		result = computer_input_from_usb(b);
-	} else {
-		result = computer_input_from_upstream(b);
+	noInterrupts();	// ring_isr() writes RINGSERIAL too
+
+	if ((ring.owner == k_port_none) && (RINGSERIAL.availableForWrite() >= ringTxIdle)) {
+		sync_line(line, micros());
+		RINGSERIAL.write((const uint8_t *)line, SYNC_LINE_LEN);
+		syncDue = millis() + SYNC_INTERVAL_MILLIS;
 	}
 
-	//Serial.println(result);
+	interrupts();
+}
+
+// Ring baud rate (see linkrate.h): Every station switches RINGSERIAL
+// when it's time. Station 0 also sends the lines that drive it, the
+// same way as send_time_sync(), and holds USB lines meanwhile.
+void link_service() {
+	bool master = (computer_get_station_id() == 0);
+	uint8_t step = link_rate.step;
+
+	LinkSend what = link_update(&link_rate, master, time_sync_now(&time_sync, micros()), millis());
 
-	if ((result == k_line_ok) || (result == k_line_end)) {
-		// Pass the data along, downstream.
-		RINGSERIAL.write(b);
+	if (what != k_link_send_none) {
+		char line[LINK_LINE_MAX];
 
-	} else if (result == k_line_first_byte) {
-		if (('1' <= b) && (b <= '9')) {
-			// Message lifespan: Decrement and pass onward
-			RINGSERIAL.write(b - 1);
+		noInterrupts();
+
+		if ((ring.owner == k_port_none) && (RINGSERIAL.availableForWrite() >= ringTxIdle)) {
+			uint8_t len = link_line(line, what);
+			RINGSERIAL.write((const uint8_t *)line, len);
+			link_sent(&link_rate, what, millis());
 		}
+
+		interrupts();
+	}
+
+	ring.hold = master && link_holding(&link_rate);
+
+	if (link_rate.step != step) {
+		ringTimer.end();
+		RINGSERIAL.flush();
+		RINGSERIAL.begin(link_baud(&link_rate), SERIAL_FORMAT);
+		ringTimer.begin(ring_isr, RING_PUMP_MICROS);
 	}
 }
 
@@ -119,6 +178,7 @@ void setup() {
 	RINGSERIAL.setTX(RING_TX);
 	RINGSERIAL.setRX(RING_RX);
 	RINGSERIAL.begin(BAUD_RATE, SERIAL_FORMAT);
+	ringTxIdle = RINGSERIAL.availableForWrite();
 
 	// initialize the digital pin as an output.
 	pinMode(BLINK_PIN, OUTPUT);
@@ -128,64 +188,27 @@ void setup() {
 
 	computer_init(&leds);
 
-	lastMillis = millis();
+	frame_init(&frames, FRAME_TARGET_FPS, micros());
+
+	ring_init(&ring);
+	ringTimer.begin(ring_isr, RING_PUMP_MICROS);
 
 	// Appliance mode: Automatically run an animation
-	// when switched on.
-	// FIXME: Put these in an array. Arrays of char *
-	// are behaving badly, I'm in the hot sun and I'm over it
-
-	switch (STATION_ID) {
-
-		case 0: {run_attract_string_with_lifespan_bytes_in_it(
-			"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x31\x0a\x31\x73\x22\x2a\x50\x5f\x2c\x32\x35\x0a\x31\x73\x23\x2d\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2e\x76\x23\x0a\x31\x73\x25\x2d\x31\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x25\x2c\x76\x25\x0a\x31\x73\x27\x2a\x76\x26\x2c\x76\x26\x0a\x31\x73\x28\x2d\x31\x2c\x76\x27\x0a\x31\x73\x29\x5a\x30\x2e\x39\x2c\x31\x0a\x31\x73\x2a\x2a\x76\x25\x2c\x76\x29\x0a\x31\x73\x2b\x2a\x76\x2a\x2c\x30\x2e\x32\x35\x0a\x31\x73\x2c\x71\x76\x2b\x0a\x31\x73\x2d\x2a\x54\x5f\x2c\x30\x2e\x30\x32\x0a\x31\x73\x2e\x5d\x76\x2d\x2c\x76\x28\x2c\x76\x2c\x0a\x31\x63\x2f\x0a"
-		); break;}
-
-		case 1: {run_attract_string_with_lifespan_bytes_in_it(
-			"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x41\x5f\x2c\x35\x0a\x31\x73\x22\x2a\x54\x5f\x2c\x30\x2e\x39\x0a\x31\x73\x23\x2b\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2a\x54\x5f\x2c\x30\x2e\x32\x0a\x31\x73\x25\x2b\x76\x23\x2c\x76\x24\x0a\x31\x73\x26\x2e\x76\x25\x0a\x31\x73\x27\x6c\x30\x2e\x39\x35\x2c\x30\x2e\x35\x2c\x76\x26\x0a\x31\x73\x28\x32\x58\x5f\x2c\x59\x5f\x0a\x31\x73\x29\x2a\x76\x28\x2c\x30\x2e\x32\x0a\x31\x73\x2a\x2b\x76\x27\x2c\x76\x29\x0a\x31\x73\x2b\x5d\x76\x2a\x2c\x31\x2c\x31\x0a\x31\x63\x2c\x0a"
-		); break;}
-
-		// Wheel with noise spokes
-		case 2: {run_attract_string_with_lifespan_bytes_in_it(
-			"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x30\x2e\x39\x0a\x31\x73\x22\x2a\x41\x5f\x2c\x35\x0a\x31\x73\x23\x2d\x76\x22\x2c\x76\x21\x0a\x31\x73\x24\x73\x76\x23\x0a\x31\x73\x25\x2a\x76\x24\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x24\x2c\x76\x25\x0a\x31\x73\x27\x2d\x31\x2c\x76\x26\x0a\x31\x73\x28\x2a\x59\x5f\x2c\x32\x38\x0a\x31\x73\x29\x2a\x58\x5f\x2c\x39\x0a\x31\x73\x2a\x2b\x76\x29\x2c\x76\x28\x0a\x31\x73\x2b\x2e\x76\x2a\x0a\x31\x73\x2c\x6c\x30\x2e\x37\x2c\x31\x2c\x76\x2b\x0a\x31\x73\x2d\x2a\x76\x24\x2c\x76\x2c\x0a\x31\x73\x2e\x2a\x54\x5f\x2c\x30\x2e\x30\x33\x0a\x31\x73\x2f\x5d\x76\x2e\x2c\x76\x27\x2c\x76\x2d\x0a\x31\x63\x30\x0a"
-		); break;}
-
-		// Fast matrix tracers
-		case 3: {run_attract_string_with_lifespan_bytes_in_it(
-			"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x31\x2e\x35\x0a\x31\x73\x22\x2a\x50\x5f\x2c\x31\x30\x0a\x31\x73\x23\x2d\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2e\x76\x23\x0a\x31\x73\x25\x2d\x31\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x25\x2c\x76\x25\x0a\x31\x73\x27\x2a\x76\x26\x2c\x76\x26\x0a\x31\x73\x28\x2d\x31\x2c\x76\x27\x0a\x31\x73\x29\x5a\x30\x2e\x39\x2c\x31\x0a\x31\x73\x2a\x2a\x76\x25\x2c\x76\x29\x0a\x31\x73\x2b\x2a\x76\x2a\x2c\x30\x2e\x32\x35\x0a\x31\x73\x2c\x71\x76\x2b\x0a\x31\x73\x2d\x2a\x54\x5f\x2c\x30\x2e\x30\x32\x0a\x31\x73\x2e\x5d\x76\x2d\x2c\x76\x28\x2c\x76\x2c\x0a\x31\x63\x2f\x0a"
-		); break;}
-
-		// Color pinwheel
-		case 4: {run_attract_string_with_lifespan_bytes_in_it(
-"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x41\x5f\x2c\x31\x0a\x31\x73\x22\x2b\x76\x21\x2c\x54\x5f\x0a\x31\x73\x23\x2e\x76\x22\x0a\x31\x73\x24\x5d\x76\x23\x2c\x31\x2c\x31\x0a\x31\x63\x25\x0a"
-		); break;}
-
-		// Atari color cycling
-		case 5: {run_attract_string_with_lifespan_bytes_in_it(
-"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x59\x5f\x2c\x39\x39\x0a\x31\x73\x22\x2a\x58\x5f\x2c\x76\x21\x0a\x31\x73\x23\x2a\x59\x5f\x2c\x39\x37\x0a\x31\x73\x24\x2a\x59\x5f\x2c\x76\x23\x0a\x31\x73\x25\x2a\x59\x5f\x2c\x76\x24\x0a\x31\x73\x26\x32\x76\x22\x2c\x76\x25\x0a\x31\x73\x27\x2a\x54\x5f\x2c\x31\x0a\x31\x73\x28\x2a\x76\x26\x2c\x33\x0a\x31\x73\x29\x2b\x76\x28\x2c\x76\x27\x0a\x31\x73\x2a\x74\x76\x29\x0a\x31\x73\x2b\x25\x76\x29\x2c\x31\x36\x0a\x31\x73\x2c\x5f\x76\x2b\x0a\x31\x73\x2d\x2f\x76\x2c\x2c\x31\x36\x0a\x31\x73\x2e\x6c\x31\x2c\x30\x2e\x36\x2c\x76\x2a\x0a\x31\x73\x2f\x3d\x76\x2d\x0a\x31\x73\x30\x3f\x76\x2f\x2c\x30\x2c\x76\x2e\x0a\x31\x73\x31\x5d\x76\x2d\x2c\x76\x30\x2c\x76\x2a\x0a\x31\x63\x32\x0a"
-		); break;}
-
-		// Pride flag (rainbow)
-		case 6: {run_attract_string_with_lifespan_bytes_in_it(
-"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x58\x5f\x2c\x32\x2e\x32\x0a\x31\x73\x22\x2a\x54\x5f\x2c\x31\x2e\x33\x0a\x31\x73\x23\x2b\x76\x22\x2c\x76\x21\x0a\x31\x73\x24\x71\x76\x23\x0a\x31\x73\x25\x2a\x58\x5f\x2c\x31\x2e\x34\x31\x34\x0a\x31\x73\x26\x2a\x54\x5f\x2c\x30\x2e\x37\x0a\x31\x73\x27\x2b\x76\x26\x2c\x76\x25\x0a\x31\x73\x28\x71\x76\x27\x0a\x31\x73\x29\x2d\x76\x24\x2c\x76\x28\x0a\x31\x73\x2a\x2a\x76\x29\x2c\x30\x2e\x30\x39\x0a\x31\x73\x2b\x2b\x59\x5f\x2c\x76\x2a\x0a\x31\x73\x2c\x2a\x76\x2b\x2c\x36\x0a\x31\x73\x2d\x5f\x76\x2c\x0a\x31\x73\x2e\x2f\x76\x2d\x2c\x36\x0a\x31\x73\x2f\x78\x76\x2e\x2c\x30\x2c\x30\x2e\x38\x33\x33\x33\x33\x0a\x31\x73\x30\x3c\x76\x2f\x2c\x30\x2e\x36\x0a\x31\x73\x31\x2d\x76\x2f\x2c\x30\x2e\x31\x36\x36\x36\x36\x37\x0a\x31\x73\x32\x3f\x76\x30\x2c\x76\x31\x2c\x76\x2f\x0a\x31\x73\x33\x3c\x76\x32\x2c\x30\x2e\x32\x0a\x31\x73\x34\x2b\x76\x32\x2c\x30\x2e\x31\x36\x36\x36\x36\x37\x0a\x31\x73\x35\x2f\x76\x34\x2c\x32\x0a\x31\x73\x36\x3f\x76\x33\x2c\x76\x35\x2c\x76\x32\x0a\x31\x73\x37\x5d\x76\x36\x2c\x31\x2c\x31\x0a\x31\x63\x38\x0a"
-		); break;}
-
-		case 7: {run_attract_string_with_lifespan_bytes_in_it(
-			// Purple radiation from upper-left corner
-			"\x37\x63\x21\x0a\x37\x67\x43\x7f\x0a\x37\x73\x21\x2a\x58\x5f\x2c\x58\x5f\x0a\x37\x73\x22\x2a\x59\x5f\x2c\x59\x5f\x0a\x37\x73\x23\x2b\x76\x21\x2c\x76\x22\x0a\x37\x73\x24\x2a\x76\x23\x2c\x33\x2e\x33\x0a\x37\x73\x25\x2a\x54\x5f\x2c\x30\x2e\x34\x35\x0a\x37\x73\x26\x2d\x76\x24\x2c\x76\x25\x0a\x37\x73\x27\x71\x76\x26\x0a\x37\x73\x28\x5a\x30\x2c\x30\x2e\x30\x31\x0a\x37\x73\x29\x30\x76\x28\x0a\x37\x73\x2a\x71\x76\x29\x0a\x37\x73\x2b\x6c\x30\x2e\x38\x2c\x31\x2c\x76\x2a\x0a\x37\x73\x2c\x2a\x54\x5f\x2c\x30\x2e\x30\x33\x0a\x37\x73\x2d\x74\x76\x2c\x0a\x37\x73\x2e\x6c\x30\x2e\x37\x35\x2c\x30\x2e\x39\x31\x36\x36\x36\x37\x2c\x76\x2d\x0a\x37\x73\x2f\x5d\x76\x2e\x2c\x76\x2b\x2c\x76\x27\x0a\x37\x63\x30\x0a"
-		); break;}
+	// when switched on. The program store's playlist (see
+	// store_boot()). A new Teensy has none yet: Run the built-in
+	// animation, and store it in slot 0 for next time.
+	if (!store_boot() && (STATION_ID < ATTRACT_MODES_LEN)) {
+		run_attract_string_with_lifespan_bytes_in_it(ATTRACT_MODES[STATION_ID]);
+
+		uint8_t first = 0;
+		store_save(first);
+		store_set_playlist(&first, 1, 0);
 	}
 
 }
 
 // the loop routine runs over and over again forever:
 void loop() {
-	leds.show();
-
-	unsigned long now = millis();
-	uint16_t elapsed = now - lastMillis;
-	lastMillis = now;
-
 	// User input: disables attract mode, for a little while
 	// 2018-06-22: At Toorcamp. Disabling attract, for now.
 	/*
@@ -208,22 +231,32 @@ void loop() {
 	}
 	*/
 
-	// From Serial: From the laptop/programmer
-	while (USB.available() > 0) {
-		// read the incoming byte:
-		uint8_t b = Serial.read();
-		serial_input(b, true);
-	}
+	// Parse input until shortly before the next swap
+	serial_input(frames.due - FRAME_SHOW_MICROS);
+	link_service();
 
-	// From UPSTREAM: From the microprocessor 1 higher
-	while (RINGSERIAL.available() > 0) {
-		// read the incoming byte:
-		uint8_t b = RINGSERIAL.read();
-		serial_input(b, false);
+	// Frame pipeline (see frame.h): Wait for the tick, then swap.
+	// Frame N clocks out while frame N+1 is drawn.
+	uint32_t now = micros();
+	if (!frame_due(&frames, now)) {
+		return;
 	}
 
+	leds.show();
+	telemetry.show_micros = micros() - now;
+
+	uint32_t elapsed = frame_swap(&frames, now);
+	telemetry.fps_x100 = (uint16_t)(frames.fps * 100.0f);
+
 	computer_run(elapsed);
 
+	frame_drawn(&frames, micros());
+
+	// Not while the ring is changing rate: It might not arrive
+	if ((computer_get_station_id() == 0) && !link_holding(&link_rate) && ((int32_t)(millis() - syncDue) >= 0)) {
+		send_time_sync();
+	}
+
 	// Blink to prove we're alive.
 	// Blinks once every 60 frames. If blink rate is >1/sec, frame rate is good!
 	frameCount = (frameCount + 1) % 60;
@@ -9,5 +9,36 @@
 //   These strings _include_ lifespan bytes, so we
 //   don't have to gut & debug the entire communications
 //   protocol on the last day of Toorcamp  :P
+//
+//   One animation per station, indexed by STATION_ID.
+//   The human-readable code is in docs/lexer_notes.txt
+
+#define ATTRACT_MODES_LEN  (8)
+
+const char * const ATTRACT_MODES[ATTRACT_MODES_LEN] = {
+	// [0] Matrix: White tracers
+	"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x31\x0a\x31\x73\x22\x2a\x50\x5f\x2c\x32\x35\x0a\x31\x73\x23\x2d\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2e\x76\x23\x0a\x31\x73\x25\x2d\x31\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x25\x2c\x76\x25\x0a\x31\x73\x27\x2a\x76\x26\x2c\x76\x26\x0a\x31\x73\x28\x2d\x31\x2c\x76\x27\x0a\x31\x73\x29\x5a\x30\x2e\x39\x2c\x31\x0a\x31\x73\x2a\x2a\x76\x25\x2c\x76\x29\x0a\x31\x73\x2b\x2a\x76\x2a\x2c\x30\x2e\x32\x35\x0a\x31\x73\x2c\x71\x76\x2b\x0a\x31\x73\x2d\x2a\x54\x5f\x2c\x30\x2e\x30\x32\x0a\x31\x73\x2e\x5d\x76\x2d\x2c\x76\x28\x2c\x76\x2c\x0a\x31\x63\x2f\x0a",
+
+	// [1] Wheel, color segments
+	"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x41\x5f\x2c\x35\x0a\x31\x73\x22\x2a\x54\x5f\x2c\x30\x2e\x39\x0a\x31\x73\x23\x2b\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2a\x54\x5f\x2c\x30\x2e\x32\x0a\x31\x73\x25\x2b\x76\x23\x2c\x76\x24\x0a\x31\x73\x26\x2e\x76\x25\x0a\x31\x73\x27\x6c\x30\x2e\x39\x35\x2c\x30\x2e\x35\x2c\x76\x26\x0a\x31\x73\x28\x32\x58\x5f\x2c\x59\x5f\x0a\x31\x73\x29\x2a\x76\x28\x2c\x30\x2e\x32\x0a\x31\x73\x2a\x2b\x76\x27\x2c\x76\x29\x0a\x31\x73\x2b\x5d\x76\x2a\x2c\x31\x2c\x31\x0a\x31\x63\x2c\x0a",
+
+	// [2] Wheel with noise spokes
+	"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x30\x2e\x39\x0a\x31\x73\x22\x2a\x41\x5f\x2c\x35\x0a\x31\x73\x23\x2d\x76\x22\x2c\x76\x21\x0a\x31\x73\x24\x73\x76\x23\x0a\x31\x73\x25\x2a\x76\x24\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x24\x2c\x76\x25\x0a\x31\x73\x27\x2d\x31\x2c\x76\x26\x0a\x31\x73\x28\x2a\x59\x5f\x2c\x32\x38\x0a\x31\x73\x29\x2a\x58\x5f\x2c\x39\x0a\x31\x73\x2a\x2b\x76\x29\x2c\x76\x28\x0a\x31\x73\x2b\x2e\x76\x2a\x0a\x31\x73\x2c\x6c\x30\x2e\x37\x2c\x31\x2c\x76\x2b\x0a\x31\x73\x2d\x2a\x76\x24\x2c\x76\x2c\x0a\x31\x73\x2e\x2a\x54\x5f\x2c\x30\x2e\x30\x33\x0a\x31\x73\x2f\x5d\x76\x2e\x2c\x76\x27\x2c\x76\x2d\x0a\x31\x63\x30\x0a",
+
+	// [3] Fast matrix tracers
+	"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x54\x5f\x2c\x31\x2e\x35\x0a\x31\x73\x22\x2a\x50\x5f\x2c\x31\x30\x0a\x31\x73\x23\x2d\x76\x21\x2c\x76\x22\x0a\x31\x73\x24\x2e\x76\x23\x0a\x31\x73\x25\x2d\x31\x2c\x76\x24\x0a\x31\x73\x26\x2a\x76\x25\x2c\x76\x25\x0a\x31\x73\x27\x2a\x76\x26\x2c\x76\x26\x0a\x31\x73\x28\x2d\x31\x2c\x76\x27\x0a\x31\x73\x29\x5a\x30\x2e\x39\x2c\x31\x0a\x31\x73\x2a\x2a\x76\x25\x2c\x76\x29\x0a\x31\x73\x2b\x2a\x76\x2a\x2c\x30\x2e\x32\x35\x0a\x31\x73\x2c\x71\x76\x2b\x0a\x31\x73\x2d\x2a\x54\x5f\x2c\x30\x2e\x30\x32\x0a\x31\x73\x2e\x5d\x76\x2d\x2c\x76\x28\x2c\x76\x2c\x0a\x31\x63\x2f\x0a",
+
+	// [4] Color pinwheel
+	"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x41\x5f\x2c\x31\x0a\x31\x73\x22\x2b\x76\x21\x2c\x54\x5f\x0a\x31\x73\x23\x2e\x76\x22\x0a\x31\x73\x24\x5d\x76\x23\x2c\x31\x2c\x31\x0a\x31\x63\x25\x0a",
+
+	// [5] Atari color cycling
+	"\x31\x63\x21\x0a\x31\x67\x43\x7f\x0a\x31\x73\x21\x2a\x59\x5f\x2c\x39\x39\x0a\x31\x73\x22\x2a\x58\x5f\x2c\x76\x21\x0a\x31\x73\x23\x2a\x59\x5f\x2c\x39\x37\x0a\x31\x73\x24\x2a\x59\x5f\x2c\x76\x23\x0a\x31\x73\x25\x2a\x59\x5f\x2c\x76\x24\x0a\x31\x73\x26\x32\x76\x22\x2c\x76\x25\x0a\x31\x73\x27\x2a\x54\x5f\x2c\x31\x0a\x31\x73\x28\x2a\x76\x26\x2c\x33\x0a\x31\x73\x29\x2b\x76\x28\x2c\x76\x27\x0a\x31\x73\x2a\x74\x76\x29\x0a\x31\x73\x2b\x25\x76\x29\x2c\x31\x36\x0a\x31\x73\x2c\x5f\x76\x2b\x0a\x31\x73\x2d\x2f\x76\x2c\x2c\x31\x36\x0a\x31\x73\x2e\x6c\x31\x2c\x30\x2e\x36\x2c\x76\x2a\x0a\x31\x73\x2f\x3d\x76\x2d\x0a\x31\x73\x30\x3f\x76\x2f\x2c\x30\x2c\x76\x2e\x0a\x31\x73\x31\x5d\x76\x2d\x2c\x76\x30\x2c\x76\x2a\x0a\x31\x63\x32\x0a",
+
+	// [6] Pride flag (rainbow)
+	"\x31\x63\x21\x0a\x31\x67\x47\x7f\x0a\x31\x73\x21\x2a\x58\x5f\x2c\x32\x2e\x32\x0a\x31\x73\x22\x2a\x54\x5f\x2c\x31\x2e\x33\x0a\x31\x73\x23\x2b\x76\x22\x2c\x76\x21\x0a\x31\x73\x24\x71\x76\x23\x0a\x31\x73\x25\x2a\x58\x5f\x2c\x31\x2e\x34\x31\x34\x0a\x31\x73\x26\x2a\x54\x5f\x2c\x30\x2e\x37\x0a\x31\x73\x27\x2b\x76\x26\x2c\x76\x25\x0a\x31\x73\x28\x71\x76\x27\x0a\x31\x73\x29\x2d\x76\x24\x2c\x76\x28\x0a\x31\x73\x2a\x2a\x76\x29\x2c\x30\x2e\x30\x39\x0a\x31\x73\x2b\x2b\x59\x5f\x2c\x76\x2a\x0a\x31\x73\x2c\x2a\x76\x2b\x2c\x36\x0a\x31\x73\x2d\x5f\x76\x2c\x0a\x31\x73\x2e\x2f\x76\x2d\x2c\x36\x0a\x31\x73\x2f\x78\x76\x2e\x2c\x30\x2c\x30\x2e\x38\x33\x33\x33\x33\x0a\x31\x73\x30\x3c\x76\x2f\x2c\x30\x2e\x36\x0a\x31\x73\x31\x2d\x76\x2f\x2c\x30\x2e\x31\x36\x36\x36\x36\x37\x0a\x31\x73\x32\x3f\x76\x30\x2c\x76\x31\x2c\x76\x2f\x0a\x31\x73\x33\x3c\x76\x32\x2c\x30\x2e\x32\x0a\x31\x73\x34\x2b\x76\x32\x2c\x30\x2e\x31\x36\x36\x36\x36\x37\x0a\x31\x73\x35\x2f\x76\x34\x2c\x32\x0a\x31\x73\x36\x3f\x76\x33\x2c\x76\x35\x2c\x76\x32\x0a\x31\x73\x37\x5d\x76\x36\x2c\x31\x2c\x31\x0a\x31\x63\x38\x0a",
+
+	// [7] Purple radiation from upper-left corner
+	"\x37\x63\x21\x0a\x37\x67\x43\x7f\x0a\x37\x73\x21\x2a\x58\x5f\x2c\x58\x5f\x0a\x37\x73\x22\x2a\x59\x5f\x2c\x59\x5f\x0a\x37\x73\x23\x2b\x76\x21\x2c\x76\x22\x0a\x37\x73\x24\x2a\x76\x23\x2c\x33\x2e\x33\x0a\x37\x73\x25\x2a\x54\x5f\x2c\x30\x2e\x34\x35\x0a\x37\x73\x26\x2d\x76\x24\x2c\x76\x25\x0a\x37\x73\x27\x71\x76\x26\x0a\x37\x73\x28\x5a\x30\x2c\x30\x2e\x30\x31\x0a\x37\x73\x29\x30\x76\x28\x0a\x37\x73\x2a\x71\x76\x29\x0a\x37\x73\x2b\x6c\x30\x2e\x38\x2c\x31\x2c\x76\x2a\x0a\x37\x73\x2c\x2a\x54\x5f\x2c\x30\x2e\x30\x33\x0a\x37\x73\x2d\x74\x76\x2c\x0a\x37\x73\x2e\x6c\x30\x2e\x37\x35\x2c\x30\x2e\x39\x31\x36\x36\x36\x37\x2c\x76\x2d\x0a\x37\x73\x2f\x5d\x76\x2e\x2c\x76\x2b\x2c\x76\x27\x0a\x37\x63\x30\x0a",
+};
 
 #endif
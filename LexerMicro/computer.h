@@ -5,25 +5,97 @@
 #include <stdbool.h>
 #include <math.h>
 #include <OctoWS2811.h>
+#include <EEPROM.h>
+#include "fixed.h"
+#include "fastmath.h"
 #include "led_layout.h"
+#include "timesync.h"
+#include "linkrate.h"
 
-#define MAX_LINE_LEN       (32)
+#define MAX_LINE_LEN       (128)	// Binary frames carry several steps
 #define MAX_STEPS          (50)
 #define ARG_COUNT          (3)
 #define STATION_COUNT      (8)
 #define ACCUMULATOR_COUNT  (1)
-#define NOISE_SIZE         (16)
+#define NOISE_SIZE         (16)	// Power of 2
+#define LED_CACHE_COUNT    (8)
 
 #define DEFAULT_GAMMA      (true)
 #define DEFAULT_BRIGHT     (255)
+#if FIXED_POINT
+#define VTIME_WRAP_MILLIS  (1UL << 24)	// vTime starts over: 4.7 hours. Q16.16 ends at 32768 s.
+#endif
 
 #define DEBUG_STATE        (false)
 #define SERIAL_PRINT_RUN   (false)
 
+// Per-step profiler: Count the cycles spent in each step, and report
+// them for a 'p' line (see send_profile()). Reads the DWT cycle
+// counter around every step, so leave this off unless profiling.
+// Off, the profiler compiles out, and 'p' lines are ignored.
+#ifndef PROFILE_STEPS
+#define PROFILE_STEPS      (false)
+#endif
+
+// Telemetry record, sent over USB for a 'q' line. See send_telemetry().
+#define TELEMETRY_MAGIC0   (0xff)
+#define TELEMETRY_MAGIC1   ('Q')
+#define TELEMETRY_SIZE     (67)	// Whole record: magic, payload, checksum
+#define PROFILE_MAGIC1     ('P')
+
+// Binary program frames ('B' lines): See serial_read_frame()
+#define FRAME_VERSION      (1)
+#define FRAME_ESC          (0x1b)	// Escapes '\n' and itself: ESC, byte ^ 0x20
+#define FRAME_ESC_XOR      (0x20)
+#define FRAME_HEADER_SIZE  (3)	// version, first step, step count
+#define FRAME_CRC_SIZE     (2)
+#define FRAME_FULL_FLOATS  (0x40)	// Kinds byte: constants are 4 byte floats, not 2
+#define FRAME_RAW_FIXED    (0x80)	// Kinds byte: constants are 4 byte Q16.16 (see frame_write_step())
+#define FRAME_STEP_MAX     (2 + ARG_COUNT * 4)	// op, kinds, operands
+
+// Program store (EEPROM): See store_save()
+#define STORE_SIZE         (2048)	// Teensy 3.2
+#define STORE_SLOTS        (4)
+#define STORE_PLAYLIST_MAX (8)
+
+// Program cache (RAM): See cache_insert()
+#define CACHE_PROGRAMS     (4)
+#define CACHE_POOL_SIZE    (768)	// Bytes, shared by the entries. Attract programs take 20-130.
+
+// Execution engine for computer_run():
+//   false: call through ops[], one function per step
+//   true:  decode steps into insts[], run them in one tight loop
+#ifndef THREADED_ENGINE
+#define THREADED_ENGINE    (false)
+#endif
+
+// Lane engine: Run each step for a block of LANE_WIDTH LEDs,
+// then the next step. See run_lanes().
+#ifndef LANE_ENGINE
+#define LANE_ENGINE        (false)
+#endif
+
+#define LANE_WIDTH         (16)
+#define LANE_INPUT_COUNT   (3 + LED_CACHE_COUNT)	// X, Y, A, led_cache[]
+
+// noise[] cell size: 16 bits (8 KB) or 8 bits (4 KB)
+#ifndef NOISE_CELL_BITS
+#define NOISE_CELL_BITS    (16)
+#endif
+
+// Hashed noise: No noise[] at all. Each lookup hashes the octave
+// lattice instead, which is slower. For boards short on RAM.
+#ifndef NOISE_HASH
+#define NOISE_HASH         (false)
+#endif
+
 // Shortcuts for operator functions
-#define f0                 (f(0))
-#define f1                 (f(1))
-#define f2                 (f(2))
+#define f0                 (arg_value<K0>(&compute_arg0[0]))
+#define f1                 (arg_value<K1>(&compute_arg0[1]))
+#define f2                 (arg_value<K2>(&compute_arg0[2]))
+
+// Operator functions are specialized on the kind of each argument
+#define OP_KINDS           template <ArgType K0, ArgType K1, ArgType K2>
 
 #define true_f             (1.0f)
 #define false_f            (0.0f)
@@ -34,12 +106,12 @@
 #define randf()    (random(0xffffff) * (1.0f / 0xffffff))
 #endif
 
-typedef enum {
-	k_line_ok = 0,
-	k_line_first_byte,
-	k_line_end,
-	k_line_do_not_share
-} LineResult;
+// Random Num in 0..1
+#if FIXED_POINT
+#define randn()    (Fixed::from_raw(random(FIXED_ONE)))
+#else
+#define randn()    (randf())
+#endif
 
 typedef enum {
 	k_blink_off = 0,
@@ -48,28 +120,130 @@ typedef enum {
 	k_blink_station_id = 3
 } BlinkType;
 
+// How a station is doing. Sent with send_telemetry(). The run
+// stats (min/max/avg) cover the frames since the last report.
+typedef struct {
+	uint32_t run_last;	// micros: computer_run()
+	uint32_t run_min;
+	uint32_t run_max;
+	uint32_t run_total;	// For the average
+	uint32_t run_frames;
+	uint32_t show_micros;	// show(), last frame
+	uint16_t fps_x100;	// Measured FPS * 100
+	uint32_t bytes_received;	// USB and upstream
+	uint32_t bytes_forwarded;	// Written downstream
+	uint32_t bytes_dropped;	// Lines too long for the buffer
+	uint16_t line_errors;	// serial_error() calls
+	uint32_t usb_overflows;	// Pump passes cut short: parse queue full (see ring.h)
+	uint32_t upstream_overflows;
+	uint16_t backlog_max;	// Most bytes waiting to be parsed
+	uint16_t cache_hits;	// 'a' lines: Program was cached
+	uint16_t cache_misses;	// Wasn't: Kept the old one
+} Telemetry;
+
+// Operand kinds in binary frames, 2 bits per arg
+typedef enum {
+	k_operand_zero = 0,
+	k_operand_step = 1,	// varint: step number
+	k_operand_var = 2,	// byte: index into FRAME_VARS
+	k_operand_const = 3	// half float, or float with FRAME_FULL_FLOATS
+} OperandKind;
+
 typedef enum {
-	k_float,
-	k_float_ptr,
-	k_array_of_floats
+	k_float = 0,
+	k_float_ptr = 1,
+	k_array_of_floats = 2,
+	k_arg_type_count = 3
 } ArgType;
 
+// What a step's result depends on. See plan_program().
+typedef enum {
+	k_dep_const = 0,
+	k_dep_frame = 0x1,	// T, S, C: changes once per frame (at most)
+	k_dep_led = 0x2,	// X, Y, A, I, P: changes for every LED
+	k_dep_state = 0x4	// rand, accum0, LED output, stale values: never hoist
+} StepDep;
+
 typedef struct arg {
 	union {
-		float f;
-		float * fp;
+		Num f;
+		const Num * fp;
 	};
 	ArgType type;
 } Arg;
 
 // Gamma + brightness LUT
 uint8_t lut[256];
+bool gamma_on = DEFAULT_GAMMA;	// What lut[] was built from, for store_save()
+uint8_t brightness = DEFAULT_BRIGHT;
 BlinkType blink_type = k_blink_60th_frame;
 
+typedef Num (*OpFn)();
+
+// Decoded step, for the threaded engine
+typedef struct {
+	const Num * src[ARG_COUNT];
+	uint16_t mask[ARG_COUNT];	// LED index mask: 0 for one value, 0xffff for per-LED arrays
+	uint8_t code;	// op char
+	uint8_t dst;	// values[] index
+} Inst;
+
+// Step for the lane engine. Each src is one value, or a row of
+// LANE_WIDTH values (see lane_mask).
+typedef struct {
+	const Num * src[ARG_COUNT];
+	Num * dst;	// lanes[] row
+} LaneStep;
+
+typedef void (*LaneFn)(const LaneStep * step, uint8_t n);
+
+// Program slot: Steps as received. 's' lines fill the upload
+// slot, and a commit ('c' line) swaps it with the live one, so
+// frames never run a half-received program.
+typedef struct {
+	Arg args[MAX_STEPS][ARG_COUNT];
+	uint8_t op_codes[MAX_STEPS];	// Op chars, as received
+	uint32_t step_hashes[MAX_STEPS];	// line_hash of each 's' line, for the commit checksum
+	uint8_t step_count;
+} Program;
+
+Program programs[2];
+Program * program = &programs[0];	// Live: What plan_program() reads
+Program * upload = &programs[1];
+bool upload_written = false;	// Since the last commit. A 'c' without new steps does nothing.
+
 // Reference machine (virtual computer instructions)
-float (*ops[MAX_STEPS])();
-Arg args[MAX_STEPS][ARG_COUNT];
-float values[MAX_STEPS];	// Computed values
+OpFn ops[MAX_STEPS];	// Specialized for run_args[], see plan_program()
+Num values[MAX_STEPS];	// Computed values
+
+// Execution plan, rebuilt when the program or layout changes.
+// Frame-invariant steps run once per frame, the rest run per LED.
+// LED-invariant steps run once per plan, into led_cache[].
+bool program_dirty = true;
+uint8_t step_deps[MAX_STEPS];	// StepDep bits
+int8_t step_cache[MAX_STEPS];	// led_cache[] slot, or -1
+uint8_t run_codes[MAX_STEPS];	// op_codes, or fused ops (see fuse_steps)
+Arg run_args[MAX_STEPS][ARG_COUNT];	// args, with cached steps read from led_cache[]
+bool fusion_enabled = true;	// Peephole pass in plan_program()
+uint8_t frame_steps[MAX_STEPS];
+uint8_t frame_step_count = 0;
+uint8_t led_steps[MAX_STEPS];
+uint8_t led_step_count = 0;
+Inst insts[MAX_STEPS];	// frame_steps, then led_steps (THREADED_ENGINE)
+
+// Lane engine state (LANE_ENGINE): values[step][LED], one block
+// of LEDs at a time, so memory stays at MAX_STEPS * LANE_WIDTH.
+bool lanes_enabled = true;	// Use the lane engine, when the plan allows it
+bool lanes_ok = false;	// This plan can run in lanes, see plan_lanes()
+LaneStep lane_steps[MAX_STEPS];	// led_steps, decoded
+LaneFn lane_ops[MAX_STEPS];
+Num lanes[MAX_STEPS][LANE_WIDTH];	// Step values, per LED in the block
+Num lane_inputs[LANE_INPUT_COUNT][LANE_WIDTH];	// Per-LED arrays, gathered
+const Num * lane_input_src[LANE_INPUT_COUNT];
+uint8_t lane_input_count = 0;
+Num lane_index[LANE_WIDTH];	// vLEDIndex, per LED in the block
+Num lane_ratio[LANE_WIDTH];	// vLEDRatio
+uint16_t lane_leds[LANE_WIDTH];	// computeLED of each lane
 
 // Incoming data lines
 
@@ -87,24 +261,82 @@ int8_t step_idx = 0;
 Arg * current_arg = NULL;
 float float_dec = 1.0f;
 uint8_t buf[2];
+uint32_t line_hash = 0;	// FNV-1a of the line being processed, without lifespan and newline
+uint8_t line_lifespan = '0';	// Of the line being processed
+uint32_t line_arrival_micros = 0;	// When its newline arrived, if known (see queue_drain())
+bool line_arrival_known = false;
+uint8_t commit_count = 0;
+uint32_t commit_checksum = 0;
+uint8_t commit_digits = 0;
+uint8_t frame_buf[MAX_LINE_LEN];	// Binary frame, unescaped
+uint8_t frame_len = 0;
+bool frame_escape = false;
+uint32_t sync_ref = 0;	// 'y' line: Station 0's time
+uint8_t sync_digits = 0;
+uint8_t link_type = 0;	// 'n', 'v' or 'k' line
+uint8_t link_buf[LINK_LINE_MAX];
+uint8_t link_len = 0;
+uint8_t store_op = 0;	// 'w' or 'r' line
 
 // Global vars, received as bytes over serial
 uint8_t station_id = 0xff;	// set with set_station_id() plz
-uint8_t step_count = 0;
 OctoWS2811 * _leds;
+Telemetry telemetry;
+
+#if PROFILE_STEPS
+// Cycles per step, summed over profile_frames. Fused steps count
+// as the step that holds the fused op. Cached steps run in
+// plan_program(), so they cost nothing per frame.
+uint64_t profile_sums[MAX_STEPS];
+uint32_t profile_frames = 0;
+#endif
 
-// LED layout
-bool does_led_exist[LED_COUNT];
-float led_x[LED_COUNT];
-float led_y[LED_COUNT];
-float led_local_angle[LED_COUNT];
-
-// Special vars, floats set at runtime
-float vTime = 0.0f;	// in seconds
-float vStationID = 0.0f;
-float vLEDIndex = 0.0f;
-float vLEDRatio = 0.0f;
-float vLEDCount = (float)(LED_COUNT);
+// LED layout: Only LEDs that exist, packed. Points into the
+// station's flash tables (STATION_LAYOUTS). Per-LED arrays (accum,
+// led_cache, ...) are indexed the same way, and computeLED counts
+// 0..led_count-1.
+uint16_t led_count = 0;
+const uint16_t * led_strip = NULL;
+const Num * led_vars[k_layout_var_count];	// X, Y, A, GX, ...: see LayoutVar
+
+// Special vars, set at runtime
+Num vTime = 0.0f;	// in seconds
+TimeSync time_sync;	// vTime in millis. vTime is rebuilt from this every frame, so it doesn't drift
+LinkRate link_rate;	// Ring baud rate. LexerMicro.ino switches RINGSERIAL to match.
+
+// Programs from the store, in turn. See playlist_update().
+typedef struct {
+	uint8_t slots[STORE_PLAYLIST_MAX];
+	uint8_t count;	// 0: Off
+	uint16_t seconds;	// Per program
+	uint8_t current;	// Index loaded, or STORE_PLAYLIST_MAX for none
+	bool paused;	// Something else was loaded
+} Playlist;
+
+Playlist playlist;
+Playlist playlist_in;	// 'l' line, as it's parsed
+uint8_t playlist_digits = 0;
+
+// Recent programs, by commit checksum. Steps are kept as
+// frame_write_step() writes them: No frame headers or CRCs. They
+// share cache_pool[], packed from the start in no particular order.
+typedef struct {
+	uint32_t hash;	// upload_checksum() when it was committed
+	uint32_t used;	// cache_clock: Least recent goes first. 0: Empty.
+	uint16_t start;	// In cache_pool[]
+	uint16_t len;
+	uint8_t step_count;
+} CacheEntry;
+
+CacheEntry program_cache[CACHE_PROGRAMS];
+uint8_t cache_pool[CACHE_POOL_SIZE];
+uint32_t cache_clock = 0;
+
+static_assert(CACHE_POOL_SIZE >= MAX_STEPS * FRAME_STEP_MAX, "Any one program fits the cache");
+Num vStationID = 0.0f;
+Num vLEDIndex = 0.0f;
+Num vLEDRatio = 0.0f;
+Num vLEDCount = LED_COUNT;
 uint16_t computeLED = 0;
 
 //
@@ -114,6 +346,7 @@ uint16_t computeLED = 0;
 void serial_line_start(uint8_t x);
 void serial_read_data_type(uint8_t x);
 void serial_read_step_count(uint8_t x);
+void serial_read_commit_checksum(uint8_t x);
 void serial_read_step_number(uint8_t x);
 void serial_read_op(uint8_t x);
 void serial_arg_start(uint8_t x);
@@ -123,8 +356,19 @@ void serial_arg_complete(uint8_t x);
 void serial_read_gamma_start(uint8_t x);
 void serial_read_gamma_end(uint8_t x);
 void serial_read_blink(uint8_t x);
+void serial_read_frame(uint8_t x);
+void serial_read_sync(uint8_t x);
+void serial_read_link(uint8_t x);
+void serial_read_store_slot(uint8_t x);
+void serial_read_playlist(uint8_t x);
+void serial_read_activate(uint8_t x);
+void cache_insert(uint32_t hash);
 void serial_error();
 void serial_wait_for_newline(uint8_t x);
+void send_telemetry();
+#if PROFILE_STEPS
+void send_profile();
+#endif
 
 //
 // PERSISTENT STATE
@@ -137,20 +381,68 @@ void set_station_id(uint8_t x) {
 	station_id = x;
 	vStationID = (float)station_id;
 
-	// Optimization: Do not compute LEDs which do not
-	// physically exist on the strand.
-	// Clear does_led_exist[] before setting layout.
-	for (uint16_t i = 0; i < LED_COUNT; i++) {
-		does_led_exist[i] = false;
+	// Optimization: Only list LEDs which physically exist
+	// on the strand. Decoded at compile time.
+	const StationLayout * layout = &STATION_LAYOUTS[station_id];
+
+	// X, Y, A, ... operands point at the old station's tables
+	for (uint8_t s = 0; s < MAX_STEPS * 2; s++) {
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			Arg * arg = &programs[s / MAX_STEPS].args[s % MAX_STEPS][a];
+			if (arg->type != k_array_of_floats) continue;
+
+			for (uint8_t v = 0; v < k_layout_var_count; v++) {
+				if (arg->fp == led_vars[v]) {
+					arg->fp = layout->vars[v];
+					break;
+				}
+			}
+		}
+	}
+
+	led_count = layout->count;
+	led_strip = layout->strip;
+
+	for (uint8_t v = 0; v < k_layout_var_count; v++) {
+		led_vars[v] = layout->vars[v];
 	}
 
-	led_layout_set_all(station_id, does_led_exist, led_x, led_y, led_local_angle);
+	// LED-invariant steps must be recomputed
+	program_dirty = true;
+}
+
+Num accum[ACCUMULATOR_COUNT][LED_COUNT];
+Num led_cache[LED_CACHE_COUNT][LED_COUNT];
+
+// vTime, after time_sync.millis jumps. Under FIXED_POINT it wraps
+// to 0 every VTIME_WRAP_MILLIS, on every station at once (it comes
+// from the synced clock), so Q16.16 never overflows. That divides
+// 2^32, so millis rolling over is just another wrap.
+Num vtime_from_millis(uint32_t millis) {
+#if FIXED_POINT
+	millis &= VTIME_WRAP_MILLIS - 1;
+	return Fixed::from_raw(((int64_t)millis * FIXED_ONE) / 1000);
+#else
+	// One rounding. A float is good to 1 ms for the first two
+	// hours, and coarser after that, but never jumps.
+	return (float)(millis / 1000) + (millis % 1000) * (1.0f / 1000.0f);
+#endif
+}
+
+void set_vtime_from_millis() {
+	vTime = vtime_from_millis(time_sync.millis);
 }
 
-float accum[ACCUMULATOR_COUNT][LED_COUNT];
+// Once per frame: Advance the synced clock, and rebuild vTime from
+// it. (Adding up float seconds instead would drift away from it.)
+void vtime_advance(TimeSync * ts, Num * v, uint32_t elapsedMillis, uint32_t now) {
+	time_sync_advance(ts, elapsedMillis, now);
+	*v = vtime_from_millis(ts->millis);
+}
 
 void reset_time_and_accumulators() {
 	vTime = 0.0f;
+	time_sync_reset(&time_sync, micros());
 
 	for (uint8_t a = 0; a < ACCUMULATOR_COUNT; a++) {
 		for (uint16_t i = 0; i < LED_COUNT; i++) {
@@ -159,88 +451,172 @@ void reset_time_and_accumulators() {
 	}
 }
 
-float noise[NOISE_SIZE][NOISE_SIZE][NOISE_SIZE];
+//
+//  NOISE
+//
+//  The volume is a sum of octaves. Each octave has random values
+//  on a lattice, `step` cells apart, interpolated in between.
+//  Larger octaves are louder: Their values are 0..step.
+//  Lattice values come from noise_hash(), so no octave needs a
+//  table of its own.
+//
+
+#define NOISE_OCTAVE_MAX   (NOISE_SIZE - 1)	// 1 + 2 + 4 + 8: Largest possible sum
+
+uint32_t noise_seed = 0;
+
+inline uint32_t noise_hash(uint32_t a) {
+	a ^= a >> 16;
+	a *= 0x7feb352d;
+	a ^= a >> 15;
+	a *= 0x846ca68b;
+	a ^= a >> 16;
+	return a;
+}
+
+// Lattice value: 0..1
+inline Num noise_lattice(uint8_t octave, uint8_t i, uint8_t j, uint8_t k) {
+	uint32_t h = noise_hash(noise_seed ^ ((uint32_t)octave << 24) ^ ((uint32_t)i << 16) ^ ((uint32_t)j << 8) ^ k);
+
+#if FIXED_POINT
+	return Fixed::from_raw(h >> 16);
+#else
+	return (h >> 8) * (1.0f / 0xffffff);
+#endif
+}
+
+// Octave sum at (x, y, z), each 0..NOISE_SIZE. The result is
+// 0..NOISE_OCTAVE_MAX, not normalized. Dims: How many coordinates
+// are used; the others are 0.
+template <uint8_t Dims>
+Num noise_octaves(Num x, Num y, Num z) {
+	Num sum = 0.0f;
+	uint8_t octave = 0;
+
+	for (uint8_t step = 1; step < NOISE_SIZE; step *= 2) {
+		uint8_t mask = NOISE_SIZE / step - 1;	// Lattice wraps around
+
+		uint8_t i0 = num_int(x) & mask;
+		uint8_t i1 = (i0 + 1) & mask;
+		Num xp = x - floor(x);
+
+		uint8_t j0 = num_int(y) & mask;
+		uint8_t j1 = (j0 + 1) & mask;
+		Num yp = y - floor(y);
+
+		uint8_t k0 = num_int(z) & mask;
+		uint8_t k1 = (k0 + 1) & mask;
+		Num zp = z - floor(z);
+
+		Num v = lerp(noise_lattice(octave, i0, j0, k0), noise_lattice(octave, i1, j0, k0), xp);
+
+		if (Dims >= 2) {
+			Num v1 = lerp(noise_lattice(octave, i0, j1, k0), noise_lattice(octave, i1, j1, k0), xp);
+			v = lerp(v, v1, yp);
+		}
+
+		if (Dims >= 3) {
+			Num v2 = lerp(noise_lattice(octave, i0, j0, k1), noise_lattice(octave, i1, j0, k1), xp);
+			Num v3 = lerp(noise_lattice(octave, i0, j1, k1), noise_lattice(octave, i1, j1, k1), xp);
+			v = lerp(v, lerp(v2, v3, yp), zp);
+		}
+
+		sum += v * step;
+
+		// Next octave's lattice coordinates
+		x = x * 0.5f;
+		y = y * 0.5f;
+		z = z * 0.5f;
+		octave++;
+	}
+
+	return sum;
+}
+
+#if !NOISE_HASH
+
+#if NOISE_CELL_BITS == 8
+typedef uint8_t NoiseCell;
+#else
+typedef uint16_t NoiseCell;
+#endif
+
+#define NOISE_CELL_MAX     ((NoiseCell)~0)
+
+// Quantized: 0..NOISE_CELL_MAX is 0..1
+NoiseCell noise[NOISE_SIZE][NOISE_SIZE][NOISE_SIZE];
+
+inline Num noise_at(uint8_t i, uint8_t j, uint8_t k) {
+#if FIXED_POINT
+	return Fixed::from_raw((int32_t)noise[i][j][k] * (0xffff / NOISE_CELL_MAX));
+#else
+	return noise[i][j][k] * (1.0f / NOISE_CELL_MAX);
+#endif
+}
 
 void reroll_noise() {
-	// Noisiest, quietest octave: Just use randf() values.
+	noise_seed = ((uint32_t)random(0x10000) << 16) | random(0x10000);
+
+	// Sum the octaves into noise[], one at a time. Each octave
+	// adds at most step * unit, so the sum can't overflow a cell.
+	float unit = (float)NOISE_CELL_MAX / NOISE_OCTAVE_MAX;
+
+	// Noisiest, quietest octave: One lattice value per cell
 	for (uint8_t i = 0; i < NOISE_SIZE; i++) {
 		for (uint8_t j = 0; j < NOISE_SIZE; j++) {
 			for (uint8_t k = 0; k < NOISE_SIZE; k++) {
-				noise[i][j][k] = randf();
+				noise[i][j][k] = (NoiseCell)(num_float(noise_lattice(0, i, j, k)) * unit);
 			}
 		}
 	}
 
-	// Larger octaves (with interpolated values) get
-	// progressively "louder" (stronger magnitude).
-	for (uint8_t step = 2; step < NOISE_SIZE; step *= 2) {
-		float step_f = (float)(step);
-		float invStep = 1.0f / step_f;
+	uint8_t octave = 1;
 
+	for (uint8_t step = 2; step < NOISE_SIZE; step *= 2) {
+		float invStep = 1.0f / step;
+		float magnitude = step * unit;
 		uint8_t sz = NOISE_SIZE / step;
-		float table[sz][sz][sz];
-
-		for (uint8_t i = 0; i < sz; i++) {
-			for (uint8_t j = 0; j < sz; j++) {
-				for (uint8_t k = 0; k < sz; k++) {
-					// Lower octaves are "louder" (stronger magnitude)
-					table[i][j][k] = randf() * step_f;
-				}
-			}
-		}
-
-		/*
-		uint8_t offset_i = random(NOISE_SIZE);
-		uint8_t offset_j = random(NOISE_SIZE);
-		uint8_t offset_k = random(NOISE_SIZE);
-		*/
 
-		// FIXME ? Does 1D and 2D noise look better when
-		//         waveforms are snapped to [0,0,0] ?
-		uint8_t offset_i = 0;
-		uint8_t offset_j = 0;
-		uint8_t offset_k = 0;
-
-		// table values are chosen. Interpolate this octave
-		// of noise, add onto noise buffer.
-		// Get ready for some ugly nested code:
+		// Each lattice cell: Interpolate between its 8 corners
 		for (uint8_t i = 0; i < sz; i++) {
-			uint8_t i0 = i;
-			uint8_t i1 = (i0 + 1) % sz;
+			uint8_t i1 = (i + 1) % sz;
 
 			for (uint8_t j = 0; j < sz; j++) {
-				uint8_t j0 = j;
-				uint8_t j1 = (j0 + 1) % sz;
+				uint8_t j1 = (j + 1) % sz;
 
 				for (uint8_t k = 0; k < sz; k++) {
-					uint8_t k0 = k;
-					uint8_t k1 = (k0 + 1) % sz;
+					uint8_t k1 = (k + 1) % sz;
+
+					float c000 = num_float(noise_lattice(octave, i, j, k));
+					float c100 = num_float(noise_lattice(octave, i1, j, k));
+					float c010 = num_float(noise_lattice(octave, i, j1, k));
+					float c110 = num_float(noise_lattice(octave, i1, j1, k));
+					float c001 = num_float(noise_lattice(octave, i, j, k1));
+					float c101 = num_float(noise_lattice(octave, i1, j, k1));
+					float c011 = num_float(noise_lattice(octave, i, j1, k1));
+					float c111 = num_float(noise_lattice(octave, i1, j1, k1));
 
-					// Set noise[][][] values
 					for (uint8_t iN = 0; iN < step; iN++) {
-						float ip = iN * invStep;	// lerp
-						uint8_t ic = (i * sz + iN + offset_i) % NOISE_SIZE;	// noise[] index
+						float ip = iN * invStep;
 
 						// Lerp values across i dimension
-						float iv0 = lerp(table[i0][j0][k0], table[i1][j0][k0], ip);
-						float iv1 = lerp(table[i0][j1][k0], table[i1][j1][k0], ip);
-						float iv2 = lerp(table[i0][j0][k1], table[i1][j0][k1], ip);
-						float iv3 = lerp(table[i0][j1][k1], table[i1][j1][k1], ip);
+						float iv0 = lerp(c000, c100, ip);
+						float iv1 = lerp(c010, c110, ip);
+						float iv2 = lerp(c001, c101, ip);
+						float iv3 = lerp(c011, c111, ip);
 
 						for (uint8_t jN = 0; jN < step; jN++) {
-							float jp = jN * invStep;	// lerp
-							uint8_t jc = (j * sz + jN + offset_j) % NOISE_SIZE;	// noise[] index
+							float jp = jN * invStep;
 
 							// Lerp i-values across the j dimension
 							float jv0 = lerp(iv0, iv1, jp);
 							float jv1 = lerp(iv2, iv3, jp);
 
-							for (uint8_t kN = 0; kN < step; kN++) {
-								float kp = kN * invStep;	// lerp
-								uint8_t kc = (k * sz + kN + offset_k) % NOISE_SIZE;	// noise[] index
+							NoiseCell * cell = &noise[i * step + iN][j * step + jN][k * step];
 
-								// Lerp ij-values across the k dimension
-								noise[ic][jc][kc] += lerp(jv0, jv1, kp);
+							// Lerp ij-values across the k dimension
+							for (uint8_t kN = 0; kN < step; kN++) {
+								cell[kN] += (NoiseCell)(lerp(jv0, jv1, kN * invStep) * magnitude);
 							}
 						}
 					}
@@ -248,57 +624,77 @@ void reroll_noise() {
 				}
 			}
 		}
+
+		octave++;
 	}
 
-	// Normalize between 0..1
-	float _min = 9999.0f;
-	float _max = -9999.0f;
+	// Normalize: Stretch to 0..NOISE_CELL_MAX
+	NoiseCell * cells = &noise[0][0][0];
+	uint32_t cellCount = NOISE_SIZE * NOISE_SIZE * NOISE_SIZE;
 
-	for (uint8_t i = 0; i < NOISE_SIZE; i++) {
-		for (uint8_t j = 0; j < NOISE_SIZE; j++) {
-			for (uint8_t k = 0; k < NOISE_SIZE; k++) {
-				_min = min(_min, noise[i][j][k]);
-				_max = max(_max, noise[i][j][k]);
-			}
-		}
+	NoiseCell _min = NOISE_CELL_MAX;
+	NoiseCell _max = 0;
+
+	for (uint32_t c = 0; c < cellCount; c++) {
+		_min = min(_min, cells[c]);
+		_max = max(_max, cells[c]);
+	}
+
+	uint32_t range = max(_max - _min, 1);
+
+	for (uint32_t c = 0; c < cellCount; c++) {
+		cells[c] = ((uint32_t)(cells[c] - _min) * NOISE_CELL_MAX) / range;
 	}
+}
+
+#else
+
+// Normalize: (noise_octaves() - noise_min) * noise_mult is 0..1
+Num noise_min = 0.0f;
+Num noise_mult = 1.0f;
+
+void reroll_noise() {
+	noise_seed = ((uint32_t)random(0x10000) << 16) | random(0x10000);
 
-	float mult = 1.0f / (_max - _min);
+	Num _min = NOISE_OCTAVE_MAX;
+	Num _max = 0.0f;
 
 	for (uint8_t i = 0; i < NOISE_SIZE; i++) {
 		for (uint8_t j = 0; j < NOISE_SIZE; j++) {
 			for (uint8_t k = 0; k < NOISE_SIZE; k++) {
-				noise[i][j][k] = (noise[i][j][k] - _min) * mult;
+				Num v = noise_octaves<3>(i, j, k);
+				_min = min(_min, v);
+				_max = max(_max, v);
 			}
 		}
 	}
 
+	noise_min = _min;
+	noise_mult = Num(1.0f) / (_max - _min);
 }
 
+#endif
+
 //
 //  OPERATIONS
 //
 
 Arg * compute_arg0 = NULL;
 
-inline float f(uint8_t idx)
-{
-	Arg * arg = &compute_arg0[idx];
-
-	if (arg->type == k_float_ptr) {
-		return (*(arg->fp));
-
-	} else if (arg->type == k_array_of_floats) {
-		return arg->fp[computeLED];
-	}
+// Argument fetch, resolved at compile time (see OP_KINDS)
+template <ArgType K> inline Num arg_value(Arg * arg);
+template <> inline Num arg_value<k_float>(Arg * arg) { return arg->f; }
+template <> inline Num arg_value<k_float_ptr>(Arg * arg) { return *(arg->fp); }
+template <> inline Num arg_value<k_array_of_floats>(Arg * arg) { return arg->fp[computeLED]; }
 
-	return arg->f;
-}
+// Each op is a kernel on plain Nums: _add(), _sin(), etc.
+// Every engine calls the same kernels, so they all agree
+// on the output, to the bit.
 
-float op_add() { return f0 + f1; }
-float op_subtract() { return f0 - f1; }
-float op_multiply() { return f0 * f1; }
-float op_divide() { return f0 / f1; }
+inline Num _add(Num a, Num b) { return a + b; }
+inline Num _subtract(Num a, Num b) { return a - b; }
+inline Num _multiply(Num a, Num b) { return a * b; }
+inline Num _divide(Num a, Num b) { return a / b; }
 
 // Modulus ? Remainder ?
 // My implementation of '%' expects a positive divisor (f1),
@@ -307,32 +703,32 @@ float op_divide() { return f0 / f1; }
 // when dividend is positive.   Example: -1 % 3 = 2.
 // Deal with it  [*sunglasses*]
 
-float op_mod() {
-	float v = f0;	// cache
-	float window = f1;	// cache
+inline Num _mod(Num v, Num window) {
 	return v - floor(v / window) * window;
 }
 
-float op_gt() { return (f0 > f1) ? true_f : false_f; }
-float op_gte() { return (f0 >= f1) ? true_f : false_f; }
-float op_lt() { return (f0 < f1) ? true_f : false_f; }
-float op_lte() { return (f0 <= f1) ? true_f : false_f; }
-float op_equal() { return (f0 == f1) ? true_f : false_f; }
-float op_notequal() { return (f0 != f1) ? true_f : false_f; }
-float op_ternary() { return (f0 != 0.0f) ? f1 : f2; }
+inline Num _gt(Num a, Num b) { return (a > b) ? true_f : false_f; }
+inline Num _gte(Num a, Num b) { return (a >= b) ? true_f : false_f; }
+inline Num _lt(Num a, Num b) { return (a < b) ? true_f : false_f; }
+inline Num _lte(Num a, Num b) { return (a <= b) ? true_f : false_f; }
+inline Num _equal(Num a, Num b) { return (a == b) ? true_f : false_f; }
+inline Num _notequal(Num a, Num b) { return (a != b) ? true_f : false_f; }
+inline Num _ternary(Num a, Num b, Num c) { return (a != 0.0f) ? b : c; }
 
 // Functions
 
 // Teensy LC: The __f versions of trig functions "should" be faster... right?
 //            But they're definitely performing slower, for me.
-float op_sin() { return sin(f0); }
-float op_cos() { return cos(f0); }
-float op_sin01() { return (sin(f0 * (float)(M_PI * 2.0f)) + 1.0f) * 0.5f; }
-float op_cos01() { return (cos(f0 * (float)(M_PI * 2.0f)) + 1.0f) * 0.5f; }
+//            math_sin() etc use polynomials instead (tables for
+//            FIXED_POINT), see fastmath.h
+inline Num _sin(Num a) { return math_sin(a); }
+inline Num _cos(Num a) { return math_cos(a); }
+inline Num _sin01(Num a) { return (sin_turns(a) + 1.0f) * 0.5f; }
+inline Num _cos01(Num a) { return (cos_turns(a) + 1.0f) * 0.5f; }
 
 // Sine-quad, cos-quad (or maybe the 'q' stands for 'quick')
-inline float _sinq(float v) {
-	float dec = v - floor(v);	// decimal part. wrap within 0..1
+inline Num _sinq(Num v) {
+	Num dec = v - floor(v);	// decimal part. wrap within 0..1
 
 	if (dec >= 0.5f) {
 		dec -= 0.75f;
@@ -343,208 +739,425 @@ inline float _sinq(float v) {
 	return 1.0f - (dec * dec * 8.0f);
 }
 
-float op_sinq() { return _sinq(f0); }
-float op_cosq() { return _sinq(f0 - 0.25f); }
+inline Num _cosq(Num a) { return _sinq(a - 0.25f); }
 
-float op_tan() { return tan(f0); }
-float op_pow() { return pow(f0, f1); }
-float op_abs() { return abs(f0); }
-float op_atan2() { return atan2(f0, f1); }
+inline Num _tan(Num a) { return math_tan(a); }
+inline Num _pow(Num a, Num b) { return math_pow(a, b); }
+inline Num _abs(Num a) { return abs(a); }
+inline Num _atan2(Num a, Num b) { return math_atan2(a, b); }
 
-float op_floor() { return floor(f0); }
-float op_ceil() { return ceil(f0); }
-float op_round() { return round(f0); }
+inline Num _floor(Num a) { return floor(a); }
+inline Num _ceil(Num a) { return ceil(a); }
+inline Num _round(Num a) { return round(a); }
 
-float op_frac() { float cachef0 = f0; return cachef0 - floor(cachef0); }
+inline Num _frac(Num a) { return a - floor(a); }
 
-float op_sqrt() { return sqrt(f0); }
-float op_log() { return log(f0); }
-float op_logBase() { return log(f0) / log(f1); }
+inline Num _sqrt(Num a) { return math_sqrt(a); }
+inline Num _log(Num a) { return math_log(a); }
+inline Num _logBase(Num a, Num b) { return math_log(a) / math_log(b); }
 
-float op_rand() { return randf(); }
-float op_randRange() { float cachef0 = f0; return cachef0 + (f1 - cachef0) * randf(); }
+inline Num _rand() { return randn(); }
+inline Num _randRange(Num a, Num b) { return a + (b - a) * randn(); }
 
-float op_noise1() {
-	float c0 = f0;	// cache
+#if !NOISE_HASH
 
-	float xf = (c0 - floor(c0)) * NOISE_SIZE;	// wrap in 0..NOISE_SIZE
+Num _noise1(Num c0) {
+	Num xf = (c0 - floor(c0)) * NOISE_SIZE;	// wrap in 0..NOISE_SIZE
 
 	// noise[] lookups
-	uint8_t x0 = (uint8_t)(xf);
-	uint8_t x1 = (x0 + 1) % NOISE_SIZE;
-	float xp = xf - floor(xf);
+	uint8_t x0 = num_int(xf) & (NOISE_SIZE - 1);
+	uint8_t x1 = (x0 + 1) & (NOISE_SIZE - 1);
+	Num xp = xf - floor(xf);
 
-	return lerp(noise[x0][0][0], noise[x1][0][0], xp);
+	return lerp(noise_at(x0, 0, 0), noise_at(x1, 0, 0), xp);
 }
 
-float op_noise2() {
-	// cache
-	float c0 = f0;
-	float c1 = f1;
-
+Num _noise2(Num c0, Num c1) {
 	// wrap in 0..NOISE_SIZE
-	float xf = (c0 - floor(c0)) * NOISE_SIZE;
-	float yf = (c1 - floor(c1)) * NOISE_SIZE;
+	Num xf = (c0 - floor(c0)) * NOISE_SIZE;
+	Num yf = (c1 - floor(c1)) * NOISE_SIZE;
 
 	// noise[] lookups
-	uint8_t x0 = (uint8_t)(xf);
-	uint8_t x1 = (x0 + 1) % NOISE_SIZE;
-	float xp = xf - floor(xf);
-	uint8_t y0 = (uint8_t)(yf);
-	uint8_t y1 = (y0 + 1) % NOISE_SIZE;
-	float yp = yf - floor(yf);
+	uint8_t x0 = num_int(xf) & (NOISE_SIZE - 1);
+	uint8_t x1 = (x0 + 1) & (NOISE_SIZE - 1);
+	Num xp = xf - floor(xf);
+	uint8_t y0 = num_int(yf) & (NOISE_SIZE - 1);
+	uint8_t y1 = (y0 + 1) & (NOISE_SIZE - 1);
+	Num yp = yf - floor(yf);
 
-	float xv0 = lerp(noise[x0][y0][0], noise[x1][y0][0], xp);
-	float xv1 = lerp(noise[x0][y1][0], noise[x1][y1][0], xp);
+	Num xv0 = lerp(noise_at(x0, y0, 0), noise_at(x1, y0, 0), xp);
+	Num xv1 = lerp(noise_at(x0, y1, 0), noise_at(x1, y1, 0), xp);
 
 	return lerp(xv0, xv1, yp);
 }
 
-float op_noise3() {
-	// cache
-	float c0 = f0;
-	float c1 = f1;
-	float c2 = f2;
-
+Num _noise3(Num c0, Num c1, Num c2) {
 	// wrap in 0..NOISE_SIZE
-	float xf = (c0 - floor(c0)) * NOISE_SIZE;
-	float yf = (c1 - floor(c1)) * NOISE_SIZE;
-	float zf = (c2 - floor(c2)) * NOISE_SIZE;
+	Num xf = (c0 - floor(c0)) * NOISE_SIZE;
+	Num yf = (c1 - floor(c1)) * NOISE_SIZE;
+	Num zf = (c2 - floor(c2)) * NOISE_SIZE;
 
 	// noise[] lookups
-	uint8_t x0 = (uint8_t)(xf);
-	uint8_t x1 = (x0 + 1) % NOISE_SIZE;
-	float xp = xf - floor(xf);
-	uint8_t y0 = (uint8_t)(yf);
-	uint8_t y1 = (y0 + 1) % NOISE_SIZE;
-	float yp = yf - floor(yf);
-	uint8_t z0 = (uint8_t)(zf);
-	uint8_t z1 = (z0 + 1) % NOISE_SIZE;
-	float zp = zf - floor(zf);
-
-	float xv0 = lerp(noise[x0][y0][z0], noise[x1][y0][z0], xp);
-	float xv1 = lerp(noise[x0][y1][z0], noise[x1][y1][z0], xp);
-	float xv2 = lerp(noise[x0][y0][z1], noise[x1][y0][z1], xp);
-	float xv3 = lerp(noise[x0][y1][z1], noise[x1][y1][z1], xp);
-
-	float yv0 = lerp(xv0, xv1, yp);
-	float yv1 = lerp(xv2, xv3, yp);
+	uint8_t x0 = num_int(xf) & (NOISE_SIZE - 1);
+	uint8_t x1 = (x0 + 1) & (NOISE_SIZE - 1);
+	Num xp = xf - floor(xf);
+	uint8_t y0 = num_int(yf) & (NOISE_SIZE - 1);
+	uint8_t y1 = (y0 + 1) & (NOISE_SIZE - 1);
+	Num yp = yf - floor(yf);
+	uint8_t z0 = num_int(zf) & (NOISE_SIZE - 1);
+	uint8_t z1 = (z0 + 1) & (NOISE_SIZE - 1);
+	Num zp = zf - floor(zf);
+
+	Num xv0 = lerp(noise_at(x0, y0, z0), noise_at(x1, y0, z0), xp);
+	Num xv1 = lerp(noise_at(x0, y1, z0), noise_at(x1, y1, z0), xp);
+	Num xv2 = lerp(noise_at(x0, y0, z1), noise_at(x1, y0, z1), xp);
+	Num xv3 = lerp(noise_at(x0, y1, z1), noise_at(x1, y1, z1), xp);
+
+	Num yv0 = lerp(xv0, xv1, yp);
+	Num yv1 = lerp(xv2, xv3, yp);
 
 	return lerp(yv0, yv1, zp);
 }
 
-float op_noise1q() {
-	float c0 = f0;	// cache
-
+inline Num _noise1q(Num c0) {
 	// wrap in 0..NOISE_SIZE
-	uint8_t x = (uint8_t)((c0 - floor(c0)) * NOISE_SIZE);
+	uint8_t x = num_int((c0 - floor(c0)) * NOISE_SIZE) & (NOISE_SIZE - 1);
 
-	return noise[x][0][0];
+	return noise_at(x, 0, 0);
 }
 
-float op_noise2q() {
-	// cache
-	float c0 = f0;
-	float c1 = f1;
+inline Num _noise2q(Num c0, Num c1) {
+	// wrap in 0..NOISE_SIZE
+	uint8_t x = num_int((c0 - floor(c0)) * NOISE_SIZE) & (NOISE_SIZE - 1);
+	uint8_t y = num_int((c1 - floor(c1)) * NOISE_SIZE) & (NOISE_SIZE - 1);
+
+	return noise_at(x, y, 0);
+}
 
+inline Num _noise3q(Num c0, Num c1, Num c2) {
 	// wrap in 0..NOISE_SIZE
-	uint8_t x = (uint8_t)((c0 - floor(c0)) * NOISE_SIZE);
-	uint8_t y = (uint8_t)((c1 - floor(c1)) * NOISE_SIZE);
+	uint8_t x = num_int((c0 - floor(c0)) * NOISE_SIZE) & (NOISE_SIZE - 1);
+	uint8_t y = num_int((c1 - floor(c1)) * NOISE_SIZE) & (NOISE_SIZE - 1);
+	uint8_t z = num_int((c2 - floor(c2)) * NOISE_SIZE) & (NOISE_SIZE - 1);
 
-	return noise[x][y][0];
+	return noise_at(x, y, z);
 }
 
-float op_noise3q() {
-	// cache
-	float c0 = f0;
-	float c1 = f1;
-	float c2 = f2;
+#else
 
-	// wrap in 0..NOISE_SIZE
-	uint8_t x = (uint8_t)((c0 - floor(c0)) * NOISE_SIZE);
-	uint8_t y = (uint8_t)((c1 - floor(c1)) * NOISE_SIZE);
-	uint8_t z = (uint8_t)((c2 - floor(c2)) * NOISE_SIZE);
+// wrap in 0..NOISE_SIZE
+inline Num noise_wrap(Num c) { return (c - floor(c)) * NOISE_SIZE; }
+
+inline Num noise_hashed(Num v) { return (v - noise_min) * noise_mult; }
+
+Num _noise1(Num c0) { return noise_hashed(noise_octaves<1>(noise_wrap(c0), 0.0f, 0.0f)); }
+Num _noise2(Num c0, Num c1) { return noise_hashed(noise_octaves<2>(noise_wrap(c0), noise_wrap(c1), 0.0f)); }
+Num _noise3(Num c0, Num c1, Num c2) { return noise_hashed(noise_octaves<3>(noise_wrap(c0), noise_wrap(c1), noise_wrap(c2))); }
+
+inline Num _noise1q(Num c0) {
+	return noise_hashed(noise_octaves<1>(floor(noise_wrap(c0)), 0.0f, 0.0f));
+}
+
+inline Num _noise2q(Num c0, Num c1) {
+	return noise_hashed(noise_octaves<2>(floor(noise_wrap(c0)), floor(noise_wrap(c1)), 0.0f));
+}
 
-	return noise[x][y][z];
+inline Num _noise3q(Num c0, Num c1, Num c2) {
+	return noise_hashed(noise_octaves<3>(floor(noise_wrap(c0)), floor(noise_wrap(c1)), floor(noise_wrap(c2))));
 }
 
-float op_min() { return min(f0, f1); }
-float op_max() { return max(f0, f1); }
-float op_lerp() { float cachef0 = f0; return cachef0 + (f1 - cachef0) * f2; }
-float op_clamp() { return constrain(f0, f1, f2); }
+#endif
+
+inline Num _min(Num a, Num b) { return min(a, b); }
+inline Num _max(Num a, Num b) { return max(a, b); }
+inline Num _lerp(Num a, Num b, Num c) { return a + (b - a) * c; }
+inline Num _clamp(Num a, Num b, Num c) { return constrain(a, b, c); }
 
-float op_tri() { 	// Triangle wave oscillator
-	float cachef0 = f0;
-	float r = cachef0 - floor(cachef0);	// remainder
+inline Num _tri(Num a) { 	// Triangle wave oscillator
+	Num r = a - floor(a);	// remainder
 	return ((r < 0.5f) ? (r) : (1.0f - r)) * 2.0f;
 }
 
 // 0..1..0 around the origin, all other values are 0
-float op_peak() {
-	return max(0.0f, 1.0f - abs(f0));
+inline Num _peak(Num a) {
+	return max(0.0f, 1.0f - abs(a));
 }
 
-float op_uni2bi() { return (f0 * 2.0f) - 1.0f; }	// unipolar to bipolar
-float op_bi2uni() { return (f0 + 1.0f) * 0.5f; }	// bipolar to unipolar
+inline Num _uni2bi(Num a) { return (a * 2.0f) - 1.0f; }	// unipolar to bipolar
+inline Num _bi2uni(Num a) { return (a + 1.0f) * 0.5f; }	// bipolar to unipolar
+
+// Kernels below are per-LED: they read computeLED
 
-float op_accum0() {
-	accum[0][computeLED] += f0;
+inline Num _accum0(Num a) {
+	accum[0][computeLED] += a;
 	return accum[0][computeLED];
 }
 
-float op_rgb() {
-	uint8_t r = constrain((int16_t)(f0 * 0xff), 0x0, 0xff);
-	uint8_t g = constrain((int16_t)(f1 * 0xff), 0x0, 0xff);
-	uint8_t b = constrain((int16_t)(f2 * 0xff), 0x0, 0xff);
+Num _rgb(Num red, Num green, Num blue) {
+	uint8_t r = constrain((int16_t)num_int(red * 0xff), 0x0, 0xff);
+	uint8_t g = constrain((int16_t)num_int(green * 0xff), 0x0, 0xff);
+	uint8_t b = constrain((int16_t)num_int(blue * 0xff), 0x0, 0xff);
 
-	_leds->setPixel(computeLED, lut[r], lut[g], lut[b]);
+	_leds->setPixel(led_strip[computeLED], lut[r], lut[g], lut[b]);
 
 	return true_f;
 }
 
-float op_hsv() {
-	float h = f0;
-	//float s = f1;
-	float v = f2;	// top (max) value
-	float p = v * (1.0f - f1);	// bottom (min) value
+Num _hsv(Num h, Num s, Num v) {
+	// v: top (max) value
+	Num p = v * (1.0f - s);	// bottom (min) value
 
-	uint8_t v8 = constrain((int16_t)(v * 0xff), 0x0, 0xff);
-	uint8_t p8 = constrain((int16_t)(p * 0xff), 0x0, 0xff);
+	uint8_t v8 = constrain((int16_t)num_int(v * 0xff), 0x0, 0xff);
+	uint8_t p8 = constrain((int16_t)num_int(p * 0xff), 0x0, 0xff);
 
 	h -= floor(h);	// wrap inside 0..1
-	float h6 = h * 6.0f;
-	float hRamp = h6 - floor(h6);
+	Num h6 = h * 6.0f;
+	Num hRamp = h6 - floor(h6);
 
-	uint8_t h6i = (uint8_t)(h6);	// 0..5
+	uint8_t h6i = (uint8_t)num_int(h6);	// 0..5
 
 	if (h6i & 0x1) {	// Odds
 		// "Falling" (yellow -> green: R falls, etc)
-		uint8_t q8 = lerp(v8, p8, hRamp);
+		uint8_t q8 = num_int(lerp(v8, p8, hRamp));
 
 		if (h6i == 1) {
-			_leds->setPixel(computeLED, lut[q8], lut[v8], lut[p8]);	// yellow -> green
+			_leds->setPixel(led_strip[computeLED], lut[q8], lut[v8], lut[p8]);	// yellow -> green
 		} else if (h6i == 3) {
-			_leds->setPixel(computeLED, lut[p8], lut[q8], lut[v8]);	// cyan -> blue
+			_leds->setPixel(led_strip[computeLED], lut[p8], lut[q8], lut[v8]);	// cyan -> blue
 		} else {
-			_leds->setPixel(computeLED, lut[v8], lut[p8], lut[q8]);	// magenta -> red
+			_leds->setPixel(led_strip[computeLED], lut[v8], lut[p8], lut[q8]);	// magenta -> red
 		}
 
 	} else {	// Evens
 		// "Rising" (red -> yellow: G rises, etc)
-		uint8_t t8 = lerp(p8, v8, hRamp);
+		uint8_t t8 = num_int(lerp(p8, v8, hRamp));
 
 		if (h6i == 0) {
-			_leds->setPixel(computeLED, lut[v8], lut[t8], lut[p8]);	// red -> yellow
+			_leds->setPixel(led_strip[computeLED], lut[v8], lut[t8], lut[p8]);	// red -> yellow
 		} else if (h6i == 2) {
-			_leds->setPixel(computeLED, lut[p8], lut[v8], lut[t8]);	// green -> cyan
+			_leds->setPixel(led_strip[computeLED], lut[p8], lut[v8], lut[t8]);	// green -> cyan
 		} else {
-			_leds->setPixel(computeLED, lut[t8], lut[p8], lut[v8]);	// blue -> magenta
+			_leds->setPixel(led_strip[computeLED], lut[t8], lut[p8], lut[v8]);	// blue -> magenta
 		}
 	}
 
 	return true_f;
 }
 
+inline Num _nop() { return false_f; }
+
+// Fused ops ("superinstructions"), built by fuse_steps().
+// Written with the kernels above, so they round the same way.
+inline Num _madd(Num a, Num b, Num c) { return _add(_multiply(a, b), c); }
+inline Num _fracmadd(Num a, Num b, Num c) { return _frac(_madd(a, b, c)); }
+inline Num _rfrac(Num a) { return _subtract(1.0f, _frac(a)); }
+inline Num _rfracmadd(Num a, Num b, Num c) { return _subtract(1.0f, _fracmadd(a, b, c)); }
+inline Num _hsvsinq(Num h, Num s, Num v) { return _hsv(h, s, _sinq(v)); }
+
+//
+//  OP TABLE
+//
+
+// Every op: X(wire code, kernel name, arg count)
+#define OP_LIST(X) \
+	/* Operators */ \
+	X('+', add, 2) \
+	X('-', subtract, 2) \
+	X('*', multiply, 2) \
+	X('/', divide, 2) \
+	X('%', mod, 2) \
+	X('<', lt, 2) \
+	X('>', gt, 2) \
+	X('{', lte, 2) \
+	X('}', gte, 2) \
+	X('=', equal, 2) \
+	X('!', notequal, 2) \
+	X('?', ternary, 3) \
+	/* Functions */ \
+	X('S', sin, 1) \
+	X('C', cos, 1) \
+	X('s', sin01, 1) \
+	X('c', cos01, 1) \
+	X('q', sinq, 1) \
+	X('Q', cosq, 1) \
+	X('T', tan, 1) \
+	X('P', pow, 2) \
+	X('|', abs, 1) \
+	X('A', atan2, 2) \
+	X('_', floor, 1) \
+	X('`', ceil, 1) \
+	X('r', round, 1) \
+	X('.', frac, 1) \
+	X('R', sqrt, 1) \
+	X('L', log, 1) \
+	X('B', logBase, 2) \
+	X('z', rand, 0) \
+	X('Z', randRange, 2) \
+	X('1', noise1, 1) \
+	X('2', noise2, 2) \
+	X('3', noise3, 3) \
+	X('4', noise1q, 1) \
+	X('5', noise2q, 2) \
+	X('6', noise3q, 3) \
+	X('m', min, 2) \
+	X('M', max, 2) \
+	X('l', lerp, 3) \
+	X('x', clamp, 3) \
+	X('t', tri, 1) \
+	X('p', peak, 1) \
+	X('b', uni2bi, 1) \
+	X('u', bi2uni, 1) \
+	X('0', accum0, 1) \
+	X('[', rgb, 3) \
+	X(']', hsv, 3)
+
+// Fused ops never arrive over the wire (codes are not ASCII)
+#define OP_MADD            (0x80)	// a * b + c
+#define OP_FRACMADD        (0x81)	// frac(a * b + c)
+#define OP_RFRAC           (0x82)	// 1 - frac(a)
+#define OP_RFRACMADD       (0x83)	// 1 - frac(a * b + c)
+#define OP_HSVSINQ         (0x84)	// hsv(h, s, sinq(v))
+
+#define FUSED_OP_LIST(X) \
+	X(OP_MADD, madd, 3) \
+	X(OP_FRACMADD, fracmadd, 3) \
+	X(OP_RFRAC, rfrac, 1) \
+	X(OP_RFRACMADD, rfracmadd, 3) \
+	X(OP_HSVSINQ, hsvsinq, 3)
+
+// Call a kernel with the first `arity` of x0, x1, x2
+#define OP_CALL_0(kernel, x0, x1, x2)  kernel()
+#define OP_CALL_1(kernel, x0, x1, x2)  kernel(x0)
+#define OP_CALL_2(kernel, x0, x1, x2)  kernel(x0, x1)
+#define OP_CALL_3(kernel, x0, x1, x2)  kernel(x0, x1, x2)
+
+// op_add<K0, K1, K2>(), etc: Fetch args for the ops[] engine, run the kernel
+#define OP_DEFINE(code, name, arity) \
+	OP_KINDS Num op_##name() { return OP_CALL_##arity(_##name, f0, f1, f2); }
+
+OP_LIST(OP_DEFINE)
+FUSED_OP_LIST(OP_DEFINE)
+OP_DEFINE(0, nop, 0)
+
+// Every specialization of an op, indexed by kinds_index()
+#define OP_VARIANTS_K0(op, k1, k2)  op<k_float, k1, k2>, op<k_float_ptr, k1, k2>, op<k_array_of_floats, k1, k2>
+#define OP_VARIANTS_K01(op, k2)     OP_VARIANTS_K0(op, k_float, k2), OP_VARIANTS_K0(op, k_float_ptr, k2), OP_VARIANTS_K0(op, k_array_of_floats, k2)
+
+#define OP_VARIANTS_0(op)  {op<k_float, k_float, k_float>}
+#define OP_VARIANTS_1(op)  {OP_VARIANTS_K0(op, k_float, k_float)}
+#define OP_VARIANTS_2(op)  {OP_VARIANTS_K01(op, k_float)}
+#define OP_VARIANTS_3(op)  {OP_VARIANTS_K01(op, k_float), OP_VARIANTS_K01(op, k_float_ptr), OP_VARIANTS_K01(op, k_array_of_floats)}
+
+#define OP_SELECT_CASE(code, name, arity) \
+	case code: {static const OpFn variants[] = OP_VARIANTS_##arity(op_##name); return variants[kinds_index(arg, arity)];}
+
+// Args past the op's arity are never read, and don't count.
+uint8_t kinds_index(Arg * arg, uint8_t arity)
+{
+	uint8_t idx = 0;
+
+	for (int8_t i = arity - 1; i >= 0; i--) {
+		idx = (idx * k_arg_type_count) + arg[i].type;
+	}
+
+	return idx;
+}
+
+// Op for the wire code, specialized for the kinds of these args
+OpFn select_op(uint8_t code, Arg * arg)
+{
+	switch (code) {
+		OP_LIST(OP_SELECT_CASE)
+		FUSED_OP_LIST(OP_SELECT_CASE)
+	}
+
+	return op_nop<k_float, k_float, k_float>;
+}
+
+#define OP_ARITY_CASE(code, name, arity) \
+	case code: return arity;
+
+uint8_t op_arity(uint8_t code)
+{
+	switch (code) {
+		OP_LIST(OP_ARITY_CASE)
+		FUSED_OP_LIST(OP_ARITY_CASE)
+	}
+
+	return 0;
+}
+
+//
+//  LANE OPS
+//
+
+// Lane operand: the same value for every lane, or a row
+template <bool IsRow> struct LaneArg;
+
+template <> struct LaneArg<false> {
+	Num v;
+	LaneArg(const Num * src) : v(*src) {}
+	inline Num operator[](uint8_t) const { return v; }
+};
+
+template <> struct LaneArg<true> {
+	const Num * __restrict row;
+	LaneArg(const Num * src) : row(src) {}
+	inline Num operator[](uint8_t j) const { return row[j]; }
+};
+
+// Kernels that read computeLED
+constexpr bool is_per_led_op(uint8_t code) {
+	return (code == '0') || (code == '[') || (code == ']') || (code == OP_HSVSINQ);
+}
+
+#define LANE_KINDS         template <bool L0, bool L1, bool L2>
+
+// lane_add<L0, L1, L2>(), etc: Run the kernel for n lanes.
+// Without computeLED, the loop is plain values in and out,
+// and the compiler can unroll and vectorize it.
+#define OP_LANE_DEFINE(code, name, arity) \
+	LANE_KINDS void lane_##name(const LaneStep * step, uint8_t n) { \
+		LaneArg<L0> a0(step->src[0]); \
+		LaneArg<L1> a1(step->src[1]); \
+		LaneArg<L2> a2(step->src[2]); \
+		Num * __restrict dst = step->dst; \
+		if (is_per_led_op(code)) { \
+			for (uint8_t j = 0; j < n; j++) { \
+				computeLED = lane_leds[j]; \
+				dst[j] = OP_CALL_##arity(_##name, a0[j], a1[j], a2[j]); \
+			} \
+		} else { \
+			for (uint8_t j = 0; j < n; j++) { \
+				dst[j] = OP_CALL_##arity(_##name, a0[j], a1[j], a2[j]); \
+			} \
+		} \
+	}
+
+OP_LIST(OP_LANE_DEFINE)
+FUSED_OP_LIST(OP_LANE_DEFINE)
+OP_LANE_DEFINE(0, nop, 0)
+
+// Indexed by lane mask: bit i set when arg i is a row
+#define LANE_VARIANTS_0(op)  {op<false, false, false>}
+#define LANE_VARIANTS_1(op)  {op<false, false, false>, op<true, false, false>}
+#define LANE_VARIANTS_2(op)  {op<false, false, false>, op<true, false, false>, op<false, true, false>, op<true, true, false>}
+#define LANE_VARIANTS_3(op)  {op<false, false, false>, op<true, false, false>, op<false, true, false>, op<true, true, false>, \
+                              op<false, false, true>, op<true, false, true>, op<false, true, true>, op<true, true, true>}
+
+#define OP_LANE_SELECT_CASE(code, name, arity) \
+	case code: {static const LaneFn variants[] = LANE_VARIANTS_##arity(lane_##name); return variants[mask & ((1 << arity) - 1)];}
+
+LaneFn select_lane_op(uint8_t code, uint8_t mask)
+{
+	switch (code) {
+		OP_LIST(OP_LANE_SELECT_CASE)
+		FUSED_OP_LIST(OP_LANE_SELECT_CASE)
+	}
+
+	return lane_nop<false, false, false>;
+}
+
 uint8_t computer_get_station_id() {
 	return station_id;
 }
@@ -552,6 +1165,9 @@ uint8_t computer_get_station_id() {
 void set_gamma_and_brightness(bool isGamma, uint8_t bright) {
 	float raw = 0.0f;
 
+	gamma_on = isGamma;
+	brightness = bright;
+
 	for (uint16_t i = 0; i < 256; i++) {
 		float v = raw;
 
@@ -636,6 +1252,81 @@ void serial_read_data_type(uint8_t x)
 		}
 		break;
 
+		// Query: Report telemetry over USB
+		case 'q':
+		{
+			send_telemetry();
+			serial_fp = serial_wait_for_newline;
+		}
+		break;
+
+		// Binary frame: Several steps
+		case 'B':
+		{
+			frame_len = 0;
+			frame_escape = false;
+			serial_fp = serial_read_frame;
+		}
+		break;
+
+		// Query: Report the step profile over USB. Without the
+		// profiler, ignore it: server.js asks every second.
+		case 'p':
+		{
+#if PROFILE_STEPS
+			send_profile();
+#endif
+			serial_fp = serial_wait_for_newline;
+		}
+		break;
+
+		// Time sync, from station 0
+		case 'y':
+		{
+			sync_ref = 0;
+			sync_digits = 0;
+			serial_fp = serial_read_sync;
+		}
+		break;
+
+		// Link rate, from station 0: Announce, probe, commit
+		case 'n':
+		case 'v':
+		case 'k':
+		{
+			link_type = x;
+			link_len = 0;
+			serial_fp = serial_read_link;
+		}
+		break;
+
+		// Program store: Save the live program, or recall one
+		case 'w':
+		case 'r':
+		{
+			store_op = x;
+			serial_fp = serial_read_store_slot;
+		}
+		break;
+
+		// Program store: Playlist
+		case 'l':
+		{
+			memset(&playlist_in, 0, sizeof(playlist_in));
+			playlist_digits = 0;
+			serial_fp = serial_read_playlist;
+		}
+		break;
+
+		// Activate a cached program, by its commit checksum
+		case 'a':
+		{
+			commit_checksum = 0;
+			commit_digits = 0;
+			serial_fp = serial_read_activate;
+		}
+		break;
+
 		default:
 		{
 			serial_error();
@@ -644,111 +1335,224 @@ void serial_read_data_type(uint8_t x)
 	}
 }
 
-void serial_read_step_count(uint8_t x) {
-	step_count = x - '!';
-	serial_fp = serial_wait_for_newline;
+// FNV-1a
+uint32_t fnv1a(uint32_t h, const uint8_t * data, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++) {
+		h = (h ^ data[i]) * 16777619u;
+	}
+	return h;
 }
 
-void serial_read_step_number(uint8_t x) {
-	if ((x < '!') || (('!' + MAX_STEPS) <= x)) {
-		step_idx = -1;
-		serial_error();
-		return;
-	}
+#define FNV1A_START  (2166136261u)
 
-	step_idx = x - '!';
-	serial_fp = serial_read_op;
+// Checksum of the first count steps of the upload slot: FNV-1a over
+// their line hashes (little-endian). Stations that got the same
+// 's' lines agree on it.
+uint32_t upload_checksum(uint8_t count)
+{
+	uint32_t h = FNV1A_START;
 
-	// Clear args
-	for (uint8_t i = 0; i < ARG_COUNT; i++) {
-		args[step_idx][i].f = 0.0f;
-		args[step_idx][i].type = k_float;
+	for (uint8_t s = 0; s < count; s++) {
+		uint8_t bytes[4];
+		for (uint8_t b = 0; b < 4; b++) {
+			bytes[b] = (upload->step_hashes[s] >> (b * 8)) & 0xff;
+		}
+		h = fnv1a(h, bytes, 4);
 	}
 
-	if (DEBUG_STATE) {
-		Serial.print("step: ");
-		Serial.println(step_idx);
+	return h;
+}
+
+// Swap the slots. Serial input is handled between frames (see
+// loop()), so this lands on a frame boundary. A program from
+// anywhere but the playlist pauses it.
+void program_commit(uint8_t count)
+{
+	upload->step_count = count;
+	playlist.paused = true;
+
+	Program * live = program;
+	program = upload;
+	upload = live;
+	upload_written = false;
+
+	program_dirty = true;
+}
+
+// Lowercase hex, or -1
+int8_t hex_digit(uint8_t x)
+{
+	if (('0' <= x) && (x <= '9')) return x - '0';
+	if (('a' <= x) && (x <= 'f')) return x - 'a' + 10;
+	return -1;
+}
+
+// count lowercase hex digits. Returns false if any isn't one.
+bool read_hex(const uint8_t * in, uint8_t count, uint32_t * v)
+{
+	*v = 0;
+	for (uint8_t i = 0; i < count; i++) {
+		int8_t digit = hex_digit(in[i]);
+		if (digit < 0) return false;
+		*v = (*v << 4) | digit;
 	}
+	return true;
 }
 
-void serial_read_op(uint8_t x)
+// The low count hex digits of v, most significant first
+void write_hex(char * out, uint32_t v, uint8_t count)
 {
-	if (DEBUG_STATE) {
-		Serial.print("  op: ");
-		Serial.println((char)x);
+	static const char hex[] = "0123456789abcdef";
+
+	for (uint8_t i = 0; i < count; i++) {
+		out[i] = hex[(v >> ((count - 1 - i) * 4)) & 0xf];
 	}
+}
 
-	switch (x) {
-		// Operators
-		case '+': {ops[step_idx] = op_add; break;}
-		case '-': {ops[step_idx] = op_subtract; break;}
-		case '*': {ops[step_idx] = op_multiply; break;}
-		case '/': {ops[step_idx] = op_divide; break;}
-		case '%': {ops[step_idx] = op_mod; break;}
-		case '<': {ops[step_idx] = op_lt; break;}
-		case '>': {ops[step_idx] = op_gt; break;}
-		case '{': {ops[step_idx] = op_lte; break;}
-		case '}': {ops[step_idx] = op_gte; break;}
-		case '=': {ops[step_idx] = op_equal; break;}
-		case '!': {ops[step_idx] = op_notequal; break;}
-		case '?': {ops[step_idx] = op_ternary; break;}
-
-		// Functions
-		case 'S': {ops[step_idx] = op_sin; break;}
-		case 'C': {ops[step_idx] = op_cos; break;}
-		case 's': {ops[step_idx] = op_sin01; break;}
-		case 'c': {ops[step_idx] = op_cos01; break;}
-		case 'q': {ops[step_idx] = op_sinq; break;}
-		case 'Q': {ops[step_idx] = op_cosq; break;}
-		case 'T': {ops[step_idx] = op_tan; break;}
-		case 'P': {ops[step_idx] = op_pow; break;}
-		case '|': {ops[step_idx] = op_abs; break;}
-		case 'A': {ops[step_idx] = op_atan2; break;}
-		case '_': {ops[step_idx] = op_floor; break;}
-		case '`': {ops[step_idx] = op_ceil; break;}
-		case 'r': {ops[step_idx] = op_round; break;}
-		case '.': {ops[step_idx] = op_frac; break;}
-		case 'R': {ops[step_idx] = op_sqrt; break;}
-		case 'L': {ops[step_idx] = op_log; break;}
-		case 'B': {ops[step_idx] = op_logBase; break;}
-		case 'z': {ops[step_idx] = op_rand; break;}
-		case 'Z': {ops[step_idx] = op_randRange; break;}
-		case '1': {ops[step_idx] = op_noise1; break;}
-		case '2': {ops[step_idx] = op_noise2; break;}
-		case '3': {ops[step_idx] = op_noise3; break;}
-		case '4': {ops[step_idx] = op_noise1q; break;}
-		case '5': {ops[step_idx] = op_noise2q; break;}
-		case '6': {ops[step_idx] = op_noise3q; break;}
-		case 'm': {ops[step_idx] = op_min; break;}
-		case 'M': {ops[step_idx] = op_max; break;}
-		case 'l': {ops[step_idx] = op_lerp; break;}
-		case 'x': {ops[step_idx] = op_clamp; break;}
-		case 't': {ops[step_idx] = op_tri; break;}
-		case 'p': {ops[step_idx] = op_peak; break;}
-		case 'b': {ops[step_idx] = op_uni2bi; break;}
-		case 'u': {ops[step_idx] = op_bi2uni; break;}
-		case '0': {ops[step_idx] = op_accum0; break;}
-		case '[': {ops[step_idx] = op_rgb; break;}
-		case ']': {ops[step_idx] = op_hsv; break;}
-	}
-
-	current_arg = &args[step_idx][0];
-	serial_fp = serial_arg_start;
+// Commit: 'c', count, then an optional checksum: 8 hex digits of
+// upload_checksum(). With a checksum, a station that missed or
+// garbled any 's' line keeps its old program. A repeated 'c' does
+// nothing: The upload slot holds the program before this one.
+void serial_read_step_count(uint8_t x) {
+	if ((x < '!') || (('!' + MAX_STEPS) < x)) {
+		serial_error();
+		return;
+	}
+
+	commit_count = x - '!';
+	commit_checksum = 0;
+	commit_digits = 0;
+	serial_fp = serial_read_commit_checksum;
 }
 
-void serial_arg_start(uint8_t x)
-{
+void serial_read_commit_checksum(uint8_t x) {
 	if (x == '\n') {
+		if (!upload_written) {
+			// Nothing new to swap in
+		} else if (commit_digits == 0) {
+			program_commit(commit_count);	// No checksum
+		} else if ((commit_digits == 8) && (commit_checksum == upload_checksum(commit_count))) {
+			program_commit(commit_count);
+			cache_insert(commit_checksum);
+		} else {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
+
 		serial_fp = serial_line_start;
 		return;
 	}
 
-	// Numeric?
-	if (('0' <= x) && (x <= '9')) {
-		current_arg->type = k_float;
-		current_arg->f = (float)(x - '0');
-		serial_fp = serial_arg_read_float;
-		float_dec = 1.0f;	// Reading the whole part of the number
+	int8_t digit = hex_digit(x);
+	if ((digit < 0) || (commit_digits == 8)) {
+		serial_error();
+		return;
+	}
+
+	commit_checksum = (commit_checksum << 4) | digit;
+	commit_digits++;
+}
+
+// Sync: 'y', then station 0's time in millis: 8 hex digits. Applied
+// only if queue_drain() knows when the line arrived: Parsing waits
+// for a gap between frames, and that wait counts too.
+void serial_read_sync(uint8_t x) {
+	if (x == '\n') {
+		if (sync_digits != 8) {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
+
+		// Station 0 is the reference. Its lines arrive with
+		// lifespan STATION_COUNT - 2, one hop downstream.
+		uint8_t hops = (STATION_COUNT - 1) - (line_lifespan - '0');
+
+		if ((station_id != 0) && line_arrival_known) {
+			if (time_sync_receive(&time_sync, sync_ref, hops, link_byte_micros(&link_rate), line_arrival_micros, micros())) {
+				set_vtime_from_millis();
+			}
+		}
+		link_heard(&link_rate, millis());
+
+		serial_fp = serial_line_start;
+		return;
+	}
+
+	int8_t digit = hex_digit(x);
+	if ((digit < 0) || (sync_digits == 8)) {
+		serial_error();
+		return;
+	}
+
+	sync_ref = (sync_ref << 4) | digit;
+	sync_digits++;
+}
+
+// Station 0: A 'y' line for the next station down, with this
+// station's time at micros now. Writes SYNC_LINE_LEN bytes.
+void sync_line(char * out, uint32_t now)
+{
+	out[0] = '0' + (STATION_COUNT - 2);
+	out[1] = 'y';
+	write_hex(&out[2], time_sync_now(&time_sync, now), 8);
+	out[10] = '\n';
+}
+
+void serial_read_step_number(uint8_t x) {
+	if ((x < '!') || (('!' + MAX_STEPS) <= x)) {
+		step_idx = -1;
+		serial_error();
+		return;
+	}
+
+	step_idx = x - '!';
+	serial_fp = serial_read_op;
+	upload->step_hashes[step_idx] = line_hash;
+	upload_written = true;
+	playlist.paused = true;	// Don't load a slot over the upload
+
+	// Clear args
+	for (uint8_t i = 0; i < ARG_COUNT; i++) {
+		upload->args[step_idx][i].f = 0.0f;
+		upload->args[step_idx][i].type = k_float;
+	}
+
+	if (DEBUG_STATE) {
+		Serial.print("step: ");
+		Serial.println(step_idx);
+	}
+}
+
+void serial_read_op(uint8_t x)
+{
+	if (DEBUG_STATE) {
+		Serial.print("  op: ");
+		Serial.println((char)x);
+	}
+
+	// Decoded by select_op(), once the args are known
+	upload->op_codes[step_idx] = x;
+
+	current_arg = &upload->args[step_idx][0];
+	serial_fp = serial_arg_start;
+}
+
+void serial_arg_start(uint8_t x)
+{
+	if (x == '\n') {
+		serial_fp = serial_line_start;
+		return;
+	}
+
+	// Numeric?
+	if (('0' <= x) && (x <= '9')) {
+		current_arg->type = k_float;
+		current_arg->f = (float)(x - '0');
+		serial_fp = serial_arg_read_float;
+		float_dec = 1.0f;	// Reading the whole part of the number
 		return;
 	}
 
@@ -766,8 +1570,8 @@ void serial_arg_read_float(uint8_t x)
 {
 	if ((x == '\n') || (x == ',')) {
 		if (DEBUG_STATE) {
-			Serial.print("  float: ");
-			Serial.println(current_arg->f);
+			Serial.print("  const: ");
+			Serial.println(num_float(current_arg->f));
 		}
 
 		if (x == '\n') {
@@ -794,100 +1598,134 @@ void serial_arg_read_float(uint8_t x)
 	}
 }
 
-void serial_arg_read_buf(uint8_t x)
+// Point arg at a special var, named by 2 chars: T_, X_, GR, ...
+// Returns false for an unknown name.
+bool special_var_arg(Arg * arg, uint8_t c0, uint8_t c1)
 {
-	buf[1] = x;
-
-	switch (buf[0]) {
-		// Point to a computed value (from a previous step)
-		case 'v': {
-			current_arg->fp = &values[x - '!'];
-			current_arg->type = k_float_ptr;
-		}
-		break;
-
+	switch (c0) {
 		case 'T': {
-			current_arg->fp = &vTime;
-			current_arg->type = k_float_ptr;
+			arg->fp = &vTime;
+			arg->type = k_float_ptr;
 		}
 		break;
 
 		case 'S': {
-			current_arg->fp = &vStationID;
-			current_arg->type = k_float_ptr;
+			arg->fp = &vStationID;
+			arg->type = k_float_ptr;
 		}
 		break;
 
 		case 'I': {
-			if (buf[1] == '_') {
-				current_arg->fp = &vLEDIndex;
-				current_arg->type = k_float_ptr;
+			if (c1 == '_') {
+				arg->fp = &vLEDIndex;
+				arg->type = k_float_ptr;
 
 				/*
-			} else if (buf[1] == 'N') {
-				current_arg->fp = &vInside;
-				current_arg->type = k_float_ptr;
+			} else if (c1 == 'N') {
+				arg->fp = &vInside;
+				arg->type = k_float_ptr;
 				*/
 
 			} else {
-				serial_error();
-				return;
+				return false;
 			}
 		}
 		break;
 
 		case 'C': {
-			current_arg->fp = &vLEDCount;
-			current_arg->type = k_float_ptr;
+			arg->fp = &vLEDCount;
+			arg->type = k_float_ptr;
 		}
 		break;
 
 		case 'P': {
-			current_arg->fp = &vLEDRatio;
-			current_arg->type = k_float_ptr;
+			arg->fp = &vLEDRatio;
+			arg->type = k_float_ptr;
 		}
 		break;
 
 		case 'X': {
-			current_arg->fp = led_x;
-			current_arg->type = k_array_of_floats;
+			arg->fp = led_vars[k_layout_x];
+			arg->type = k_array_of_floats;
 		}
 		break;
 
 		case 'Y': {
-			current_arg->fp = led_y;
-			current_arg->type = k_array_of_floats;
+			arg->fp = led_vars[k_layout_y];
+			arg->type = k_array_of_floats;
 		}
 		break;
 
 		case 'A': {
-			current_arg->fp = led_local_angle;
-			current_arg->type = k_array_of_floats;
+			arg->fp = led_vars[k_layout_local_angle];
+			arg->type = k_array_of_floats;
 		}
 		break;
 
-		/*
+		// Local: LX, LY, LA, LR
 		case 'L': {
-			if (buf[1] == 'X') {
-				current_arg->fp = led_x;
-				current_arg->type = k_array_of_floats;
+			if (c1 == 'X') {
+				arg->fp = led_vars[k_layout_x];
 
-			} else if (buf[1] == 'A') {
-				current_arg->fp = led_local_angle;
-				current_arg->type = k_array_of_floats;
+			} else if (c1 == 'Y') {
+				arg->fp = led_vars[k_layout_y];
+
+			} else if (c1 == 'A') {
+				arg->fp = led_vars[k_layout_local_angle];
+
+			} else if (c1 == 'R') {
+				arg->fp = led_vars[k_layout_local_radius];
 
 			} else {
-				serial_error();
-				return;
+				return false;
 			}
-			break;
+
+			arg->type = k_array_of_floats;
 		}
-		*/
+		break;
+
+		// Global, across the whole sign: GX, GY, GA, GR
+		case 'G': {
+			if (c1 == 'X') {
+				arg->fp = led_vars[k_layout_global_x];
+
+			} else if (c1 == 'Y') {
+				arg->fp = led_vars[k_layout_y];	// The letters share a baseline
+
+			} else if (c1 == 'A') {
+				arg->fp = led_vars[k_layout_global_angle];
+
+			} else if (c1 == 'R') {
+				arg->fp = led_vars[k_layout_global_radius];
+
+			} else {
+				return false;
+			}
+
+			arg->type = k_array_of_floats;
+		}
+		break;
+
+		//case 'O': {arg->fp = &vOutside; break;}
+
+		default: {return false;}
+	}
+
+	return true;
+}
 
-		//case 'G': {current_arg->fp = &vGlobalAngle; break;}
-		//case 'O': {current_arg->fp = &vOutside; break;}
+void serial_arg_read_buf(uint8_t x)
+{
+	buf[1] = x;
+
+	// Point to a computed value (from a previous step)
+	if (buf[0] == 'v') {
+		current_arg->fp = &values[x - '!'];
+		current_arg->type = k_float_ptr;
 
-		default: {serial_error(); return;}
+	} else if (!special_var_arg(current_arg, buf[0], buf[1])) {
+		serial_error();
+		return;
 	}
 
 	serial_fp = serial_arg_complete;
@@ -957,139 +1795,1724 @@ void serial_read_gamma_end(uint8_t x) {
 	serial_fp = serial_wait_for_newline;
 }
 
-void serial_error() {
-	serial_fp = serial_wait_for_newline;
+//
+//  BINARY FRAMES
+//
+//  'B' line: Steps in binary, for uploads several times smaller
+//  than the text lines. The frame is escaped (FRAME_ESC), so it
+//  holds no '\n', and the ring passes it along like any line.
+//
+//    u8  FRAME_VERSION
+//    u8  first step number, u8 step count
+//    Each step:
+//      u8  op char, as in 's' lines
+//      u8  kinds: OperandKind for args 0, 1, 2 in bits 0-1, 2-3,
+//          4-5, and FRAME_FULL_FLOATS or FRAME_RAW_FIXED
+//      operands, in order: nothing for zero, a varint step number,
+//      a FRAME_VARS index, or a little-endian half, float or Q16.16
+//    u16 CRC-16/CCITT-FALSE of the above, big-endian
+//
+//  Steps land in the upload slot. Commit with a 'c' line, as
+//  usual: each step's line_hash is the FNV-1a of its bytes.
+//
+
+// Special vars by index. Two chars each, as in 's' lines.
+const char FRAME_VARS[] = "T_S_I_C_P_X_Y_A_LXLYLALRGXGYGAGR";
+#define FRAME_VAR_COUNT    ((sizeof(FRAME_VARS) - 1) / 2)
+
+uint16_t crc16(const uint8_t * data, uint8_t len)
+{
+	uint16_t crc = 0xffff;
+
+	for (uint8_t i = 0; i < len; i++) {
+		crc ^= data[i] << 8;
+		for (uint8_t b = 0; b < 8; b++) {
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+
+	return crc;
 }
 
-void serial_wait_for_newline(uint8_t x)
+float half_to_float(uint16_t h)
 {
-	if (x == '\n') {
-		serial_fp = serial_line_start;
+	uint16_t e = (h >> 10) & 0x1f;
+	uint16_t m = h & 0x3ff;
+	float v;
+
+	if (e == 0) {
+		v = ldexpf((float)m, -24);	// Subnormal
+	} else if (e == 0x1f) {
+		v = m ? NAN : INFINITY;
+	} else {
+		v = ldexpf((float)(m | 0x400), e - 25);
 	}
+
+	return (h & 0x8000) ? -v : v;
 }
 
-//
-//  INIT, INPUT
-//
+// Reads one operand at *pos. wide: The kinds byte's
+// FRAME_FULL_FLOATS and FRAME_RAW_FIXED bits. Returns false if it
+// runs past end, or is out of range.
+bool frame_read_operand(Arg * arg, uint8_t kind, uint8_t wide, const uint8_t * p, uint8_t * pos, uint8_t end)
+{
+	switch (kind) {
+		case k_operand_zero:
+		{
+			arg->f = 0.0f;
+			arg->type = k_float;
+		}
+		return true;
 
-void computer_init(OctoWS2811 * inLEDs) {
-	randomSeed(1337);
-	set_station_id(STATION_ID);
-	reset_time_and_accumulators();
-	reroll_noise();
-	set_gamma_and_brightness(DEFAULT_GAMMA, DEFAULT_BRIGHT);
-	serial_fp = serial_line_start;
-	_leds = inLEDs;
+		case k_operand_step:
+		{
+			uint16_t step = 0;
+			uint8_t shift = 0;
+
+			// varint: 7 bits per byte, low bits first
+			while (true) {
+				if ((*pos) >= end || (shift > 7)) return false;
+				uint8_t b = p[(*pos)++];
+				step |= (b & 0x7f) << shift;
+				shift += 7;
+				if (!(b & 0x80)) break;
+			}
+
+			if (step >= MAX_STEPS) return false;
+
+			arg->fp = &values[step];
+			arg->type = k_float_ptr;
+		}
+		return true;
+
+		case k_operand_var:
+		{
+			if ((*pos) >= end) return false;
+			uint8_t v = p[(*pos)++];
+			if (v >= FRAME_VAR_COUNT) return false;
+
+			return special_var_arg(arg, FRAME_VARS[v * 2], FRAME_VARS[v * 2 + 1]);
+		}
+
+		case k_operand_const:
+		{
+			uint8_t size = wide ? 4 : 2;
+			if ((*pos) + size > end) return false;
+
+			const uint8_t * b = &p[*pos];
+			(*pos) += size;
+			uint32_t bits = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+
+			if (wide & FRAME_RAW_FIXED) {
+#if FIXED_POINT
+				arg->f = Fixed::from_raw((int32_t)bits);
+#else
+				arg->f = num_float(Fixed::from_raw((int32_t)bits));
+#endif
+			} else if (wide) {
+				arg->f = bits_float(bits);
+			} else {
+				arg->f = half_to_float(b[0] | (b[1] << 8));
+			}
+			arg->type = k_float;
+		}
+		return true;
+	}
+
+	return false;
 }
 
-LineResult _input_from_stream(uint8_t * buf, uint16_t * idx, uint8_t c) {
-	LineResult result = k_line_ok;
+// Step s of the upload slot, from the len bytes at p: op, kinds,
+// operands. Returns the bytes it took, or 0 if it's bad.
+uint8_t decode_step(const uint8_t * p, uint8_t len, uint8_t s)
+{
+	if ((s >= MAX_STEPS) || (len < 2)) return 0;
 
-	// Room to store this?
-	if ((*idx) < MAX_LINE_LEN) {
-		buf[*idx] = c;
+	uint8_t pos = 2;
+	uint8_t kinds = p[1];
+
+	for (uint8_t a = 0; a < ARG_COUNT; a++) {
+		uint8_t kind = (kinds >> (a * 2)) & 0x3;
+		if (!frame_read_operand(&upload->args[s][a], kind, kinds & (FRAME_FULL_FLOATS | FRAME_RAW_FIXED), p, &pos, len)) {
+			return 0;
+		}
+	}
+
+	upload->op_codes[s] = p[0];
+	upload->step_hashes[s] = fnv1a(FNV1A_START, p, pos);
+	upload_written = true;
+	return pos;
+}
+
+bool decode_frame(const uint8_t * p, uint8_t len)
+{
+	if (len < FRAME_HEADER_SIZE + FRAME_CRC_SIZE) return false;
+
+	uint8_t end = len - FRAME_CRC_SIZE;
+	if (crc16(p, end) != ((p[end] << 8) | p[end + 1])) return false;
+	if (p[0] != FRAME_VERSION) return false;
+
+	uint8_t s = p[1];
+	uint8_t count = p[2];
+	uint8_t pos = FRAME_HEADER_SIZE;
+
+	for (uint8_t i = 0; i < count; i++, s++) {
+		uint8_t n = decode_step(&p[pos], end - pos, s);
+		if (!n) return false;
+		pos += n;
 	}
 
-	if ((*idx) == 0) {
-		result = k_line_first_byte;
+	return pos == end;
+}
+
+// Exact half float for f, or false
+bool float_to_half(float f, uint16_t * out)
+{
+	uint32_t b = float_bits(f);
+	uint16_t sign = (b >> 16) & 0x8000;
+	int32_t e = (int32_t)((b >> 23) & 0xff) - 127;
+	uint32_t m = b & 0x7fffff;
+
+	if ((b & 0x7fffffff) == 0) {
+		*out = sign;
+		return true;
 	}
 
-	// Advance to next character (line length is longer)
-	(*idx)++;
+	if ((e > 15) || (e < -24)) return false;
 
-	// End of line?
-	if (c == '\n') {
+	if (e >= -14) {
+		if (m & 0x1fff) return false;	// Needs more than 10 bits
+		*out = sign | ((e + 15) << 10) | (m >> 13);
+		return true;
+	}
 
-		// Finish a shareable message (lifespan is still valid)
-		if (buf[0] != '0') {
-			result = k_line_end;
-		}
+	// Subnormal half
+	uint32_t full = m | 0x800000;
+	uint8_t shift = 13 + (-14 - e);
+	if (full & ((1u << shift) - 1)) return false;
+	*out = sign | (full >> shift);
+	return true;
+}
 
-		// Valid line length?
-		if ((*idx) <= MAX_LINE_LEN) {
+// Writes one operand at *pos, as wide says (see frame_read_operand()).
+// Returns its OperandKind.
+uint8_t frame_write_operand(const Arg * arg, uint8_t wide, uint8_t * out, uint8_t * pos)
+{
+	if (arg->type == k_float) {
+		float f = num_float(arg->f);
+		if (f == 0.0f) return k_operand_zero;
 
-			// Process this line, one byte at a time
-			for (uint8_t i = 0; i < (*idx); i++) {
-				// State machine (function pointer)
-				serial_fp(buf[i]);
-			}
+		if (wide) {
+			uint32_t b = (wide & FRAME_RAW_FIXED) ? (uint32_t)num_raw(arg->f) : float_bits(f);
+			for (uint8_t i = 0; i < 4; i++) out[(*pos)++] = (b >> (i * 8)) & 0xff;
+		} else {
+			uint16_t h = 0;
+			float_to_half(f, &h);
+			out[(*pos)++] = h & 0xff;
+			out[(*pos)++] = h >> 8;
 		}
+		return k_operand_const;
+	}
+
+	if ((arg->fp >= values) && (arg->fp < values + MAX_STEPS)) {
+		uint16_t step = arg->fp - values;
+		do {
+			out[(*pos)++] = (step & 0x7f) | ((step > 0x7f) ? 0x80 : 0);
+			step >>= 7;
+		} while (step);
+		return k_operand_step;
 	}
 
-	// Do not share messages with expired lifespans.
-	if (buf[0] == '0') {
-		result = k_line_do_not_share;
+	for (uint8_t v = 0; v < FRAME_VAR_COUNT; v++) {
+		Arg probe;
+		if (special_var_arg(&probe, FRAME_VARS[v * 2], FRAME_VARS[v * 2 + 1]) && (probe.fp == arg->fp)) {
+			out[(*pos)++] = v;
+			return k_operand_var;
+		}
 	}
 
-	return result;
+	return k_operand_zero;	// Can't happen
 }
 
-LineResult computer_input_from_upstream(uint8_t x)
+// Step s of prog, as decode_frame() reads it: op, kinds, operands.
+// Constants are halves if they all fit, else floats. Under
+// FIXED_POINT, a constant with more than 24 significant bits
+// doesn't fit a float either: Then they go as raw Q16.16, so every
+// constant reads back exactly. Writes at most FRAME_STEP_MAX
+// bytes, and returns the count.
+uint8_t frame_write_step(const Program * prog, uint8_t s, uint8_t * out)
 {
-	LineResult result = _input_from_stream(upstreamBuf, &upstreamIdx, x);
+	uint8_t wide = 0;
+	for (uint8_t a = 0; a < ARG_COUNT; a++) {
+		uint16_t h;
+		const Arg * arg = &prog->args[s][a];
+		if (arg->type != k_float) continue;
+
+		if (!num_float_exact(arg->f)) {
+			wide = FRAME_RAW_FIXED;
+		} else if (!float_to_half(num_float(arg->f), &h) && !wide) {
+			wide = FRAME_FULL_FLOATS;
+		}
+	}
+
+	uint8_t pos = 2;
+	uint8_t kinds = wide;
+	for (uint8_t a = 0; a < ARG_COUNT; a++) {
+		kinds |= frame_write_operand(&prog->args[s][a], wide, out, &pos) << (a * 2);
+	}
 
-	if (result == k_line_end) {
-		upstreamIdx = 0;
+	out[0] = prog->op_codes[s];
+	out[1] = kinds;
+	return pos;
+}
+
+void serial_read_frame(uint8_t x) {
+	if (x == '\n') {
+		if (frame_escape || !decode_frame(frame_buf, frame_len)) {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
+
+		playlist.paused = true;	// Don't load a slot over the upload
+		serial_fp = serial_line_start;
+		return;
 	}
 
-	return result;
+	if (frame_escape) {
+		x ^= FRAME_ESC_XOR;
+		frame_escape = false;
+	} else if (x == FRAME_ESC) {
+		frame_escape = true;
+		return;
+	}
+
+	// Can't happen: The line fits in MAX_LINE_LEN
+	if (frame_len >= MAX_LINE_LEN) {
+		serial_error();
+		return;
+	}
+
+	frame_buf[frame_len++] = x;
+}
+
+//
+//  LINK RATE (linkrate.h)
+//
+//  'n' line: Step ('0'..), switch time on the synced clock (8 hex
+//      digits), then 't' for a trial or 'f' for final
+//  'v' line: Sequence (1 hex digit), LINK_PROBE_LEN payload bytes,
+//      then the CRC-16 of those (4 hex digits)
+//  'k' line: Step. Keep it.
+//
+//  Station 0 sends 'n' and 'k' to every other station, and 'v' all
+//  the way round the ring, back to itself.
+//
+
+// Varied bit patterns, but never a newline
+void link_probe_payload(uint8_t seq, uint8_t * out)
+{
+	uint8_t x = seq * 29 + 1;
+
+	for (uint8_t i = 0; i < LINK_PROBE_LEN; i++) {
+		x = x * 109 + 89;
+		out[i] = '0' + (x & 0x3f);
+	}
 }
 
-LineResult computer_input_from_usb(uint8_t x)
+// Station 0: The line for link_update()'s request. Returns its
+// length: At most LINK_LINE_MAX.
+uint8_t link_line(char * out, LinkSend what)
 {
-	LineResult result = _input_from_stream(usbBuf, &usbIdx, x);
+	uint8_t len = 0;
+
+	switch (what) {
+		case k_link_send_announce:
+			out[len++] = '0' + (STATION_COUNT - 2);
+			out[len++] = 'n';
+			out[len++] = '0' + link_rate.next;
+			write_hex(&out[len], link_rate.switch_at, 8);
+			len += 8;
+			out[len++] = link_rate.final ? 'f' : 't';
+			break;
+
+		case k_link_send_probe:
+		{
+			out[len++] = '0' + (STATION_COUNT - 1);
+			out[len++] = 'v';
+			write_hex(&out[len++], link_rate.probes_sent, 1);
+			link_probe_payload(link_rate.probes_sent & 0xf, (uint8_t *)&out[len]);
+			len += LINK_PROBE_LEN;
+			write_hex(&out[len], crc16((const uint8_t *)&out[2], 1 + LINK_PROBE_LEN), 4);
+			len += 4;
+		}
+		break;
+
+		case k_link_send_commit:
+			out[len++] = '0' + (STATION_COUNT - 2);
+			out[len++] = 'k';
+			out[len++] = '0' + link_rate.step;
+			break;
 
-	if (result == k_line_end) {
-		usbIdx = 0;
+		default:
+			return 0;
 	}
 
-	return result;
+	out[len++] = '\n';
+	return len;
 }
 
-void computer_run(uint16_t elapsedMillis)
+// A whole 'n', 'v' or 'k' line, without lifespan, type and newline.
+// Returns false if it's malformed.
+bool link_parse(const uint8_t * in, uint8_t len)
 {
-	float elapsed_f = elapsedMillis * (1.0f / 1000.0f);
-	vTime += elapsed_f;
+	uint32_t now = millis();
 
-	vLEDIndex = 0.0f;
-	vLEDRatio = 0.0f;
-	float ratioInc = 1.0f / vLEDCount;
+	switch (link_type) {
+		case 'n':
+		{
+			uint32_t switchAt;
+			uint8_t step = in[0] - '0';
+			if ((len != 10) || (step >= LINK_STEPS) || !read_hex(&in[1], 8, &switchAt)) return false;
+			if ((in[9] != 't') && (in[9] != 'f')) return false;
 
-	for (computeLED = 0; computeLED < LED_COUNT; computeLED++) {
+			if (station_id != 0) link_announced(&link_rate, step, switchAt, in[9] == 'f', now);
+			return true;
+		}
 
-		// Optimization: Only compute LEDs that exist.
-		if (!does_led_exist[computeLED]) {
-			continue;
+		case 'v':
+		{
+			uint32_t crc;
+			bool ok = (len == 1 + LINK_PROBE_LEN + 4) && read_hex(&in[1 + LINK_PROBE_LEN], 4, &crc) &&
+				(crc == crc16(in, 1 + LINK_PROBE_LEN));
+
+			// Station 0 sent it: It made it all the way round
+			link_probe(&link_rate, ok, station_id == 0, now);
+			return ok;
 		}
 
-		for (uint8_t s = 0; s < step_count; s++) {
-			compute_arg0 = &args[s][0];
-			values[s] = ops[s]();
+		case 'k':
+		{
+			uint8_t step = in[0] - '0';
+			if ((len != 1) || (step >= LINK_STEPS)) return false;
 
-			if (SERIAL_PRINT_RUN) {
-				Serial.print(s);
-				Serial.print(": ");
-				Serial.println(values[s]);
-			}
+			if (station_id != 0) link_committed(&link_rate, step, now);
+			return true;
+		}
+	}
 
-			if (DEBUG_STATE) {
-				Serial.print("ran ");
-				Serial.print(s);
-				Serial.print(": ");
-				Serial.println(values[s]);
-			}
-		}	// !for each step
+	return false;
+}
 
-		// Advance the varying floats
-		vLEDIndex += 1.0f;
-		vLEDRatio += ratioInc;
+void serial_read_link(uint8_t x) {
+	if (x == '\n') {
+		if (!link_parse(link_buf, link_len)) {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
 
-	}	// !for each LED
+		serial_fp = serial_line_start;
+		return;
+	}
 
-	if (DEBUG_STATE) {
-		Serial.println("~~~~~~~~~~~~~~~~~~~~~~~~");
+	if (link_len >= LINK_LINE_MAX) {
+		serial_error();
+		return;
 	}
 
+	link_buf[link_len++] = x;
+}
+
+//
+//  PROGRAM CACHE
+//
+//  Every program committed with a checksum ('c' line) is kept in
+//  RAM, CACHE_PROGRAMS at a time. Switching back to one is a single
+//  short line, instead of the whole upload:
+//
+//  'a' line: The program's commit checksum (8 hex digits). If it's
+//      cached, it's decoded into the upload slot and committed, as
+//      if it had just been uploaded.
+//
+//  The server keeps the same list (see server.js), so it only has
+//  to follow the same rules: Commits and hits make a program the
+//  most recent, and a commit that isn't cached replaces the least
+//  recent. Programs from the store don't touch the cache.
+//
+//  Entries take what their steps need from cache_pool[]. A big
+//  program can push out more than one, which the server doesn't
+//  know about. A miss keeps the live program and is counted: At
+//  station 0, the telemetry shows it, and the server goes back to
+//  full uploads.
+//
+
+CacheEntry * cache_find(uint32_t hash)
+{
+	for (uint8_t i = 0; i < CACHE_PROGRAMS; i++) {
+		if (program_cache[i].used && (program_cache[i].hash == hash)) return &program_cache[i];
+	}
+	return NULL;
+}
+
+// Bytes of cache_pool[] in use. They're packed: The rest is free.
+uint16_t cache_pool_used()
+{
+	uint16_t n = 0;
+	for (uint8_t i = 0; i < CACHE_PROGRAMS; i++) {
+		if (program_cache[i].used) n += program_cache[i].len;
+	}
+	return n;
+}
+
+// Frees an entry, and moves the steps above it down
+void cache_evict(CacheEntry * entry)
+{
+	uint16_t end = entry->start + entry->len;
+	memmove(&cache_pool[entry->start], &cache_pool[end], cache_pool_used() - end);
+
+	for (uint8_t i = 0; i < CACHE_PROGRAMS; i++) {
+		if (program_cache[i].used && (program_cache[i].start > entry->start)) {
+			program_cache[i].start -= entry->len;
+		}
+	}
+	entry->used = 0;
+}
+
+// The live program, just committed
+void cache_insert(uint32_t hash)
+{
+	CacheEntry * entry = cache_find(hash);
+
+	if (!entry) {
+		uint8_t step[FRAME_STEP_MAX];
+		uint16_t len = 0;
+		for (uint8_t s = 0; s < program->step_count; s++) {
+			len += frame_write_step(program, s, step);
+		}
+
+		// Least recent out, until there's an entry and room for it
+		while (true) {
+			entry = NULL;
+			CacheEntry * oldest = NULL;
+
+			for (uint8_t i = 0; i < CACHE_PROGRAMS; i++) {
+				CacheEntry * e = &program_cache[i];
+				if (!e->used) {
+					entry = e;
+				} else if (!oldest || (e->used < oldest->used)) {
+					oldest = e;
+				}
+			}
+
+			if (entry && (cache_pool_used() + len <= CACHE_POOL_SIZE)) break;
+			cache_evict(oldest);
+		}
+
+		entry->hash = hash;
+		entry->start = cache_pool_used();
+		entry->len = len;
+		entry->step_count = program->step_count;
+
+		uint16_t pos = entry->start;
+		for (uint8_t s = 0; s < program->step_count; s++) {
+			pos += frame_write_step(program, s, &cache_pool[pos]);
+		}
+	}
+
+	entry->used = ++cache_clock;
+}
+
+// Returns false if it isn't cached: The live program stays
+bool cache_activate(uint32_t hash)
+{
+	CacheEntry * entry = cache_find(hash);
+	if (!entry) {
+		telemetry.cache_misses++;
+		return false;
+	}
+
+	uint16_t pos = 0;
+	for (uint8_t s = 0; s < entry->step_count; s++) {
+		pos += decode_step(&cache_pool[entry->start + pos], min(entry->len - pos, FRAME_STEP_MAX), s);
+	}
+
+	program_commit(entry->step_count);
+	entry->used = ++cache_clock;
+	telemetry.cache_hits++;
+	return true;
+}
+
+void serial_read_activate(uint8_t x) {
+	if (x == '\n') {
+		if (commit_digits != 8) {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
+
+		cache_activate(commit_checksum);
+		serial_fp = serial_line_start;
+		return;
+	}
+
+	int8_t digit = hex_digit(x);
+	if ((digit < 0) || (commit_digits == 8)) {
+		serial_error();
+		return;
+	}
+
+	commit_checksum = (commit_checksum << 4) | digit;
+	commit_digits++;
+}
+
+//
+//  PROGRAM STORE
+//
+//  Programs saved in EEPROM, so a station boots straight into its
+//  animation, and the attract loop changes over the wire instead
+//  of by reflashing. The VM's own layout points into values[] and
+//  this station's layout tables, so a slot holds the program as
+//  binary frames (see decode_frame()), with full floats where a
+//  half isn't exact. Loading reads them and decodes: No text.
+//
+//    Header: 'L' 'S', STORE_VERSION, playlist count, seconds per
+//            program (u16), playlist slots
+//    Slot:   step count (0xff: empty), gamma, brightness, checksum
+//            (u32: upload_checksum() of the decoded steps), then
+//            frames: u8 length, frame
+//
+//  'w' line: Save the live program in a slot ('0'..)
+//  'r' line: Load a slot. (Pauses the playlist, like an upload.)
+//  'l' line: Playlist: seconds per program (4 hex digits), then
+//      slots. Programs change on the synced clock (timesync.h), so
+//      the stations change together. No slots: Stop.
+//
+
+#define STORE_MAGIC0       ('L')
+#define STORE_MAGIC1       ('S')
+#define STORE_VERSION      (1)
+#define STORE_HEADER_SIZE  (6 + STORE_PLAYLIST_MAX)
+#define STORE_SLOT_HEADER  (7)
+#define STORE_SLOT_SIZE    ((STORE_SIZE - STORE_HEADER_SIZE) / STORE_SLOTS)	// 508: At least 33 steps
+#define STORE_EMPTY        (0xff)	// Slot step count: Never saved, or saving
+
+uint16_t store_slot_addr(uint8_t slot)
+{
+	return STORE_HEADER_SIZE + slot * STORE_SLOT_SIZE;
+}
+
+void store_read(uint16_t addr, uint8_t * out, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++) {
+		out[i] = EEPROM.read(addr + i);
+	}
+}
+
+// Only the bytes that changed: EEPROM wears out
+void store_write(uint16_t addr, const uint8_t * in, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++) {
+		EEPROM.update(addr + i, in[i]);
+	}
+}
+
+bool store_valid()
+{
+	return (EEPROM.read(0) == STORE_MAGIC0) && (EEPROM.read(1) == STORE_MAGIC1) && (EEPROM.read(2) == STORE_VERSION);
+}
+
+void store_write_playlist()
+{
+	uint8_t header[STORE_HEADER_SIZE] = {STORE_MAGIC0, STORE_MAGIC1, STORE_VERSION, playlist.count,
+		(uint8_t)(playlist.seconds & 0xff), (uint8_t)(playlist.seconds >> 8)};
+	memcpy(&header[6], playlist.slots, STORE_PLAYLIST_MAX);
+
+	store_write(0, header, STORE_HEADER_SIZE);
+}
+
+// A new Teensy (or an old layout): Empty slots, no playlist
+void store_format()
+{
+	memset(&playlist, 0, sizeof(playlist));
+	playlist.current = STORE_PLAYLIST_MAX;
+
+	for (uint8_t slot = 0; slot < STORE_SLOTS; slot++) {
+		EEPROM.update(store_slot_addr(slot), STORE_EMPTY);
+	}
+	store_write_playlist();
+}
+
+// Adds the CRC, and writes the frame at *addr, after its length
+bool store_write_frame(uint8_t * frame, uint8_t len, uint16_t * addr, uint16_t end)
+{
+	uint16_t crc = crc16(frame, len);
+	frame[len++] = crc >> 8;
+	frame[len++] = crc & 0xff;
+
+	if ((*addr) + 1 + len > end) return false;
+
+	EEPROM.update((*addr)++, len);
+	store_write(*addr, frame, len);
+	(*addr) += len;
+	return true;
+}
+
+// The live program, and gamma and brightness. Returns false if it
+// doesn't fit: The slot is left empty.
+bool store_save(uint8_t slot)
+{
+	if (slot >= STORE_SLOTS) return false;
+	if (!store_valid()) store_format();
+
+	uint16_t base = store_slot_addr(slot);
+	uint16_t addr = base + STORE_SLOT_HEADER;
+	uint16_t end = base + STORE_SLOT_SIZE;
+
+	// Empty until the last byte, so a reset mid-save can't leave
+	// half a program
+	EEPROM.update(base, STORE_EMPTY);
+
+	uint8_t frame[MAX_LINE_LEN];
+	uint8_t len = FRAME_HEADER_SIZE;
+	uint32_t checksum = FNV1A_START;
+
+	frame[0] = FRAME_VERSION;
+	frame[1] = 0;	// First step
+	frame[2] = 0;	// Step count
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		uint8_t step[FRAME_STEP_MAX];
+		uint8_t n = frame_write_step(program, s, step);
+
+		// As decode_frame() will hash it
+		uint32_t h = fnv1a(FNV1A_START, step, n);
+		uint8_t le[4] = {(uint8_t)h, (uint8_t)(h >> 8), (uint8_t)(h >> 16), (uint8_t)(h >> 24)};
+		checksum = fnv1a(checksum, le, 4);
+
+		if (len + n + FRAME_CRC_SIZE > MAX_LINE_LEN) {
+			if (!store_write_frame(frame, len, &addr, end)) return false;
+			frame[1] = s;
+			frame[2] = 0;
+			len = FRAME_HEADER_SIZE;
+		}
+
+		memcpy(&frame[len], step, n);
+		len += n;
+		frame[2]++;
+	}
+
+	if (frame[2] && !store_write_frame(frame, len, &addr, end)) return false;
+
+	uint8_t header[STORE_SLOT_HEADER - 1] = {gamma_on, brightness,
+		(uint8_t)checksum, (uint8_t)(checksum >> 8), (uint8_t)(checksum >> 16), (uint8_t)(checksum >> 24)};
+	store_write(base + 1, header, sizeof(header));
+	EEPROM.update(base, program->step_count);
+	return true;
+}
+
+// Decodes a slot into the upload slot, and commits it. Returns
+// false if it's empty or damaged: The live program stays, and
+// whatever was decoded is dropped (a plain 'c' won't commit it).
+bool store_load(uint8_t slot)
+{
+	if ((slot >= STORE_SLOTS) || !store_valid()) return false;
+
+	uint16_t base = store_slot_addr(slot);
+	uint16_t addr = base + STORE_SLOT_HEADER;
+	uint16_t end = base + STORE_SLOT_SIZE;
+
+	uint8_t header[STORE_SLOT_HEADER];
+	store_read(base, header, STORE_SLOT_HEADER);
+
+	uint8_t count = header[0];
+	if (count > MAX_STEPS) return false;	// STORE_EMPTY
+
+	uint32_t checksum = header[3] | (header[4] << 8) | (header[5] << 16) | ((uint32_t)header[6] << 24);
+	uint8_t frame[MAX_LINE_LEN];
+	uint8_t loaded = 0;
+
+	while (loaded < count) {
+		if (addr >= end) break;
+
+		uint8_t len = EEPROM.read(addr++);
+		if ((len > MAX_LINE_LEN) || (addr + len > end)) break;
+
+		store_read(addr, frame, len);
+		addr += len;
+
+		if (!decode_frame(frame, len) || (frame[1] != loaded) || (frame[2] == 0)) break;
+		loaded += frame[2];
+	}
+
+	if ((loaded != count) || (upload_checksum(count) != checksum)) {
+		upload_written = false;
+		return false;
+	}
+
+	program_commit(count);
+	set_gamma_and_brightness(header[1], header[2]);
+	return true;
+}
+
+void store_set_playlist(const uint8_t * slots, uint8_t count, uint16_t seconds)
+{
+	if (!store_valid()) store_format();
+
+	memset(&playlist, 0, sizeof(playlist));
+	memcpy(playlist.slots, slots, count);
+	playlist.count = count;
+	playlist.seconds = seconds;
+	playlist.current = STORE_PLAYLIST_MAX;
+
+	store_write_playlist();
+}
+
+// Each frame: Load the playlist's program for the synced time. An
+// upload coming in pauses it (see serial_read_frame()), before it
+// can load over the half-received steps.
+void playlist_update()
+{
+	if ((playlist.count == 0) || playlist.paused) return;
+
+	uint8_t i = 0;
+	if ((playlist.count > 1) && (playlist.seconds > 0)) {
+		i = (time_sync_now(&time_sync, micros()) / (playlist.seconds * 1000UL)) % playlist.count;
+	}
+	if (i == playlist.current) return;
+
+	// A bad slot: Keep what's running, and don't try again until
+	// the next one is due
+	playlist.current = i;
+	store_load(playlist.slots[i]);
+	playlist.paused = false;
+}
+
+// At boot: Load the playlist from the store. Returns false for a
+// new store, with nothing in it.
+bool store_boot()
+{
+	if (!store_valid()) {
+		store_format();
+		return false;
+	}
+
+	uint8_t header[STORE_HEADER_SIZE];
+	store_read(0, header, STORE_HEADER_SIZE);
+
+	memset(&playlist, 0, sizeof(playlist));
+	playlist.count = min(header[3], STORE_PLAYLIST_MAX);
+	playlist.seconds = header[4] | (header[5] << 8);
+	playlist.current = STORE_PLAYLIST_MAX;
+
+	for (uint8_t i = 0; i < playlist.count; i++) {
+		playlist.slots[i] = min(header[6 + i], STORE_SLOTS - 1);
+	}
+
+	playlist_update();
+	return true;
+}
+
+void serial_read_store_slot(uint8_t x) {
+	uint8_t slot = x - '0';
+	bool ok = (slot < STORE_SLOTS) && ((store_op == 'w') ? store_save(slot) : store_load(slot));
+
+	if (!ok) {
+		serial_error();
+		return;
+	}
+
+	serial_fp = serial_wait_for_newline;
+}
+
+void serial_read_playlist(uint8_t x) {
+	if (x == '\n') {
+		bool timed = (playlist_in.seconds > 0) || (playlist_in.count <= 1);
+		if ((playlist_digits != 4) || !timed) {
+			serial_error();
+			serial_wait_for_newline(x);
+			return;
+		}
+
+		store_set_playlist(playlist_in.slots, playlist_in.count, playlist_in.seconds);
+		serial_fp = serial_line_start;
+		return;
+	}
+
+	if (playlist_digits < 4) {
+		int8_t digit = hex_digit(x);
+		if (digit < 0) {
+			serial_error();
+			return;
+		}
+
+		playlist_in.seconds = (playlist_in.seconds << 4) | digit;
+		playlist_digits++;
+		return;
+	}
+
+	uint8_t slot = x - '0';
+	if ((slot >= STORE_SLOTS) || (playlist_in.count == STORE_PLAYLIST_MAX)) {
+		serial_error();
+		return;
+	}
+
+	playlist_in.slots[playlist_in.count++] = slot;
+}
+
+void serial_error() {
+	telemetry.line_errors++;
+	serial_fp = serial_wait_for_newline;
+}
+
+void serial_wait_for_newline(uint8_t x)
+{
+	if (x == '\n') {
+		serial_fp = serial_line_start;
+	}
+}
+
+//
+//  PROFILER (PROFILE_STEPS)
+//
+
+#if PROFILE_STEPS
+
+// Teensyduino maps ARM_DWT_CYCCNT to the DWT cycle counter.
+// The host stub reads the TSC instead.
+inline uint32_t profile_cycles() { return ARM_DWT_CYCCNT; }
+
+void profile_init()
+{
+#ifdef __arm__
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+}
+
+void profile_reset()
+{
+	memset(profile_sums, 0, sizeof(profile_sums));
+	profile_frames = 0;
+}
+
+inline void profile_step(uint8_t s, uint32_t start)
+{
+	profile_sums[s] += profile_cycles() - start;
+}
+
+#else
+
+// Off: The callers' if (PROFILE_STEPS) drops these
+inline uint32_t profile_cycles() { return 0; }
+inline void profile_init() {}
+inline void profile_reset() {}
+inline void profile_step(uint8_t s, uint32_t start) {}
+
+#endif
+
+//
+//  INIT, INPUT
+//
+
+void computer_init(OctoWS2811 * inLEDs) {
+	memset(&telemetry, 0, sizeof(telemetry));
+	if (PROFILE_STEPS) {
+		profile_init();
+		profile_reset();
+	}
+	randomSeed(1337);
+	set_station_id(STATION_ID);
+	time_sync_init(&time_sync, micros());
+	link_init(&link_rate, millis());
+	reset_time_and_accumulators();
+	reroll_noise();
+	set_gamma_and_brightness(DEFAULT_GAMMA, DEFAULT_BRIGHT);
+	serial_fp = serial_line_start;
+	_leds = inLEDs;
+}
+
+// Buffer a line, and parse it at the newline. Forwarding is done
+// elsewhere (ring.h), so this only sees this station's copy.
+void _input_from_stream(uint8_t * buf, uint16_t * idx, uint8_t c) {
+	telemetry.bytes_received++;
+
+	// Room to store this?
+	if ((*idx) < MAX_LINE_LEN) {
+		buf[*idx] = c;
+	}
+
+	// Advance to next character (line length is longer)
+	(*idx)++;
+
+	// End of line?
+	if (c == '\n') {
+
+		// Valid line length?
+		if ((*idx) <= MAX_LINE_LEN) {
+			line_hash = fnv1a(FNV1A_START, &buf[1], ((*idx) >= 2) ? ((*idx) - 2) : 0);
+			line_lifespan = buf[0];
+
+			// Process this line, one byte at a time
+			for (uint8_t i = 0; i < (*idx); i++) {
+				// State machine (function pointer)
+				serial_fp(buf[i]);
+			}
+		} else {
+			telemetry.bytes_dropped += (*idx);
+		}
+
+		(*idx) = 0;
+		line_arrival_known = false;
+	}
+}
+
+void computer_input_from_upstream(uint8_t x)
+{
+	_input_from_stream(upstreamBuf, &upstreamIdx, x);
+}
+
+void computer_input_from_usb(uint8_t x)
+{
+	_input_from_stream(usbBuf, &usbIdx, x);
+}
+
+//
+//  PLANNING
+//
+
+// Index of the step this arg reads, or -1
+int8_t arg_source_step(Arg * arg)
+{
+	if ((arg->type == k_float_ptr) && (values <= arg->fp) && (arg->fp < values + MAX_STEPS)) {
+		return arg->fp - values;
+	}
+
+	return -1;
+}
+
+// Which StepDep bits does this arg bring to step s?
+uint8_t arg_deps(Arg * arg, uint8_t s)
+{
+	if (arg->type == k_array_of_floats) {
+		return k_dep_led;
+	}
+
+	if (arg->type == k_float) {
+		return k_dep_const;
+	}
+
+	// Computed value from another step
+	int8_t src = arg_source_step(arg);
+	if (src >= 0) {
+		// Reading a step that runs later (or this step) sees the
+		// previous LED's value. Keep that in the LED loop, as-is.
+		if (src >= s) {
+			return k_dep_state;
+		}
+
+		return step_deps[src];
+	}
+
+	if ((arg->fp == &vLEDIndex) || (arg->fp == &vLEDRatio)) {
+		return k_dep_led;
+	}
+
+	// vTime, vStationID, vLEDCount
+	return k_dep_frame;
+}
+
+// Same for every frame, but not for every LED
+inline bool is_led_invariant(uint8_t deps) {
+	return (deps & k_dep_led) && !(deps & (k_dep_frame | k_dep_state));
+}
+
+inline bool is_frame_invariant(uint8_t deps) {
+	return !(deps & (k_dep_led | k_dep_state));
+}
+
+// Evaluate the LED-invariant steps for every LED, and keep
+// the ones the LED loop needs in led_cache[].
+void fill_led_cache()
+{
+	// Specialized for args[], not run_args[]
+	OpFn cache_ops[MAX_STEPS];
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		cache_ops[s] = select_op(program->op_codes[s], program->args[s]);
+
+		// LED-invariant steps may read constant steps
+		if (step_deps[s] == k_dep_const) {
+			compute_arg0 = &program->args[s][0];
+			values[s] = cache_ops[s]();
+		}
+	}
+
+	Num ledIndex = 0.0f;
+	Num ledRatio = 0.0f;
+	Num ratioInc = 1.0f / vLEDCount;
+
+	for (computeLED = 0; computeLED < led_count; computeLED++) {
+		vLEDIndex = ledIndex;
+		vLEDRatio = ledRatio;
+
+		for (uint8_t s = 0; s < program->step_count; s++) {
+			if (!is_led_invariant(step_deps[s])) {
+				continue;
+			}
+
+			compute_arg0 = &program->args[s][0];
+			values[s] = cache_ops[s]();
+
+			if (step_cache[s] >= 0) {
+				led_cache[step_cache[s]][computeLED] = values[s];
+			}
+		}
+
+		ledIndex += 1.0f;
+		ledRatio += ratioInc;
+	}
+}
+
+void decode_inst(Inst * inst, uint8_t s)
+{
+	inst->code = run_codes[s];
+	inst->dst = s;
+
+	for (uint8_t a = 0; a < ARG_COUNT; a++) {
+		Arg * arg = &run_args[s][a];
+
+		if (arg->type == k_float) {
+			inst->src[a] = &arg->f;
+			inst->mask[a] = 0;
+
+		} else {
+			inst->src[a] = arg->fp;
+			inst->mask[a] = (arg->type == k_array_of_floats) ? 0xffff : 0;
+		}
+	}
+}
+
+// Row for a per-LED array, gathered for each block of lanes
+const Num * lane_input(const Num * src)
+{
+	for (uint8_t g = 0; g < lane_input_count; g++) {
+		if (lane_input_src[g] == src) return lane_inputs[g];
+	}
+
+	if (lane_input_count >= LANE_INPUT_COUNT) return NULL;
+
+	lane_input_src[lane_input_count] = src;
+	return lane_inputs[lane_input_count++];
+}
+
+// Decode led_steps for the lane engine. Clears lanes_ok when
+// running step-by-step would change the result:
+//   * A step reads a later step (or itself): the previous LED's value
+//   * More than one step calls rand: the order of random() calls
+bool plan_lanes(bool * in_loop)
+{
+	uint8_t rand_steps = 0;
+	lane_input_count = 0;
+
+	for (uint8_t i = 0; i < led_step_count; i++) {
+		uint8_t s = led_steps[i];
+		uint8_t code = run_codes[s];
+		uint8_t arity = op_arity(code);
+		LaneStep * step = &lane_steps[i];
+		uint8_t mask = 0;
+
+		if ((code == 'z') || (code == 'Z')) {
+			rand_steps++;
+		}
+
+		step->dst = lanes[s];
+
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			Arg * arg = &run_args[s][a];
+			const Num * row = NULL;
+
+			if (arg->type == k_float) {
+				step->src[a] = &arg->f;
+				continue;
+			}
+
+			step->src[a] = arg->fp;
+			if (a >= arity) continue;
+
+			int8_t src = arg_source_step(arg);
+
+			if (arg->type == k_array_of_floats) {
+				row = lane_input(arg->fp);
+				if (!row) return false;
+
+			} else if (src >= 0) {
+				if (src >= s) return false;
+				if (in_loop[src]) row = lanes[src];
+
+			} else if (arg->fp == &vLEDIndex) {
+				row = lane_index;
+
+			} else if (arg->fp == &vLEDRatio) {
+				row = lane_ratio;
+			}
+
+			if (row) {
+				step->src[a] = row;
+				mask |= (1 << a);
+			}
+		}
+
+		lane_ops[i] = select_lane_op(code, mask);
+	}
+
+	return (rand_steps <= 1);
+}
+
+// Step that `arg` of step c reads, if it can be fused into c:
+// It runs in the LED loop, just for c, and has the given code.
+int8_t fusable_source(Arg * arg, uint8_t c, uint8_t code, bool * in_loop, uint8_t * readers)
+{
+	int8_t p = arg_source_step(arg);
+
+	if ((p < 0) || (p >= c) || !in_loop[p] || (readers[p] != 1)) return -1;
+	if (step_deps[p] & k_dep_state) return -1;
+	if (run_codes[p] != code) return -1;
+
+	return p;
+}
+
+// Peephole pass: Merge chains of LED-loop steps into fused ops.
+// The producer step is dropped from the loop; its args move
+// into the consumer.
+void fuse_steps(bool * in_loop)
+{
+	uint8_t readers[MAX_STEPS];
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		readers[s] = 0;
+	}
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			int8_t src = arg_source_step(&program->args[s][a]);
+			if (src >= 0) readers[src]++;
+		}
+	}
+
+	for (uint8_t c = 0; c < program->step_count; c++) {
+		if (!in_loop[c]) continue;
+
+		Arg * ca = run_args[c];
+		int8_t p = -1;
+
+		switch (run_codes[c]) {
+			// a * b + c
+			case '+':
+			{
+				for (uint8_t i = 0; (i < 2) && (p < 0); i++) {
+					p = fusable_source(&ca[i], c, '*', in_loop, readers);
+					if (p >= 0) {
+						ca[2] = ca[1 - i];
+						ca[0] = run_args[p][0];
+						ca[1] = run_args[p][1];
+						run_codes[c] = OP_MADD;
+					}
+				}
+			}
+			break;
+
+			// frac(a * b + c)
+			case '.':
+			{
+				p = fusable_source(&ca[0], c, OP_MADD, in_loop, readers);
+				if (p >= 0) {
+					ca[0] = run_args[p][0];
+					ca[1] = run_args[p][1];
+					ca[2] = run_args[p][2];
+					run_codes[c] = OP_FRACMADD;
+				}
+			}
+			break;
+
+			// 1 - frac(...)
+			case '-':
+			{
+				if ((ca[0].type != k_float) || (ca[0].f != 1.0f)) break;
+
+				p = fusable_source(&ca[1], c, '.', in_loop, readers);
+				if (p >= 0) {
+					ca[0] = run_args[p][0];
+					run_codes[c] = OP_RFRAC;
+					break;
+				}
+
+				p = fusable_source(&ca[1], c, OP_FRACMADD, in_loop, readers);
+				if (p >= 0) {
+					ca[0] = run_args[p][0];
+					ca[1] = run_args[p][1];
+					ca[2] = run_args[p][2];
+					run_codes[c] = OP_RFRACMADD;
+				}
+			}
+			break;
+
+			// hsv(h, s, sinq(v))
+			case ']':
+			{
+				p = fusable_source(&ca[2], c, 'q', in_loop, readers);
+				if (p >= 0) {
+					ca[2] = run_args[p][0];
+					run_codes[c] = OP_HSVSINQ;
+				}
+			}
+			break;
+		}
+
+		if (p >= 0) {
+			in_loop[p] = false;
+		}
+	}
+}
+
+// Classify each step by what it reads, and split the program
+// into steps that run once per frame, steps that run per LED,
+// and LED-invariant steps that are cached at plan time.
+void plan_program()
+{
+	frame_step_count = 0;
+	led_step_count = 0;
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		uint8_t deps = k_dep_const;
+
+		switch (program->op_codes[s]) {
+			case 'z':	// rand: different for every LED
+			case 'Z':
+			case '0':	// accum0: per-LED state
+			case '[':	// rgb, hsv: per-LED output
+			case ']':
+			{
+				deps |= k_dep_state;
+			}
+			break;
+		}
+
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			deps |= arg_deps(&program->args[s][a], s);
+		}
+
+		step_deps[s] = deps;
+	}
+
+	// LED-invariant steps read by the LED loop get a cache slot.
+	// Walk backwards: When the slots run out, the step is computed
+	// in the LED loop instead, and its own sources need caching.
+	// An LED-invariant step read by an earlier step (a forward
+	// reference) must run in the LED loop too: Its reader wants the
+	// previous LED's value, not the last one from plan time.
+	bool needed[MAX_STEPS];
+	bool forward[MAX_STEPS];
+	bool in_loop[MAX_STEPS];
+	uint8_t slots = 0;
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		needed[s] = false;
+		forward[s] = false;
+	}
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			int8_t src = arg_source_step(&program->args[s][a]);
+			if (src > s) forward[src] = true;
+		}
+	}
+
+	for (int8_t s = program->step_count - 1; s >= 0; s--) {
+		step_cache[s] = -1;
+		in_loop[s] = !is_frame_invariant(step_deps[s]);
+
+		if (is_led_invariant(step_deps[s]) && !forward[s]) {
+			if (!needed[s]) {
+				in_loop[s] = false;
+
+			} else if (slots < LED_CACHE_COUNT) {
+				step_cache[s] = slots++;
+				in_loop[s] = false;
+			}
+		}
+
+		if (!in_loop[s]) {
+			continue;
+		}
+
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			int8_t src = arg_source_step(&program->args[s][a]);
+			if ((0 <= src) && (src < s) && is_led_invariant(step_deps[src])) {
+				needed[src] = true;
+			}
+		}
+	}
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		run_codes[s] = program->op_codes[s];
+
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			run_args[s][a] = program->args[s][a];
+
+			int8_t src = arg_source_step(&program->args[s][a]);
+			if ((src >= 0) && (step_cache[src] >= 0)) {
+				run_args[s][a].fp = led_cache[step_cache[src]];
+				run_args[s][a].type = k_array_of_floats;
+			}
+		}
+
+	}
+
+	if (fusion_enabled) {
+		fuse_steps(in_loop);
+	}
+
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		ops[s] = select_op(run_codes[s], run_args[s]);
+
+		if (in_loop[s]) {
+			led_steps[led_step_count++] = s;
+
+		} else if (is_frame_invariant(step_deps[s])) {
+			frame_steps[frame_step_count++] = s;
+		}
+	}
+
+	if (LANE_ENGINE) {
+		lanes_ok = plan_lanes(in_loop);
+	}
+
+	if (THREADED_ENGINE) {
+		for (uint8_t i = 0; i < frame_step_count; i++) {
+			decode_inst(&insts[i], frame_steps[i]);
+		}
+
+		for (uint8_t i = 0; i < led_step_count; i++) {
+			decode_inst(&insts[frame_step_count + i], led_steps[i]);
+		}
+	}
+
+	if (slots > 0) {
+		fill_led_cache();
+	}
+
+	// Step numbers mean something else now
+	if (PROFILE_STEPS) {
+		profile_reset();
+	}
+
+	program_dirty = false;
+}
+
+inline void run_step(uint8_t s)
+{
+	uint32_t start = PROFILE_STEPS ? profile_cycles() : 0;
+
+	compute_arg0 = &run_args[s][0];
+	values[s] = ops[s]();
+
+	if (PROFILE_STEPS) {
+		profile_step(s, start);
+	}
+
+	if (SERIAL_PRINT_RUN) {
+		Serial.print(s);
+		Serial.print(": ");
+		Serial.println(num_float(values[s]));
+	}
+
+	if (DEBUG_STATE) {
+		Serial.print("ran ");
+		Serial.print(s);
+		Serial.print(": ");
+		Serial.println(num_float(values[s]));
+	}
+}
+
+// ops[] engine: one call per step
+void run_steps()
+{
+	Num ratioInc = 1.0f / vLEDCount;
+
+	// Frame-invariant steps: Same result for every LED
+	computeLED = 0;
+	for (uint8_t i = 0; i < frame_step_count; i++) {
+		run_step(frame_steps[i]);
+	}
+
+	for (computeLED = 0; computeLED < led_count; computeLED++) {
+		for (uint8_t i = 0; i < led_step_count; i++) {
+			run_step(led_steps[i]);
+		}	// !for each step
+
+		// Advance the varying floats
+		vLEDIndex += 1.0f;
+		vLEDRatio += ratioInc;
+
+	}	// !for each LED
+}
+
+#define OP_THREADED_CASE(code, name, arity) \
+	case code: {r = OP_CALL_##arity(_##name, x0, x1, x2);} break;
+
+// Threaded engine: Decoded insts, one switch, no calls.
+// The LED index and operand pointers stay in registers.
+inline void run_insts(const Inst * inst, const Inst * end, uint16_t led)
+{
+	for (; inst < end; inst++) {
+		uint32_t start = PROFILE_STEPS ? profile_cycles() : 0;
+
+		Num x0 = inst->src[0][led & inst->mask[0]];
+		Num x1 = inst->src[1][led & inst->mask[1]];
+		Num x2 = inst->src[2][led & inst->mask[2]];
+		Num r;
+
+		switch (inst->code) {
+			OP_LIST(OP_THREADED_CASE)
+			FUSED_OP_LIST(OP_THREADED_CASE)
+			default: {r = _nop();} break;
+		}
+
+		values[inst->dst] = r;
+
+		if (PROFILE_STEPS) {
+			profile_step(inst->dst, start);
+		}
+	}
+}
+
+void run_threaded()
+{
+	Num ratioInc = 1.0f / vLEDCount;
+	const Inst * ledInsts = &insts[frame_step_count];
+	const Inst * end = ledInsts + led_step_count;
+
+	// Frame-invariant steps: Same result for every LED
+	computeLED = 0;
+	run_insts(insts, ledInsts, 0);
+
+	for (uint16_t led = 0; led < led_count; led++) {
+		computeLED = led;	// for accum0, rgb, hsv
+		run_insts(ledInsts, end, led);
+
+		// Advance the varying floats
+		vLEDIndex += 1.0f;
+		vLEDRatio += ratioInc;
+	}
+}
+
+// Lane engine: Column-major. Each step runs for a block of up to
+// LANE_WIDTH LEDs, into lanes[step][], then the next step runs.
+void run_lanes()
+{
+	Num ledIndex = 0.0f;
+	Num ledRatio = 0.0f;
+	Num ratioInc = 1.0f / vLEDCount;
+	uint16_t led = 0;
+
+	// Frame-invariant steps: Same result for every LED
+	computeLED = 0;
+	for (uint8_t i = 0; i < frame_step_count; i++) {
+		run_step(frame_steps[i]);
+	}
+
+	while (led < led_count) {
+		uint8_t n = min(led_count - led, LANE_WIDTH);
+
+		for (uint8_t j = 0; j < n; j++) {
+			lane_leds[j] = led + j;
+			lane_index[j] = ledIndex;
+			lane_ratio[j] = ledRatio;
+
+			// Advance the varying floats
+			ledIndex += 1.0f;
+			ledRatio += ratioInc;
+		}
+
+		// Per-LED arrays are packed, so each row is a straight copy
+		for (uint8_t g = 0; g < lane_input_count; g++) {
+			memcpy(lane_inputs[g], &lane_input_src[g][led], n * sizeof(Num));
+		}
+
+		led += n;
+
+		for (uint8_t i = 0; i < led_step_count; i++) {
+			uint32_t start = PROFILE_STEPS ? profile_cycles() : 0;
+
+			lane_ops[i](&lane_steps[i], n);
+
+			if (PROFILE_STEPS) {
+				profile_step(led_steps[i], start);
+			}
+		}
+	}
+
+	vLEDIndex = ledIndex;
+	vLEDRatio = ledRatio;
+}
+
+//
+//  TELEMETRY
+//
+
+void telemetry_put16(uint8_t * out, uint8_t * pos, uint16_t v)
+{
+	out[(*pos)++] = v & 0xff;
+	out[(*pos)++] = v >> 8;
+}
+
+void telemetry_put32(uint8_t * out, uint8_t * pos, uint32_t v)
+{
+	telemetry_put16(out, pos, v & 0xffff);
+	telemetry_put16(out, pos, v >> 16);
+}
+
+// Binary record, little-endian, TELEMETRY_SIZE bytes:
+//   0xff 'Q'
+//   u8  station_id, u8 step count
+//   u32 run last, min, max, avg (micros)
+//   u32 show (micros)
+//   u16 fps * 100
+//   u32 bytes received, forwarded, dropped
+//   u16 line errors
+//   u32 frames in the run stats
+//   u32 pump passes cut short, parse queue full: USB, upstream
+//   u16 most bytes waiting to be parsed
+//   u32 ring baud rate (linkrate.h)
+//   u16 link probes received: intact, failed the CRC
+//   u16 program cache: hits, misses ('a' lines)
+//   u8  checksum: sum of the payload bytes
+// Then the run stats start over.
+void send_telemetry()
+{
+	uint8_t out[TELEMETRY_SIZE];
+	uint8_t pos = 0;
+
+	out[pos++] = TELEMETRY_MAGIC0;
+	out[pos++] = TELEMETRY_MAGIC1;
+	out[pos++] = station_id;
+	out[pos++] = program->step_count;
+
+	uint32_t frames = telemetry.run_frames;
+	telemetry_put32(out, &pos, telemetry.run_last);
+	telemetry_put32(out, &pos, frames ? telemetry.run_min : 0);
+	telemetry_put32(out, &pos, telemetry.run_max);
+	telemetry_put32(out, &pos, frames ? (telemetry.run_total / frames) : 0);
+	telemetry_put32(out, &pos, telemetry.show_micros);
+	telemetry_put16(out, &pos, telemetry.fps_x100);
+	telemetry_put32(out, &pos, telemetry.bytes_received);
+	telemetry_put32(out, &pos, telemetry.bytes_forwarded);
+	telemetry_put32(out, &pos, telemetry.bytes_dropped);
+	telemetry_put16(out, &pos, telemetry.line_errors);
+	telemetry_put32(out, &pos, frames);
+	telemetry_put32(out, &pos, telemetry.usb_overflows);
+	telemetry_put32(out, &pos, telemetry.upstream_overflows);
+	telemetry_put16(out, &pos, telemetry.backlog_max);
+	telemetry_put32(out, &pos, link_baud(&link_rate));
+	telemetry_put16(out, &pos, link_rate.probes_ok);
+	telemetry_put16(out, &pos, link_rate.probes_bad);
+	telemetry_put16(out, &pos, telemetry.cache_hits);
+	telemetry_put16(out, &pos, telemetry.cache_misses);
+
+	uint8_t sum = 0;
+	for (uint8_t i = 2; i < pos; i++) {
+		sum += out[i];
+	}
+	out[pos++] = sum;
+
+	Serial.write(out, pos);
+
+	telemetry.run_min = 0;
+	telemetry.run_max = 0;
+	telemetry.run_total = 0;
+	telemetry.run_frames = 0;
+}
+
+// Binary record, little-endian, 9 + 4 * count bytes:
+//   0xff 'P'
+//   u8  station_id, u8 count: step count
+//   u32 frames profiled
+//   u32 cycles per frame, for each step
+//   u8  checksum: sum of the payload bytes
+// Then the profile starts over.
+#if PROFILE_STEPS
+void send_profile()
+{
+	uint8_t out[9 + MAX_STEPS * 4];
+	uint8_t pos = 0;
+	uint8_t count = program->step_count;
+	uint32_t frames = profile_frames;
+
+	out[pos++] = TELEMETRY_MAGIC0;
+	out[pos++] = PROFILE_MAGIC1;
+	out[pos++] = station_id;
+	out[pos++] = count;
+	telemetry_put32(out, &pos, frames);
+
+	for (uint8_t s = 0; s < count; s++) {
+		telemetry_put32(out, &pos, frames ? (uint32_t)(profile_sums[s] / frames) : 0);
+	}
+
+	uint8_t sum = 0;
+	for (uint8_t i = 2; i < pos; i++) {
+		sum += out[i];
+	}
+	out[pos++] = sum;
+
+	Serial.write(out, pos);
+
+	profile_reset();
+}
+#endif
+
+void telemetry_run(uint32_t runMicros)
+{
+	telemetry.run_last = runMicros;
+	telemetry.run_min = telemetry.run_frames ? min(telemetry.run_min, runMicros) : runMicros;
+	telemetry.run_max = max(telemetry.run_max, runMicros);
+	telemetry.run_total += runMicros;
+	telemetry.run_frames++;
+}
+
+void computer_run(uint32_t elapsedMillis)
+{
+	uint32_t runStart = micros();
+
+	// Elapsed time, slewed toward station 0's (see timesync.h)
+	vtime_advance(&time_sync, &vTime, elapsedMillis, runStart);
+
+	vLEDIndex = 0.0f;
+	vLEDRatio = 0.0f;
+
+	playlist_update();
+
+	if (program_dirty) {
+		plan_program();
+	}
+
+	if (LANE_ENGINE && lanes_enabled && lanes_ok) {
+		run_lanes();
+	} else if (THREADED_ENGINE) {
+		run_threaded();
+	} else {
+		run_steps();
+	}
+
+	if (DEBUG_STATE) {
+		Serial.println("~~~~~~~~~~~~~~~~~~~~~~~~");
+	}
+
+#if PROFILE_STEPS
+	profile_frames++;
+#endif
+
+	telemetry_run(micros() - runStart);
 }
 
 BlinkType computer_get_blink_type() {
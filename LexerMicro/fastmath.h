@@ -0,0 +1,206 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "fixed.h"
+
+// Float kernels for the transcendental ops.
+//   MATH_LIBM: libm, as before
+//   MATH_FAST: Polynomials (a table for sqrt), within the error
+//              bounds listed in fixed.h, checked by host/test_vm.cpp.
+// Fixed always uses its own table versions (fixed.h): without an
+// FPU, table lookup beats evaluating a polynomial.
+#define MATH_LIBM          (0)
+#define MATH_FAST          (1)
+
+#ifndef MATH_PRECISION
+#define MATH_PRECISION     (MATH_FAST)
+#endif
+
+// 2 * pi, split for range reduction: FAST_TWOPI_HI has few bits,
+// so n * FAST_TWOPI_HI is exact.
+#define FAST_TWOPI_HI      (6.28125f)
+#define FAST_TWOPI_LO      (0.0019353071795864769f)
+#define FAST_INV_TWOPI     (0.15915494309189535f)
+
+inline uint32_t float_bits(float a) { uint32_t b; memcpy(&b, &a, sizeof(b)); return b; }
+inline float bits_float(uint32_t b) { float a; memcpy(&a, &b, sizeof(a)); return a; }
+
+#define FAST_ROUND_MAGIC   (12582912.0f)	// 1.5 * 2^23: (a + M) - M rounds a to a whole number
+#define FAST_PI            (3.14159265f)
+#define FAST_HALF_PI       (1.57079633f)
+
+// sin(x) for x in -pi/2..pi/2, error 7e-7 (least squares fit)
+inline float fast_sin_poly(float x) {
+	float x2 = x * x;
+	return x * (0.99999718f + x2 * (-0.16664980f + x2 * (0.0083074392f + x2 * -0.00018387949f)));
+}
+
+// sin(r) for r in -pi..pi
+inline float fast_sin_pi(float r) {
+	if (r > FAST_HALF_PI) r = FAST_PI - r;
+	if (r < -FAST_HALF_PI) r = -FAST_PI - r;
+	return fast_sin_poly(r);
+}
+
+// cos(r) for r in -pi..pi
+inline float fast_cos_pi(float r) { return fast_sin_poly(FAST_HALF_PI - fabsf(r)); }
+
+// a = n * 2pi + r, with r in -pi..pi
+inline float fast_reduce(float a) {
+	float n = (a * FAST_INV_TWOPI + FAST_ROUND_MAGIC) - FAST_ROUND_MAGIC;
+	return (a - n * FAST_TWOPI_HI) - n * FAST_TWOPI_LO;
+}
+
+inline float fast_sin(float a) { return (fabsf(a) < 1e6f) ? fast_sin_pi(fast_reduce(a)) : sin(a); }
+inline float fast_cos(float a) { return (fabsf(a) < 1e6f) ? fast_cos_pi(fast_reduce(a)) : cos(a); }
+
+// sin(a * 2pi), cos(a * 2pi). Past 2^22, a is a whole number of
+// half turns, so sin is 0.
+inline float fast_turns(float a) {
+	float u = a - ((a + FAST_ROUND_MAGIC) - FAST_ROUND_MAGIC);	// -0.5..0.5
+	return u * (float)(M_PI * 2.0f);
+}
+
+inline float fast_sin_turns(float a) { return (fabsf(a) < 4194304.0f) ? fast_sin_pi(fast_turns(a)) : 0.0f; }
+inline float fast_cos_turns(float a) { return (fabsf(a) < 4194304.0f) ? fast_cos_pi(fast_turns(a)) : 1.0f; }
+
+inline float fast_tan(float a) { return fast_sin(a) / fast_cos(a); }
+
+// Abramowitz & Stegun 4.4.49: atan(z) for z in 0..1, error 1e-5
+inline float fast_atan_unit(float z) {
+	float z2 = z * z;
+	return z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+}
+
+inline float fast_atan2(float y, float x) {
+	float ax = fabsf(x);
+	float ay = fabsf(y);
+
+	if (!(ax + ay > 0.0f) || (ax + ay > 1e30f)) return atan2(y, x);	// 0, inf, nan
+
+	float r = (ay > ax) ? ((float)(M_PI / 2) - fast_atan_unit(ax / ay)) : fast_atan_unit(ay / ax);
+
+	if (x < 0.0f) r = (float)M_PI - r;
+	return (y < 0.0f) ? -r : r;
+}
+
+// log2(1 + f) for f in 0..1, error 3e-6 (least squares fit)
+inline float fast_log2_poly(float f) {
+	return f * (1.4425348f + f * (-0.71803360f + f * (0.45715818f + f * (-0.27734176f + f * (0.12147305f + f * -0.025792379f)))));
+}
+
+// Normal, positive floats only (see fast_log)
+inline float fast_log2(float a) {
+	uint32_t b = float_bits(a);
+	int32_t e = (int32_t)(b >> 23) - 127;
+	float m = bits_float((b & 0x007fffff) | 0x3f800000);	// 1..2
+
+	return e + fast_log2_poly(m - 1.0f);
+}
+
+inline bool fast_log_ok(float a) {
+	return (a >= 1.17549435e-38f) && (a < 3.4e38f);	// Not 0, negative, denormal, inf or nan
+}
+
+inline float fast_log(float a) {
+	if (!fast_log_ok(a)) return log(a);
+
+	return fast_log2(a) * (float)M_LN2;
+}
+
+// 2^f for f in 0..1, relative error 1e-7 (least squares fit)
+inline float fast_exp2_poly(float f) {
+	return 0.99999990f + f * (0.69315462f + f * (0.24014077f + f * (0.055863283f + f * (0.0089462143f + f * 0.0018951074f))));
+}
+
+inline float fast_exp2(float a) {
+	if (!(a > -126.0f)) return (a == a) ? 0.0f : a;	// underflow, nan
+	if (a >= 128.0f) return INFINITY;
+
+	float n = (a - 0.5f + FAST_ROUND_MAGIC) - FAST_ROUND_MAGIC;	// floor, give or take 1 ulp
+	return fast_exp2_poly(a - n) * bits_float((uint32_t)((int32_t)n + 127) << 23);
+}
+
+// Negative and zero bases go to libm
+inline float fast_pow(float a, float b) {
+	if (!fast_log_ok(a)) return pow(a, b);
+
+	return fast_exp2(b * fast_log2(a));
+}
+
+// sqrt(1 + i / 128) * 2^23, for i in 0..128
+#define FAST_SQRT_BITS     (7)
+#define FAST_SQRT2_Q31     (3037000500u)	// sqrt(2) * 2^31
+
+const uint32_t FAST_SQRT_TABLE[(1 << FAST_SQRT_BITS) + 1] = {
+	8388608, 8421312, 8453890, 8486343, 8518672, 8550879, 8582964, 8614931,
+	8646779, 8678511, 8710126, 8741628, 8773016, 8804293, 8835458, 8866515,
+	8897462, 8928303, 8959037, 8989667, 9020192, 9050614, 9080935, 9111154,
+	9141274, 9171294, 9201217, 9231043, 9260772, 9290407, 9319947, 9349394,
+	9378749, 9408012, 9437184, 9466266, 9495260, 9524164, 9552982, 9581713,
+	9610358, 9638918, 9667393, 9695785, 9724094, 9752321, 9780466, 9808530,
+	9836515, 9864420, 9892246, 9919994, 9947665, 9975260, 10002778, 10030220,
+	10057588, 10084881, 10112101, 10139247, 10166322, 10193324, 10220255, 10247115,
+	10273905, 10300625, 10327276, 10353858, 10380373, 10406820, 10433199, 10459513,
+	10485760, 10511942, 10538058, 10564110, 10590098, 10616023, 10641884, 10667683,
+	10693419, 10719093, 10744707, 10770259, 10795751, 10821182, 10846554, 10871867,
+	10897121, 10922317, 10947455, 10972535, 10997558, 11022524, 11047434, 11072287,
+	11097085, 11121828, 11146516, 11171149, 11195728, 11220253, 11244725, 11269143,
+	11293509, 11317822, 11342084, 11366293, 11390451, 11414558, 11438614, 11462619,
+	11486575, 11510480, 11534336, 11558143, 11581900, 11605610, 11629270, 11652883,
+	11676448, 11699966, 11723436, 11746860, 11770236, 11793567, 11816851, 11840090,
+	11863283
+};
+
+// Integer math only: The Teensy 3.2's Cortex-M4 has no FPU, so
+// libm's sqrt is a soft-float routine. Table plus interpolation
+// on the mantissa, times sqrt(2) for an odd exponent: relative
+// error 2e-6. Zero, negative, denormal, inf and nan go to libm.
+inline float fast_sqrt(float a) {
+	uint32_t b = float_bits(a);
+	if ((b - 0x00800000u) >= 0x7f000000u) return sqrt(a);
+
+	int32_t e = (int32_t)(b >> 23) - 127;
+	uint32_t m = b & 0x7fffff;	// a = (1 + m / 2^23) * 2^e
+	uint32_t i = m >> (23 - FAST_SQRT_BITS);
+	uint32_t f = m & ((1 << (23 - FAST_SQRT_BITS)) - 1);
+
+	uint32_t lo = FAST_SQRT_TABLE[i];
+	uint32_t r = lo + (((FAST_SQRT_TABLE[i + 1] - lo) * f) >> (23 - FAST_SQRT_BITS));
+	if (e & 1) r = (uint32_t)(((uint64_t)r * FAST_SQRT2_Q31) >> 31);
+
+	// r is 1..2 (Q.23). Adding carries into the exponent if it rounds up to 2.
+	return bits_float((uint32_t)((e >> 1) + 127) * 0x800000u + (r - 0x800000u));
+}
+
+//
+//  Num math: What the kernels call
+//
+
+#define MATH_PICK(fast, libm)  ((MATH_PRECISION == MATH_FAST) ? (fast) : (libm))
+
+inline float math_sin(float a) { return MATH_PICK(fast_sin(a), sin(a)); }
+inline float math_cos(float a) { return MATH_PICK(fast_cos(a), cos(a)); }
+inline float math_tan(float a) { return MATH_PICK(fast_tan(a), tan(a)); }
+inline float math_atan2(float y, float x) { return MATH_PICK(fast_atan2(y, x), atan2(y, x)); }
+inline float math_log(float a) { return MATH_PICK(fast_log(a), log(a)); }
+inline float math_pow(float a, float b) { return MATH_PICK(fast_pow(a, b), pow(a, b)); }
+
+inline float math_sqrt(float a) { return MATH_PICK(fast_sqrt(a), sqrt(a)); }
+
+// sin(a * 2pi), cos(a * 2pi)
+inline float sin_turns(float a) { return MATH_PICK(fast_sin_turns(a), sin(a * (float)(M_PI * 2.0f))); }
+inline float cos_turns(float a) { return MATH_PICK(fast_cos_turns(a), cos(a * (float)(M_PI * 2.0f))); }
+
+inline Fixed math_sin(Fixed a) { return sin(a); }
+inline Fixed math_cos(Fixed a) { return cos(a); }
+inline Fixed math_tan(Fixed a) { return tan(a); }
+inline Fixed math_atan2(Fixed y, Fixed x) { return atan2(y, x); }
+inline Fixed math_log(Fixed a) { return log(a); }
+inline Fixed math_pow(Fixed a, Fixed b) { return pow(a, b); }
+inline Fixed math_sqrt(Fixed a) { return sqrt(a); }
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+#include <math.h>
+
+// Num: What the VM computes with. float, or Q16.16 fixed point
+// for cores without an FPU (Teensy LC).
+#ifndef FIXED_POINT
+#define FIXED_POINT        (false)
+#endif
+
+#define FIXED_ONE          (65536)
+#define FIXED_PI           (205887)	// pi, raw
+#define FIXED_HALF_PI      (102944)
+#define FIXED_LN2          (45426)
+#define FIXED_INV_TWOPI    (683565276)	// 2^32 / (2 * pi)
+
+#define FIXED_TABLE_BITS   (7)
+#define FIXED_TABLE_SIZE   (1 << FIXED_TABLE_BITS)
+#define FIXED_LERP_BITS    (16 - FIXED_TABLE_BITS)
+
+//
+//  Q16.16: 16 integer bits (signed), 16 fraction bits.
+//
+//  Range is -32768 .. 32767.99998, resolution 1/65536.
+//  +, - and * wrap around on overflow, like int32_t. / saturates.
+//  Conversions from float saturate (NaN is 0). vTime wraps to 0
+//  every VTIME_WRAP_MILLIS (4.7 hours, in computer.h), before the
+//  2^15 second limit.
+//
+//  Error bounds, against libm on the same inputs, in the
+//  useful range of each op (checked by host/test_vm.cpp):
+//
+//    + - * / % floor ceil round frac   1 LSB (1.5e-5)
+//    sqrt                              1 LSB
+//    sin cos                           5e-5
+//    sin01 cos01                       3e-5
+//    atan2                             4e-5 radians
+//    log                               4e-5
+//    tan                               2e-4 relative, for |a| < 1.4
+//    pow, logBase                      2e-4 relative
+//    hsv, rgb                          1 level (of 255) per channel
+//    sinq, noise, lerp, etc.           Built from the ops above
+//
+//
+
+// sin(u * pi/2)
+const int32_t FIXED_SIN_TABLE[FIXED_TABLE_SIZE + 1] = {
+	0, 804, 1608, 2412, 3216, 4019, 4821, 5623,
+	6424, 7224, 8022, 8820, 9616, 10411, 11204, 11996,
+	12785, 13573, 14359, 15143, 15924, 16703, 17479, 18253,
+	19024, 19792, 20557, 21320, 22078, 22834, 23586, 24335,
+	25080, 25821, 26558, 27291, 28020, 28745, 29466, 30182,
+	30893, 31600, 32303, 33000, 33692, 34380, 35062, 35738,
+	36410, 37076, 37736, 38391, 39040, 39683, 40320, 40951,
+	41576, 42194, 42806, 43412, 44011, 44604, 45190, 45769,
+	46341, 46906, 47464, 48015, 48559, 49095, 49624, 50146,
+	50660, 51166, 51665, 52156, 52639, 53114, 53581, 54040,
+	54491, 54934, 55368, 55794, 56212, 56621, 57022, 57414,
+	57798, 58172, 58538, 58896, 59244, 59583, 59914, 60235,
+	60547, 60851, 61145, 61429, 61705, 61971, 62228, 62476,
+	62714, 62943, 63162, 63372, 63572, 63763, 63944, 64115,
+	64277, 64429, 64571, 64704, 64827, 64940, 65043, 65137,
+	65220, 65294, 65358, 65413, 65457, 65492, 65516, 65531,
+	65536
+};
+
+// atan(u)
+const int32_t FIXED_ATAN_TABLE[FIXED_TABLE_SIZE + 1] = {
+	0, 512, 1024, 1536, 2047, 2559, 3070, 3580,
+	4091, 4600, 5110, 5618, 6126, 6633, 7140, 7645,
+	8150, 8653, 9156, 9657, 10158, 10657, 11155, 11652,
+	12147, 12641, 13133, 13624, 14114, 14601, 15088, 15572,
+	16055, 16536, 17015, 17492, 17968, 18441, 18913, 19382,
+	19850, 20315, 20779, 21240, 21699, 22156, 22610, 23062,
+	23512, 23960, 24406, 24849, 25289, 25727, 26163, 26597,
+	27028, 27456, 27882, 28306, 28727, 29145, 29561, 29975,
+	30386, 30794, 31200, 31603, 32003, 32401, 32797, 33190,
+	33580, 33968, 34353, 34735, 35115, 35492, 35867, 36239,
+	36608, 36975, 37340, 37701, 38060, 38417, 38771, 39123,
+	39472, 39818, 40162, 40503, 40842, 41178, 41512, 41844,
+	42172, 42499, 42823, 43145, 43464, 43780, 44095, 44407,
+	44716, 45024, 45328, 45631, 45931, 46229, 46525, 46818,
+	47109, 47398, 47685, 47969, 48251, 48531, 48809, 49085,
+	49359, 49630, 49899, 50167, 50432, 50695, 50956, 51215,
+	51472
+};
+
+// log2(1 + u)
+const int32_t FIXED_LOG2_TABLE[FIXED_TABLE_SIZE + 1] = {
+	0, 736, 1466, 2190, 2909, 3623, 4331, 5034,
+	5732, 6425, 7112, 7795, 8473, 9146, 9814, 10477,
+	11136, 11791, 12440, 13086, 13727, 14363, 14996, 15624,
+	16248, 16868, 17484, 18096, 18704, 19308, 19909, 20505,
+	21098, 21687, 22272, 22854, 23433, 24007, 24579, 25146,
+	25711, 26272, 26830, 27384, 27936, 28484, 29029, 29571,
+	30109, 30645, 31178, 31707, 32234, 32758, 33279, 33797,
+	34312, 34825, 35334, 35841, 36346, 36847, 37346, 37842,
+	38336, 38827, 39316, 39802, 40286, 40767, 41246, 41722,
+	42196, 42667, 43137, 43603, 44068, 44530, 44990, 45448,
+	45904, 46357, 46809, 47258, 47705, 48150, 48593, 49034,
+	49472, 49909, 50344, 50776, 51207, 51636, 52063, 52488,
+	52911, 53332, 53751, 54169, 54584, 54998, 55410, 55820,
+	56229, 56635, 57040, 57443, 57845, 58245, 58643, 59039,
+	59434, 59827, 60219, 60609, 60997, 61384, 61769, 62152,
+	62534, 62915, 63294, 63671, 64047, 64421, 64794, 65166,
+	65536
+};
+
+// 2^u
+const int32_t FIXED_EXP2_TABLE[FIXED_TABLE_SIZE + 1] = {
+	65536, 65892, 66250, 66609, 66971, 67335, 67700, 68068,
+	68438, 68809, 69183, 69558, 69936, 70316, 70698, 71082,
+	71468, 71856, 72246, 72638, 73032, 73429, 73828, 74229,
+	74632, 75037, 75444, 75854, 76266, 76680, 77096, 77515,
+	77936, 78359, 78785, 79212, 79642, 80075, 80510, 80947,
+	81386, 81828, 82273, 82719, 83169, 83620, 84074, 84531,
+	84990, 85451, 85915, 86382, 86851, 87322, 87796, 88273,
+	88752, 89234, 89719, 90206, 90696, 91188, 91684, 92181,
+	92682, 93185, 93691, 94200, 94711, 95226, 95743, 96263,
+	96785, 97311, 97839, 98370, 98905, 99442, 99982, 100524,
+	101070, 101619, 102171, 102726, 103283, 103844, 104408, 104975,
+	105545, 106118, 106694, 107274, 107856, 108442, 109031, 109623,
+	110218, 110816, 111418, 112023, 112631, 113243, 113858, 114476,
+	115098, 115723, 116351, 116983, 117618, 118257, 118899, 119544,
+	120194, 120846, 121502, 122162, 122825, 123492, 124163, 124837,
+	125515, 126197, 126882, 127571, 128263, 128960, 129660, 130364,
+	131072
+};
+
+struct Fixed {
+	int32_t raw;
+
+	Fixed() = default;
+	constexpr Fixed(int v) : raw(v * FIXED_ONE) {}
+	constexpr Fixed(float v) : raw((v != v) ? 0 : (v >= 32768.0f) ? INT32_MAX :
+		(v <= -32768.0f) ? INT32_MIN :
+		(int32_t)(v * (float)FIXED_ONE + ((v < 0.0f) ? -0.5f : 0.5f))) {}
+	constexpr Fixed(double v) : Fixed((float)v) {}
+
+	static constexpr Fixed from_raw(int32_t r) { return Fixed(r, true); }
+
+	inline Fixed & operator+=(Fixed b) { raw = (int32_t)((uint32_t)raw + (uint32_t)b.raw); return *this; }
+	inline Fixed & operator-=(Fixed b) { raw = (int32_t)((uint32_t)raw - (uint32_t)b.raw); return *this; }
+	inline Fixed & operator*=(Fixed b) { raw = (int32_t)(((int64_t)raw * b.raw) >> 16); return *this; }
+
+private:
+	constexpr Fixed(int32_t r, bool) : raw(r) {}
+};
+
+inline Fixed operator+(Fixed a, Fixed b) { return a += b; }
+inline Fixed operator-(Fixed a, Fixed b) { return a -= b; }
+inline Fixed operator*(Fixed a, Fixed b) { return a *= b; }
+inline Fixed operator-(Fixed a) { return Fixed::from_raw(-a.raw); }
+
+inline Fixed operator/(Fixed a, Fixed b) {
+	if (b.raw == 0) {
+		return Fixed::from_raw((a.raw >= 0) ? INT32_MAX : INT32_MIN);
+	}
+
+	int64_t q = ((int64_t)a.raw * FIXED_ONE) / b.raw;
+	return Fixed::from_raw((q > INT32_MAX) ? INT32_MAX : (q < INT32_MIN) ? INT32_MIN : (int32_t)q);
+}
+
+inline bool operator==(Fixed a, Fixed b) { return a.raw == b.raw; }
+inline bool operator!=(Fixed a, Fixed b) { return a.raw != b.raw; }
+inline bool operator<(Fixed a, Fixed b) { return a.raw < b.raw; }
+inline bool operator<=(Fixed a, Fixed b) { return a.raw <= b.raw; }
+inline bool operator>(Fixed a, Fixed b) { return a.raw > b.raw; }
+inline bool operator>=(Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+// Linear interpolation in a FIXED_TABLE_SIZE + 1 entry table.
+// u: Position in the table, 0..FIXED_ONE
+inline int32_t fixed_lookup(const int32_t * table, uint32_t u) {
+	uint32_t i = u >> FIXED_LERP_BITS;
+	if (i >= FIXED_TABLE_SIZE) return table[FIXED_TABLE_SIZE];
+
+	int32_t frac = u & ((1 << FIXED_LERP_BITS) - 1);
+	return table[i] + (((table[i + 1] - table[i]) * frac) >> FIXED_LERP_BITS);
+}
+
+// phase: 0..0xffffffff is one full turn
+inline Fixed fixed_sin_phase(uint32_t phase) {
+	uint8_t quadrant = phase >> 30;
+	uint32_t u = ((phase & 0x3fffffff) + (1 << 13)) >> 14;	// 0..FIXED_ONE, rounded
+
+	if (quadrant & 0x1) u = FIXED_ONE - u;
+
+	int32_t s = fixed_lookup(FIXED_SIN_TABLE, u);
+	return Fixed::from_raw((quadrant & 0x2) ? -s : s);
+}
+
+// Radians to phase
+inline uint32_t fixed_phase(Fixed a) {
+	return (uint32_t)(((int64_t)a.raw * FIXED_INV_TWOPI) >> 16);
+}
+
+// a > 0
+inline int32_t fixed_log2(int32_t raw) {
+	int8_t p = 31 - __builtin_clz((uint32_t)raw);	// Highest bit
+	uint32_t m = (p >= 16) ? ((uint32_t)raw >> (p - 16)) : ((uint32_t)raw << (16 - p));	// 1..2
+
+	return (p - 16) * FIXED_ONE + fixed_lookup(FIXED_LOG2_TABLE, m - FIXED_ONE);
+}
+
+inline Fixed fixed_exp2(Fixed a) {
+	int32_t n = a.raw >> 16;	// floor
+	int32_t m = fixed_lookup(FIXED_EXP2_TABLE, a.raw & 0xffff);	// 1..2
+
+	if (n >= 15) return Fixed::from_raw(INT32_MAX);
+	if (n <= -17) return Fixed::from_raw(0);
+
+	return Fixed::from_raw((n >= 0) ? (m << n) : (m >> -n));
+}
+
+//
+//  libm, for Fixed
+//
+
+inline Fixed floor(Fixed a) { return Fixed::from_raw(a.raw & ~0xffff); }
+inline Fixed ceil(Fixed a) { return Fixed::from_raw((a.raw + 0xffff) & ~0xffff); }
+
+// Some Arduino cores define round() and abs() as macros
+#ifndef round
+inline Fixed round(Fixed a) {	// Half away from zero, like roundf()
+	return (a.raw >= 0) ? Fixed::from_raw((a.raw + 0x8000) & ~0xffff) :
+		-Fixed::from_raw((-a.raw + 0x8000) & ~0xffff);
+}
+#endif
+
+#ifndef abs
+inline Fixed abs(Fixed a) { return (a.raw < 0) ? -a : a; }
+#endif
+
+inline Fixed sin(Fixed a) { return fixed_sin_phase(fixed_phase(a)); }
+inline Fixed cos(Fixed a) { return fixed_sin_phase(fixed_phase(a) + 0x40000000); }
+inline Fixed tan(Fixed a) { return sin(a) / cos(a); }
+
+inline Fixed atan2(Fixed y, Fixed x) {
+	if ((x.raw == 0) && (y.raw == 0)) return Fixed::from_raw(0);
+
+	uint32_t ax = (x.raw < 0) ? -(uint32_t)x.raw : x.raw;
+	uint32_t ay = (y.raw < 0) ? -(uint32_t)y.raw : y.raw;
+	int32_t r;
+
+	// atan of 0..1, then unfold the octant
+	if (ay > ax) {
+		r = FIXED_HALF_PI - fixed_lookup(FIXED_ATAN_TABLE, ((uint64_t)ax << 16) / ay);
+	} else {
+		r = fixed_lookup(FIXED_ATAN_TABLE, ((uint64_t)ay << 16) / ax);
+	}
+
+	if (x.raw < 0) r = FIXED_PI - r;
+	return Fixed::from_raw((y.raw < 0) ? -r : r);
+}
+
+// log(0 or less) is -32768, not -inf or nan
+inline Fixed log(Fixed a) {
+	if (a.raw <= 0) return Fixed::from_raw(INT32_MIN);
+
+	return Fixed::from_raw(((int64_t)fixed_log2(a.raw) * FIXED_LN2) >> 16);
+}
+
+// Negative base: only for whole exponents (nan for floats)
+inline Fixed pow(Fixed a, Fixed b) {
+	if (a.raw == 0) {
+		return (b.raw > 0) ? Fixed::from_raw(0) : (b.raw == 0) ? Fixed(1) : Fixed::from_raw(INT32_MAX);
+	}
+
+	if (a.raw < 0) {
+		if (b.raw & 0xffff) return Fixed::from_raw(0);
+
+		Fixed r = pow(-a, b);
+		return ((b.raw >> 16) & 0x1) ? -r : r;
+	}
+
+	return fixed_exp2(b * Fixed::from_raw(fixed_log2(a.raw)));
+}
+
+// sqrt(negative) is 0, not nan
+inline Fixed sqrt(Fixed a) {
+	if (a.raw <= 0) return Fixed::from_raw(0);
+
+	uint64_t v = (uint64_t)a.raw << 16;
+	uint64_t r = 0;
+	uint64_t bit = (uint64_t)1 << 46;
+
+	while (bit > v) bit >>= 2;
+
+	while (bit) {
+		if (v >= r + bit) {
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return Fixed::from_raw((int32_t)r);
+}
+
+//
+//  Num helpers: The same call for float and Fixed
+//
+
+inline int32_t num_int(float a) { return (int32_t)(a); }	// toward zero
+inline int32_t num_int(Fixed a) { return (a.raw >= 0) ? (a.raw >> 16) : -(-a.raw >> 16); }
+
+inline float num_float(float a) { return a; }
+inline float num_float(Fixed a) { return a.raw * (1.0f / FIXED_ONE); }
+
+// Does a come back from num_float() unchanged? A Fixed needs at
+// most 24 significant bits.
+inline bool num_float_exact(float a) { return true; }
+inline bool num_float_exact(Fixed a) { return Fixed(num_float(a)) == a; }
+
+inline int32_t num_raw(float a) { return Fixed(a).raw; }	// Q16.16 bits
+inline int32_t num_raw(Fixed a) { return a.raw; }
+
+// sin(a * 2pi), cos(a * 2pi): Read the phase from the fraction
+// bits, so there is no overflow for large a. (float: fastmath.h)
+inline Fixed sin_turns(Fixed a) { return fixed_sin_phase((uint32_t)a.raw << 16); }
+inline Fixed cos_turns(Fixed a) { return fixed_sin_phase(((uint32_t)a.raw << 16) + 0x40000000); }
+
+#if FIXED_POINT
+typedef Fixed Num;
+#else
+typedef float Num;
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+
+//
+//  Frame pipeline
+//
+//  OctoWS2811 keeps two buffers. setPixel() draws into drawingMemory,
+//  and show() copies that into displayMemory and starts the DMA. So
+//  frame N clocks out of displayMemory while computer_run() draws
+//  frame N+1 into drawingMemory:
+//
+//    swap (show N) -> draw N+1 -> wait -> swap (show N+1) -> draw N+2
+//
+//  The scheduler puts each swap on a steady FRAME_TARGET_FPS tick, so
+//  frame timing no longer depends on how long the program takes.
+//  Animation time advances by whole frame periods, so motion stays
+//  smooth even when a frame runs late.
+//
+
+#define FRAME_TARGET_FPS      (60)
+
+// Drawing must finish before the next swap. Leave time for show()
+// to copy the buffer.
+#define FRAME_SHOW_MICROS     (500)
+
+#define FRAME_FPS_WINDOW      (1000000)	// micros: FPS is measured over this long
+
+// Print the frame stats over USB, once per FRAME_FPS_WINDOW
+#define FRAME_REPORT          (false)
+
+typedef struct {
+	uint32_t period;	// micros between swaps
+	uint32_t budget;	// micros to draw a frame
+	uint32_t due;	// micros: next swap
+	uint32_t swapped;	// micros: last swap
+	uint32_t time_micros;	// Animation time not yet passed to computer_run()
+
+	// Stats
+	uint32_t frames;
+	uint32_t dropped;	// Swaps skipped, because a frame ran late
+	uint32_t over_budget;	// Frames that took longer than budget to draw
+	uint32_t draw_micros;	// Last frame
+	uint32_t draw_max;	// Worst frame in the window
+
+	uint32_t window_start;
+	uint16_t window_frames;
+	float fps;	// Measured over the last window
+} FrameScheduler;
+
+void frame_init(FrameScheduler * fs, uint16_t fps, uint32_t now)
+{
+	memset(fs, 0, sizeof(FrameScheduler));
+
+	fs->period = 1000000 / fps;
+	fs->budget = fs->period - FRAME_SHOW_MICROS;
+	fs->due = now;
+	fs->swapped = now;
+}
+
+// Time to swap? (Wrap-safe: micros() wraps every 71 minutes)
+bool frame_due(const FrameScheduler * fs, uint32_t now)
+{
+	return (int32_t)(now - fs->due) >= 0;
+}
+
+// Call right after show(). Returns the millis to pass to
+// computer_run() for the next frame.
+uint32_t frame_swap(FrameScheduler * fs, uint32_t now)
+{
+	// Late by a whole period (or more)? Skip those swaps, rather
+	// than rushing to catch up. Stays on the same tick.
+	uint32_t missed = (now - fs->due) / fs->period;
+	fs->dropped += missed;
+	fs->due += (missed + 1) * fs->period;
+
+	fs->swapped = now;
+
+	// Measured FPS: Swaps since the one at window_start
+	if (fs->frames++ == 0) {
+		fs->window_start = now;
+	} else {
+		fs->window_frames++;
+	}
+
+	uint32_t windowMicros = now - fs->window_start;
+
+	if (windowMicros >= FRAME_FPS_WINDOW) {
+		fs->fps = fs->window_frames * (1000000.0f / windowMicros);
+
+		if (FRAME_REPORT) {
+			Serial.print("fps ");
+			Serial.print(fs->fps);
+			Serial.print(" draw ");
+			Serial.print(fs->draw_micros);
+			Serial.print("us max ");
+			Serial.print(fs->draw_max);
+			Serial.print("us over ");
+			Serial.print(fs->over_budget);
+			Serial.print(" dropped ");
+			Serial.println(fs->dropped);
+		}
+
+		fs->window_start = now;
+		fs->window_frames = 0;
+		fs->draw_max = 0;
+	}
+
+	// Animation time, in whole periods
+	fs->time_micros += (missed + 1) * fs->period;
+	uint32_t elapsedMillis = fs->time_micros / 1000;
+	fs->time_micros -= elapsedMillis * 1000;
+
+	return elapsedMillis;
+}
+
+// Call when the frame is drawn
+void frame_drawn(FrameScheduler * fs, uint32_t now)
+{
+	fs->draw_micros = now - fs->swapped;
+	fs->draw_max = max(fs->draw_max, fs->draw_micros);
+
+	if (fs->draw_micros > fs->budget) {
+		fs->over_budget++;
+	}
+}
+
+#endif
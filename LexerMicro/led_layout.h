@@ -2,6 +2,7 @@
 #define LED_LAYOUT_H
 
 #include <stdint.h>
+#include "fixed.h"
 
 #define TWOPI (6.283185f)
 
@@ -25,6 +26,26 @@
 #define DL_2_3  (6)
 #define DR_2_3  (7)
 
+// Per-LED values, computed when the layout is decoded
+typedef enum {
+	k_layout_x = 0,	// Within the letter: 0..1 is STATION_LED_WIDTH
+	k_layout_y,	// 0..1 is STATION_LED_HEIGHT
+	k_layout_local_angle,	// From the center of the letter, in turns
+	k_layout_local_radius,	// From the center of the letter: 1 is STATION_LED_HEIGHT / 2
+	k_layout_global_x,	// Across the sign: 0..1 is SIGN_LEDS_ACROSS
+	k_layout_global_angle,	// From the center of the sign, in turns
+	k_layout_global_radius,	// From the center of the sign: 1 is SIGN_LEDS_ACROSS / 2
+	k_layout_var_count
+} LayoutVar;
+
+// Existing LEDs, packed and sorted by strip index. The arrays
+// are parallel: Entry i of each is the same LED.
+typedef struct {
+	uint16_t count;
+	uint16_t * strip;	// setPixel() index
+	Num * vars[k_layout_var_count];
+} LedList;
+
 typedef enum {
 	k_read_led_index = 0,
 	k_read_x,
@@ -35,7 +56,7 @@ typedef enum {
 typedef uint8_t station_data_t;
 
 // T
-const station_data_t STATION_0[] = {
+constexpr station_data_t STATION_0[] = {
 	// Heading left
 	RL*0,  5, 18, L, U,U,U,U,U,U,U,U,U,U,U,U,U,U,U,U, L,L, X,
 
@@ -46,7 +67,7 @@ const station_data_t STATION_0[] = {
 };
 
 // O1
-const station_data_t STATION_1[] = {
+constexpr station_data_t STATION_1[] = {
 	// Inside
 	RL*0,  8, 16, L,L,L,L,L,L, U,U,U,U,U,U,U,U,U,U,U,U,U,U, R,R,R,R,R,R, D,D,D,D,D,D,D,D,D,D,D,D,D, X,
 
@@ -60,7 +81,7 @@ const station_data_t STATION_1[] = {
 };
 
 // O2
-const station_data_t STATION_2[] = {
+constexpr station_data_t STATION_2[] = {
 	// Outside, going left
 	RL*0,  9, 18, L,L,L,L,L,L,L,L,L, U,U,U,U,U,U,U,U,U,U, X,
 
@@ -74,7 +95,7 @@ const station_data_t STATION_2[] = {
 };
 
 // R
-const station_data_t STATION_3[] = {
+constexpr station_data_t STATION_3[] = {
 	// Going up
 	RL*1, 10, 18,  U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U,U,U, L,L,L,L,L, L,L,L, DL,DL, D,D,D,D, DR_2_3,DR_2_3, X,
 
@@ -88,7 +109,7 @@ const station_data_t STATION_3[] = {
 };
 
 // C
-const station_data_t STATION_4[] = {
+constexpr station_data_t STATION_4[] = {
 	// Bottom, going left
 	RL*0,  10, 18, L,L,L,L,L, L,L,L,L,L, U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U,U,U, R,R,R,R,R, R,R,R,R,R, D, X,
 
@@ -99,7 +120,7 @@ const station_data_t STATION_4[] = {
 };
 
 // A
-const station_data_t STATION_5[] = {
+constexpr station_data_t STATION_5[] = {
 	// Going right
 	RL*0,  9, 18, R, U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U,U,U, X,
 
@@ -113,7 +134,7 @@ const station_data_t STATION_5[] = {
 };
 
 // It's the huge M oh lord
-const station_data_t STATION_6[] = {
+constexpr station_data_t STATION_6[] = {
 	// Going left
 	RL*0,  8, 18, L, U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U, L,L,L,L,L,L, D,D,D,D,D, D,D,D,D,D, D,D,D,D,D, D, L,L, U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U,U,U, R,R,R,R,R, R,R,R,R,R, R,R,R,R,R,R, X,
 
@@ -124,7 +145,7 @@ const station_data_t STATION_6[] = {
 };
 
 // P
-const station_data_t STATION_7[] = {
+constexpr station_data_t STATION_7[] = {
 	// Going left
 	RL*2, 1, 18, L, U,U,U,U,U, U,U,U,U,U, U,U,U,U,U, U,U,U, R,R,R,R,R, R,R,R,R,R, D,D,D,D,D,D, X,
 
@@ -137,7 +158,7 @@ const station_data_t STATION_7[] = {
 	X
 };
 
-const station_data_t * STATIONS[] = {
+constexpr const station_data_t * STATIONS[] = {
 	STATION_0,
 	STATION_1,
 	STATION_2,
@@ -148,27 +169,116 @@ const station_data_t * STATIONS[] = {
 	STATION_7
 };
 
-void _set_led_position(float x, float y, bool * does_led_exist_ar, float * x_ptr, float * y_ptr, float * local_angle_ptr)
+// Left edge of each letter on the sign, in LEDs. The M is wider
+// than the rest.
+constexpr float STATION_OFFSET_X[] = {0, 16, 32, 48, 64, 80, 96, 120};
+
+#define SIGN_LEDS_ACROSS      (STATION_OFFSET_X[7] + STATION_LEDS_ACROSS)
+
+// sqrt() and atan2() for the layout, in double. constexpr: libm's
+// aren't (GCC folds them as builtins, other compilers don't), and
+// the compiler and the runtime decoder run the same code, so both
+// agree to the bit.
+constexpr double layout_sqrt(double v)
+{
+	if (v <= 0.0) return 0.0;
+
+	// Newton's method, from above: Stops when it stops shrinking
+	double r = (v > 1.0) ? v : 1.0;
+	for (uint8_t n = 0; n < 100; n++) {
+		double next = 0.5 * (r + v / r);
+		if (next >= r) break;
+		r = next;
+	}
+	return r;
+}
+
+constexpr double layout_atan2(double y, double x)
+{
+	// pi, as the nearest double. From integers: The host builds
+	// with -fsingle-precision-constant.
+	const double PI_D = (double)7074237752028440ULL / (double)(1ULL << 51);
+
+	if ((x == 0.0) && (y == 0.0)) return 0.0;
+
+	// Fold to 0..1, then halve the angle twice (tan(a/2) is
+	// t / (1 + sqrt(1 + t*t))): |t| <= tan(pi/16), and the series
+	// converges fast.
+	double ax = (x < 0.0) ? -x : x;
+	double ay = (y < 0.0) ? -y : y;
+	bool swap = (ay > ax);
+	double t = swap ? (ax / ay) : (ay / ax);
+
+	for (uint8_t n = 0; n < 2; n++) {
+		t = t / (1.0 + layout_sqrt(1.0 + t * t));
+	}
+
+	double t2 = t * t;
+	double term = t;
+	double a = 0.0;
+	for (uint8_t k = 0; k < 40; k++) {
+		a += term / (2 * k + 1);
+		term *= -t2;
+	}
+	a *= 4.0;
+
+	if (swap) a = PI_D * 0.5 - a;
+	if (x < 0.0) a = PI_D - a;
+	return (y < 0.0) ? -a : a;
+}
+
+// constexpr: Also run by the compiler, see LAYOUT_TABLE()
+constexpr void _set_led_position(uint8_t station_id, uint16_t led_index, float x, float y, LedList * list)
 {
-	*does_led_exist_ar = true;
-	*x_ptr = x * (1.0f / STATION_LED_WIDTH);
-	*y_ptr = y * (1.0f / STATION_LED_HEIGHT);
-
-	*local_angle_ptr = atan2(
-		-((float)(y) - STATION_LED_HEIGHT * 0.5f),
-		(float)(x) - STATION_LEDS_ACROSS * 0.5f
-	) * (1.0f / TWOPI);
+	// Keep the list sorted: Shift later LEDs up. A position set
+	// twice keeps the last one.
+	uint16_t i = list->count;
+	while ((i > 0) && (list->strip[i - 1] > led_index)) {
+		i--;
+	}
+
+	if ((i == 0) || (list->strip[i - 1] != led_index)) {
+		for (uint16_t j = list->count; j > i; j--) {
+			list->strip[j] = list->strip[j - 1];
+
+			for (uint8_t v = 0; v < k_layout_var_count; v++) {
+				list->vars[v][j] = list->vars[v][j - 1];
+			}
+		}
+		list->count++;
+
+	} else {
+		i--;
+	}
+
+	list->strip[i] = led_index;
+	list->vars[k_layout_x][i] = x * (1.0f / STATION_LED_WIDTH);
+	list->vars[k_layout_y][i] = y * (1.0f / STATION_LED_HEIGHT);
+
+	// In double, then rounded once to float
+	double dy = -((double)(y) - STATION_LED_HEIGHT * 0.5);	// Up is positive
+	double dx = (double)(x) - STATION_LEDS_ACROSS * 0.5;
+	list->vars[k_layout_local_angle][i] = (float)(layout_atan2(dy, dx) * (1.0 / TWOPI));
+	list->vars[k_layout_local_radius][i] = (float)(layout_sqrt(dx * dx + dy * dy) * (1.0 / (STATION_LED_HEIGHT * 0.5)));
+
+	double gx = (double)STATION_OFFSET_X[station_id] + x;
+	double gdx = gx - SIGN_LEDS_ACROSS * 0.5;
+	list->vars[k_layout_global_x][i] = (float)(gx * (1.0 / SIGN_LEDS_ACROSS));
+	list->vars[k_layout_global_angle][i] = (float)(layout_atan2(dy, gdx) * (1.0 / TWOPI));
+	list->vars[k_layout_global_radius][i] = (float)(layout_sqrt(gdx * gdx + dy * dy) * (1.0 / (SIGN_LEDS_ACROSS * 0.5)));
 }
 
-void led_layout_set_all(uint8_t station_id, bool * does_led_exist_ar, float * x_ar, float * y_ar, float * local_angle_ar)
+constexpr void led_layout_set_all(uint8_t station_id, LedList * list)
 {
 	// Different stations have different LED layouts.
 	const station_data_t * data = STATIONS[station_id];
 
+	list->count = 0;
+
 	LayoutState state = k_read_led_index;
 	uint8_t led_index = 0;
-	float x;
-	float y;
+	float x = 0.0f;
+	float y = 0.0f;
 
 	for (uint16_t i = 0; i < 999; i++) {
 		switch (state) {
@@ -196,7 +306,7 @@ void led_layout_set_all(uint8_t station_id, bool * does_led_exist_ar, float * x_
 				y = data[i];
 
 				// Set this LED
-				_set_led_position(x, y, &does_led_exist_ar[led_index], &x_ar[led_index], &y_ar[led_index], &local_angle_ar[led_index]);
+				_set_led_position(station_id, led_index, x, y, list);
 
 				state = k_read_dir;
 			}
@@ -228,7 +338,7 @@ void led_layout_set_all(uint8_t station_id, bool * does_led_exist_ar, float * x_
 
 				led_index++;
 
-				_set_led_position(x, y, &does_led_exist_ar[led_index], &x_ar[led_index], &y_ar[led_index], &local_angle_ar[led_index]);
+				_set_led_position(station_id, led_index, x, y, list);
 
 				//state = k_read_dir	// already set
 			}
@@ -238,4 +348,76 @@ void led_layout_set_all(uint8_t station_id, bool * does_led_exist_ar, float * x_
 
 }
 
+//
+//  Layouts decoded at compile time: led_layout_set_all(), run by
+//  the compiler. One flash table per station, sized to fit.
+//  The VM points at these, so changing stations copies nothing.
+//
+
+#define LAYOUT_MAX_LEDS       (RL * 3)
+
+template <uint16_t N>
+struct LayoutTable {
+	uint16_t count;
+	uint16_t strip[N];
+	Num vars[k_layout_var_count][N];
+};
+
+template <uint16_t N>
+constexpr LayoutTable<N> layout_table(uint8_t station_id)
+{
+	LayoutTable<N> table {};
+	LedList list = {0, table.strip, {}};
+
+	for (uint8_t v = 0; v < k_layout_var_count; v++) {
+		list.vars[v] = table.vars[v];
+	}
+
+	led_layout_set_all(station_id, &list);
+	table.count = list.count;
+
+	return table;
+}
+
+constexpr uint16_t layout_led_count(uint8_t station_id)
+{
+	return layout_table<LAYOUT_MAX_LEDS>(station_id).count;
+}
+
+#define LAYOUT_TABLE(n) \
+	constexpr LayoutTable<layout_led_count(n)> LAYOUT_##n = layout_table<layout_led_count(n)>(n)
+
+LAYOUT_TABLE(0);
+LAYOUT_TABLE(1);
+LAYOUT_TABLE(2);
+LAYOUT_TABLE(3);
+LAYOUT_TABLE(4);
+LAYOUT_TABLE(5);
+LAYOUT_TABLE(6);
+LAYOUT_TABLE(7);
+
+// A station's layout, as the VM reads it
+typedef struct {
+	uint16_t count;
+	const uint16_t * strip;
+	const Num * vars[k_layout_var_count];
+} StationLayout;
+
+#define STATION_LAYOUT(n)  {LAYOUT_##n.count, LAYOUT_##n.strip, { \
+	LAYOUT_##n.vars[0], LAYOUT_##n.vars[1], LAYOUT_##n.vars[2], LAYOUT_##n.vars[3], \
+	LAYOUT_##n.vars[4], LAYOUT_##n.vars[5], LAYOUT_##n.vars[6]}}
+
+static_assert(k_layout_var_count == 7, "STATION_LAYOUT() lists every var");
+
+const StationLayout STATION_LAYOUTS[] = {
+	STATION_LAYOUT(0),
+	STATION_LAYOUT(1),
+	STATION_LAYOUT(2),
+	STATION_LAYOUT(3),
+	STATION_LAYOUT(4),
+	STATION_LAYOUT(5),
+	STATION_LAYOUT(6),
+	STATION_LAYOUT(7)
+};
+
 #endif
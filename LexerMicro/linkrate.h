@@ -0,0 +1,316 @@
+#ifndef LINKRATE_H
+#define LINKRATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+//
+//  Ring baud rate negotiation
+//
+//  Each Teensy's ring UART (RINGSERIAL) has one baud rate for both
+//  directions. So every hop runs at the same rate, and the whole ring
+//  changes rate together. Station 0 leads:
+//
+//    1. Announce ('n' line): Switch to the next LINK_BAUDS step at a
+//       time on the synced clock (see timesync.h). Station 0 holds
+//       other traffic until it's over (Ring.hold, ring.h).
+//    2. At that time, every station switches.
+//    3. Station 0 sends LINK_PROBES probe lines ('v', with a CRC-16).
+//       Their lifespan takes them all the way round the ring, back
+//       to station 0. That only works once P is wired back to T (see
+//       the README).
+//    4. If every probe came back intact, station 0 commits ('k').
+//       Any station without a commit by LINK_TRIAL_MILLIS goes back
+//       to the old rate, so an open ring stays at 9600.
+//
+//  Station 0 climbs one step at a time until a step fails. After
+//  that, it probes the ring every LINK_CHECK_MILLIS. If too many
+//  probes are lost, the whole ring falls back to 9600 (a final
+//  announce, no trial), and station 0 climbs again, one step short.
+//  A station that hears nothing for LINK_WATCHDOG_MILLIS (it missed
+//  a switch, or a station upstream did) falls back to 9600 too.
+//
+//  These are plain functions of the clocks, like timesync.h. The
+//  lines are built and parsed in computer.h.
+//
+
+#ifndef LINK_NEGOTIATE
+#define LINK_NEGOTIATE        (true)
+#endif
+
+#define LINK_STEPS            (7)
+const uint32_t LINK_BAUDS[LINK_STEPS] = {9600, 19200, 38400, 57600, 115200, 230400, 460800};
+
+#define LINK_START_MILLIS     (5000)	// After boot: Time sync has locked on
+#define LINK_LEAD_MILLIS      (200)	// Announce, then switch this much later
+#define LINK_GUARD_MILLIS     (30)	// Sync error and parse delay, around a switch
+#define LINK_PROBES           (8)	// Per trial. All must come back.
+#define LINK_PROBE_LEN        (24)	// Payload bytes
+#define LINK_LINE_MAX         (32)	// A whole probe line: lifespan, 'v', sequence, payload, CRC, newline
+#define LINK_DECIDE_MILLIS    (600)	// After a switch: Station 0 counts its probes
+#define LINK_TRIAL_MILLIS     (1000)	// After a switch: No commit, go back
+#define LINK_COMMITS          (3)	// Sent more than once: a lost one splits the ring
+#define LINK_CLIMB_MILLIS     (2000)	// Between steps up
+#define LINK_CHECK_MILLIS     (10000)	// Station 0 probes the ring this often
+#define LINK_CHECK_PROBES     (4)
+#define LINK_CHECK_PASS       (3)	// Fewer back: The ring falls back to 9600
+#define LINK_WATCHDOG_MILLIS  (4000)	// No sync line: Fall back to 9600
+
+typedef enum {
+	k_link_steady = 0,
+	k_link_announced = 1,	// Switch at switch_at
+	k_link_trial = 2	// Switched. Back to prev unless committed.
+} LinkState;
+
+// Station 0: What to send next
+typedef enum {
+	k_link_send_none = 0,
+	k_link_send_announce = 1,
+	k_link_send_probe = 2,
+	k_link_send_commit = 3
+} LinkSend;
+
+typedef struct {
+	uint8_t step;	// LINK_BAUDS index in use
+	uint8_t prev;	// Trial: Step to go back to
+	uint8_t next;	// Announced step
+	bool final;	// Announced: No trial, just switch
+	LinkState state;
+	uint32_t switch_at;	// Synced millis (time_sync_now())
+	uint32_t heard;	// millis: Last sync line, probe or commit
+
+	// Station 0
+	bool announcing;	// Announce not sent yet
+	uint8_t cap;	// Highest step to try
+	uint32_t next_action;	// millis: Next climb, or check
+	bool checking;	// Probes out for a check, not a trial
+	uint32_t check_at;	// millis: The last probe went out
+	uint8_t probes_sent;
+	uint8_t probes_back;	// Came back intact
+	uint8_t commits_sent;
+
+	// Stats
+	uint16_t probes_ok;	// Probes received intact (any station)
+	uint16_t probes_bad;	// Failed the CRC
+	uint16_t switches;
+} LinkRate;
+
+void link_init(LinkRate * l, uint32_t now)
+{
+	memset(l, 0, sizeof(LinkRate));
+	l->cap = LINK_NEGOTIATE ? (LINK_STEPS - 1) : 0;
+	l->heard = now;
+	l->next_action = now + LINK_START_MILLIS;
+}
+
+uint32_t link_baud(const LinkRate * l)
+{
+	return LINK_BAUDS[l->step];
+}
+
+// 10 bits per byte: start, 8 data, stop
+uint32_t link_byte_micros(const LinkRate * l)
+{
+	return 10000000 / LINK_BAUDS[l->step];
+}
+
+// Station 0 keeps other traffic off the ring around a switch
+bool link_holding(const LinkRate * l)
+{
+	return l->state != k_link_steady;
+}
+
+// Wrap-safe: Has time t come?
+bool link_reached(uint32_t now, uint32_t t)
+{
+	return (int32_t)(now - t) >= 0;
+}
+
+void link_switch(LinkRate * l, uint8_t step)
+{
+	if (step != l->step) l->switches++;
+	l->step = step;
+}
+
+//
+//  Lines received. now is millis().
+//
+
+void link_heard(LinkRate * l, uint32_t now)
+{
+	l->heard = now;
+}
+
+// 'n': Switch to step at switchAt, on the synced clock
+void link_announced(LinkRate * l, uint8_t step, uint32_t switchAt, bool final, uint32_t now)
+{
+	if (step >= LINK_STEPS) return;
+
+	l->next = step;
+	l->final = final;
+	l->switch_at = switchAt;
+	l->state = k_link_announced;
+	l->heard = now;
+}
+
+// 'k': Keep the trial step
+void link_committed(LinkRate * l, uint8_t step, uint32_t now)
+{
+	if ((l->state == k_link_trial) && (step == l->step)) {
+		l->state = k_link_steady;
+	}
+	l->heard = now;
+}
+
+// 'v': A probe. Station 0 only counts the ones that made it round.
+void link_probe(LinkRate * l, bool ok, bool cameBack, uint32_t now)
+{
+	if (!ok) {
+		l->probes_bad++;
+		return;
+	}
+
+	l->probes_ok++;
+	l->heard = now;
+	if (cameBack) l->probes_back++;
+}
+
+//
+//  Station 0
+//
+
+void link_announce(LinkRate * l, uint8_t step, bool final)
+{
+	l->next = step;
+	l->final = final;
+	l->state = k_link_announced;
+	l->announcing = true;
+	l->probes_sent = 0;
+	l->probes_back = 0;
+	l->commits_sent = 0;
+}
+
+// Station 0 sent what link_update() asked for. (It waits for a gap
+// between lines, so that may take a few passes of loop().)
+void link_sent(LinkRate * l, LinkSend what, uint32_t now)
+{
+	switch (what) {
+		case k_link_send_announce:
+			l->announcing = false;
+			break;
+
+		case k_link_send_probe:
+			l->probes_sent++;
+			l->check_at = now;
+			break;
+
+		case k_link_send_commit:
+			if (++l->commits_sent == LINK_COMMITS) {
+				l->state = k_link_steady;
+				l->next_action = now + LINK_CLIMB_MILLIS;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+//
+//  Call every pass of loop(). Switches when it's time, and returns
+//  what station 0 should send next (again, until link_sent()).
+//  sync is time_sync_now(), now is millis().
+//
+
+LinkSend link_update(LinkRate * l, bool master, uint32_t sync, uint32_t now)
+{
+	switch (l->state) {
+		case k_link_announced:
+		{
+			if (master && l->announcing) {
+				l->switch_at = sync + LINK_LEAD_MILLIS;
+				return k_link_send_announce;
+			}
+
+			if (!link_reached(sync, l->switch_at)) return k_link_send_none;
+
+			l->prev = l->step;
+			link_switch(l, l->next);
+			l->state = l->final ? k_link_steady : k_link_trial;
+			l->heard = now;
+			return k_link_send_none;
+		}
+
+		case k_link_trial:
+		{
+			// Committing: Finish, even if it runs late
+			if (master && (l->commits_sent > 0)) return k_link_send_commit;
+
+			if (link_reached(sync, l->switch_at + LINK_TRIAL_MILLIS)) {
+				// No commit: Go back. Station 0 stops climbing.
+				link_switch(l, l->prev);
+				l->state = k_link_steady;
+				l->heard = now;
+
+				if (master) {
+					l->cap = l->prev;
+					l->next_action = now + LINK_CHECK_MILLIS;
+				}
+				return k_link_send_none;
+			}
+
+			if (!master || !link_reached(sync, l->switch_at + LINK_GUARD_MILLIS)) return k_link_send_none;
+
+			if (l->probes_sent < LINK_PROBES) return k_link_send_probe;
+
+			bool decide = link_reached(sync, l->switch_at + LINK_DECIDE_MILLIS);
+			bool late = link_reached(sync, l->switch_at + LINK_TRIAL_MILLIS - LINK_LEAD_MILLIS);
+			return (decide && !late && (l->probes_back >= LINK_PROBES)) ? k_link_send_commit : k_link_send_none;
+		}
+
+		default:
+			break;
+	}
+
+	if (!master) {
+		// Lost: Back to where every station ends up
+		if ((now - l->heard) > LINK_WATCHDOG_MILLIS) {
+			link_switch(l, 0);
+			l->heard = now;
+		}
+		return k_link_send_none;
+	}
+
+	if (l->checking) {
+		if (l->probes_sent < LINK_CHECK_PROBES) return k_link_send_probe;
+		if ((now - l->check_at) < LINK_DECIDE_MILLIS) return k_link_send_none;
+
+		l->checking = false;
+		if (l->probes_back < LINK_CHECK_PASS) {
+			// Fall back. Then climb again, short of this step.
+			l->cap = l->step - 1;
+			l->next_action = now + LINK_WATCHDOG_MILLIS + LINK_CLIMB_MILLIS;
+			link_announce(l, 0, true);
+			return k_link_send_none;
+		}
+	}
+
+	if (!link_reached(now, l->next_action)) return k_link_send_none;
+
+	if (l->step < l->cap) {
+		link_announce(l, l->step + 1, false);
+		return k_link_send_none;
+	}
+
+	l->next_action = now + LINK_CHECK_MILLIS;
+
+	if (l->step > 0) {
+		l->checking = true;
+		l->probes_sent = 0;
+		l->probes_back = 0;
+	}
+
+	return k_link_send_none;
+}
+
+#endif
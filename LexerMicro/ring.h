@@ -0,0 +1,248 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+//
+//  Ring forwarding: Cut-through
+//
+//  ring_pump() runs from a timer interrupt (see LexerMicro.ino), so
+//  bytes move downstream as they arrive, not when loop() gets
+//  around to it between frames. The lifespan byte is decremented on
+//  the fly, and every other byte is passed straight on. Nothing is
+//  validated on the way through: a copy of each byte goes into a
+//  queue, and loop() hands those to the local parser
+//  (computer_input_from_usb(), computer_input_from_upstream()).
+//
+//  Parsing is budgeted (queue_drain()), so a burst of program lines
+//  can't hold up the next frame. Bytes wait in the queue instead.
+//  If the queue fills up, or the downstream UART's transmit buffer
+//  does, the pump leaves bytes in the port: USB flow control holds
+//  the host back, and the ISR never blocks in write().
+//
+//  A port that stops mid-line (the host died mid-write, a cable came
+//  out) would hold the downstream link forever. After
+//  RING_OWNER_TIMEOUT quiet passes, its line is ended, as for one
+//  that's too long.
+//
+
+#define RING_QUEUE_SIZE    (256)	// Power of 2
+#define RING_PUMP_MICROS   (250)	// A byte takes 1042 us at 9600 baud
+#define RING_OWNER_TIMEOUT (20)	// Pump passes: 5 ms without a byte ends the line
+
+// Parse budget, per port, per call to queue_drain()
+#define PARSE_MIN_BYTES    (16)	// Always: A frame's worth at 9600 baud, so parsing keeps up
+#define PARSE_MAX_BYTES    (128)	// At most, even with time to spare
+
+// Lines longer than this are dropped by every parser anyway. Cut
+// them off, so the other port gets a turn.
+#define RING_MAX_LINE      (MAX_LINE_LEN)
+
+typedef enum {
+	k_port_usb = 0,
+	k_port_upstream = 1,
+	k_port_count = 2,
+	k_port_none = 0xff
+} RingPort;
+
+// Single producer (the pump), single consumer (loop())
+typedef struct {
+	uint8_t data[RING_QUEUE_SIZE];
+	volatile uint16_t head;	// Written by the producer only
+	volatile uint16_t tail;	// Written by the consumer only
+	volatile uint32_t overflows;	// Pump passes cut short: The queue was full
+	uint16_t backlog_max;	// Most bytes waiting, seen by queue_drain()
+
+	// When the newest line arrived, for time sync (see serial_read_sync())
+	volatile uint32_t line_micros;
+	volatile uint16_t lines_in;	// Newlines pushed
+	uint16_t lines_out;	// Newlines popped
+} ByteQueue;
+
+typedef struct {
+	bool line_start;	// Next byte is a lifespan
+	bool sharing;	// This line goes downstream
+	uint16_t length;
+} LineForwarder;
+
+typedef struct {
+	LineForwarder lines[k_port_count];
+	ByteQueue local[k_port_count];	// Bytes for this station, by port
+	uint8_t owner;	// Port whose line is going downstream, or k_port_none
+	uint8_t owner_idle;	// Pump passes since the owner had a byte for us
+	volatile bool hold;	// Station 0: New USB lines wait (the ring is changing rate, see linkrate.h)
+	volatile uint32_t forwarded;
+} Ring;
+
+bool queue_push(ByteQueue * q, uint8_t b)
+{
+	uint16_t head = q->head;
+
+	if ((uint16_t)(head - q->tail) >= RING_QUEUE_SIZE) return false;
+
+	q->data[head & (RING_QUEUE_SIZE - 1)] = b;
+	q->head = head + 1;	// Publish after the byte is stored
+	return true;
+}
+
+bool queue_pop(ByteQueue * q, uint8_t * b)
+{
+	uint16_t tail = q->tail;
+	if (tail == q->head) return false;
+
+	*b = q->data[tail & (RING_QUEUE_SIZE - 1)];
+	q->tail = tail + 1;
+	return true;
+}
+
+uint16_t queue_count(const ByteQueue * q)
+{
+	return (uint16_t)(q->head - q->tail);
+}
+
+// Hand queued bytes to parse(): at least PARSE_MIN_BYTES, then more
+// until PARSE_MAX_BYTES or micros() reaches deadline. Returns the
+// number of bytes parsed.
+template <class Parse>
+uint16_t queue_drain(ByteQueue * q, Parse parse, uint32_t deadline)
+{
+	q->backlog_max = max(q->backlog_max, queue_count(q));
+
+	uint16_t n = 0;
+	uint8_t b;
+
+	while ((n < PARSE_MAX_BYTES) && queue_pop(q, &b)) {
+		// The arrival time is only known for the newest line
+		if (b == '\n') {
+			q->lines_out++;
+			line_arrival_micros = q->line_micros;
+			line_arrival_known = (q->lines_out == q->lines_in);
+		}
+
+		parse(b);
+		n++;
+
+		// Wrap-safe: micros() wraps every 71 minutes
+		if ((n >= PARSE_MIN_BYTES) && ((int32_t)(micros() - deadline) >= 0)) break;
+	}
+
+	return n;
+}
+
+void ring_init(Ring * r)
+{
+	memset(r, 0, sizeof(Ring));
+
+	for (uint8_t p = 0; p < k_port_count; p++) {
+		r->lines[p].line_start = true;
+	}
+	r->owner = k_port_none;
+}
+
+// The byte to send downstream in place of b, or -1 for none.
+// Lifespans '1'..'9' go on as '0'..'8'. Lines with lifespan '0',
+// or without a lifespan, stop here. An overlong line is ended with
+// a '\n' one byte past RING_MAX_LINE: The next station drops it
+// too, and the line after it arrives intact.
+int16_t forward_byte(LineForwarder * f, uint8_t b)
+{
+	int16_t out = b;
+
+	if (f->line_start) {
+		f->sharing = ('1' <= b) && (b <= '9');
+		f->length = 0;
+		out = b - 1;
+	}
+
+	f->line_start = (b == '\n');
+
+	if (f->sharing && (++f->length > RING_MAX_LINE + 1)) {
+		f->sharing = false;
+		return '\n';
+	}
+
+	return f->sharing ? out : -1;
+}
+
+// Drain one input port. Lines from two ports can't interleave
+// downstream: while one port's line is going out, the other
+// port's bytes wait in its receive buffer. So do bytes with no
+// room for them, in the queue or downstream.
+template <class In, class Out>
+void ring_pump_port(Ring * r, uint8_t port, In & in, Out & out)
+{
+	LineForwarder * f = &r->lines[port];
+	ByteQueue * q = &r->local[port];
+
+	while (in.available() > 0) {
+		if ((r->owner != k_port_none) && (r->owner != port)) return;
+		if (r->hold && (port == k_port_usb) && f->line_start) return;
+		if (out.availableForWrite() <= 0) return;
+
+		if (queue_count(q) >= RING_QUEUE_SIZE) {
+			q->overflows++;
+			return;
+		}
+
+		uint8_t b = in.read();
+		r->owner_idle = 0;
+
+		if (queue_push(q, b) && (b == '\n')) {
+			q->line_micros = micros();
+			q->lines_in++;
+		}
+
+		int16_t fwd = forward_byte(f, b);
+
+		if (fwd >= 0) {
+			out.write((uint8_t)fwd);
+			r->forwarded++;
+		}
+
+		// Hold the downstream link until this line ends (or is cut off)
+		r->owner = (f->sharing && !f->line_start) ? port : k_port_none;
+	}
+}
+
+// The owner went quiet mid-line: End the line downstream and
+// locally, and let go of the link. The rest of it, if it ever
+// comes, stops here.
+template <class Out>
+void ring_cut_owner(Ring * r, Out & out)
+{
+	if (out.availableForWrite() <= 0) return;
+
+	LineForwarder * f = &r->lines[r->owner];
+	ByteQueue * q = &r->local[r->owner];
+
+	if (queue_push(q, '\n')) {
+		q->line_micros = micros();
+		q->lines_in++;
+	}
+
+	f->sharing = false;
+	out.write('\n');
+	r->owner = k_port_none;
+}
+
+template <class Usb, class Upstream, class Out>
+void ring_pump(Ring * r, Usb & usb, Upstream & upstream, Out & out)
+{
+	ring_pump_port(r, k_port_usb, usb, out);
+	ring_pump_port(r, k_port_upstream, upstream, out);
+
+	// Quiet: Nothing waiting. (Bytes held up by a full queue or
+	// transmit buffer don't count.)
+	if (r->owner == k_port_none) return;
+
+	bool quiet = (r->owner == k_port_usb) ? (usb.available() <= 0) : (upstream.available() <= 0);
+
+	if (!quiet) {
+		r->owner_idle = 0;
+	} else if (++r->owner_idle >= RING_OWNER_TIMEOUT) {
+		ring_cut_owner(r, out);
+	}
+}
+
+#endif
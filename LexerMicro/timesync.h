@@ -0,0 +1,111 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdint.h>
+#include <string.h>
+
+//
+//  Ring time sync
+//
+//  Each station adds up its own animation time (vTime) from its own
+//  crystal, so the letters drift apart by a few seconds a day.
+//  Station 0 sends its time down the ring once a second (a 'y' line,
+//  see sync_line() in computer.h). Getting there takes a while:
+//  the line itself, then a byte and a pump wait for each station it
+//  passes through (forwarding is cut-through, see ring.h). The
+//  receiver adds that delay, then slews toward the result, running
+//  at most 1/SYNC_SLEW_DIV fast or slow, so motion stays smooth.
+//  Only a big error (at boot, or after a reset) jumps.
+//
+//  These are plain functions of the clock readings, so the host can
+//  run a whole ring of them with skewed clocks (see test_vm.cpp).
+//
+
+#define SYNC_INTERVAL_MILLIS  (1000)	// Station 0 sends this often
+#define SYNC_LINE_LEN         (11)	// Lifespan, 'y', 8 hex digits, newline
+#define SERIAL_BYTE_MICROS    (1042)	// 10 bits at 9600 baud (see linkrate.h for faster)
+
+// At each hop, a byte must arrive before it can be passed on, then
+// waits for the ring pump: Half of RING_PUMP_MICROS, on average
+#define SYNC_PUMP_WAIT_MICROS (125)
+
+#define SYNC_SLEW_DIV         (8)
+#define SYNC_JUMP_MILLIS      (500)
+
+typedef struct {
+	uint32_t millis;	// Animation time (vTime)
+	uint32_t stamp;	// micros: When millis was last advanced
+	int32_t pending;	// millis: Error still to slew in
+
+	// Stats
+	int32_t last_error;	// millis: At the last sync
+	uint32_t syncs;
+	uint32_t jumps;
+} TimeSync;
+
+void time_sync_init(TimeSync * ts, uint32_t now)
+{
+	memset(ts, 0, sizeof(TimeSync));
+	ts->stamp = now;
+}
+
+// Time goes back to 0 (a 't' line)
+void time_sync_reset(TimeSync * ts, uint32_t now)
+{
+	ts->millis = 0;
+	ts->stamp = now;
+	ts->pending = 0;
+}
+
+// Animation time at micros now, between frames.
+// (Wrap-safe: micros() wraps every 71 minutes)
+uint32_t time_sync_now(const TimeSync * ts, uint32_t now)
+{
+	return ts->millis + (now - ts->stamp) / 1000;
+}
+
+// Call once per frame, with the millis from frame_swap(). Returns
+// the millis to advance vTime by: elapsedMillis, plus some slew.
+uint32_t time_sync_advance(TimeSync * ts, uint32_t elapsedMillis, uint32_t now)
+{
+	int32_t limit = (elapsedMillis + SYNC_SLEW_DIV - 1) / SYNC_SLEW_DIV;
+	int32_t slew = constrain(ts->pending, -limit, limit);
+
+	ts->pending -= slew;
+	ts->millis += elapsedMillis + slew;
+	ts->stamp = now;
+
+	return elapsedMillis + slew;
+}
+
+// micros from station 0 sending a sync line, to its newline arriving
+// hops stations downstream, with byteMicros per byte on the wire
+uint32_t time_sync_delay(uint8_t hops, uint32_t byteMicros)
+{
+	return (SYNC_LINE_LEN - 1) * byteMicros + hops * (byteMicros + SYNC_PUMP_WAIT_MICROS);
+}
+
+// Station 0's time was refMillis when it sent the line, and the
+// newline arrived at micros arrival. Returns true if time jumped.
+bool time_sync_receive(TimeSync * ts, uint32_t refMillis, uint8_t hops, uint32_t byteMicros, uint32_t arrival, uint32_t now)
+{
+	uint32_t target = refMillis + (time_sync_delay(hops, byteMicros) + (now - arrival)) / 1000;
+	int32_t error = (int32_t)(target - time_sync_now(ts, now));
+
+	ts->last_error = error;
+	ts->syncs++;
+
+	if ((error > SYNC_JUMP_MILLIS) || (error < -SYNC_JUMP_MILLIS)) {
+		ts->millis += error;
+		ts->pending = 0;
+		ts->jumps++;
+		return true;
+	}
+
+	// Replaces the old error: This one is measured against the time
+	// already slewed
+	ts->pending = error;
+	return false;
+}
+
+#endif
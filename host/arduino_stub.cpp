@@ -0,0 +1,10 @@
+//
+//  arduino_stub.cpp
+//
+//  Storage for the host stand-ins declared in include/Arduino.h
+//
+
+#include "Arduino.h"
+
+HostSerial Serial;
+HostSerial Serial1;
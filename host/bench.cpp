@@ -0,0 +1,308 @@
+//
+//  bench.cpp
+//
+//  Host-native microbenchmarks for the LexerMicro VM.
+//
+//    * ns per LED per step, for every op_* function
+//    * frames/sec of computer_run(), for each attract program
+//    * fastmath.h against libm: ns per call, and worst error
+//    * upload size and time: text lines against binary frames
+//
+//  Programs are loaded through the serial protocol, exactly
+//  like the firmware receives them.
+//
+
+// Mirror LexerMicro.ino
+#define STATION_ID      (0)
+#define LEDS_PER_STRIP  (76)
+#define LED_COUNT       (LEDS_PER_STRIP * 3)
+
+#include "attract.h"
+#include "computer.h"
+#include "wire_encode.h"
+
+#define OP_FRAMES       (2000)
+#define OP_REPEAT       (32)	// copies of the op under test, per program
+#define ATTRACT_FRAMES  (20000)
+#define FRAME_MILLIS    (16)
+#define TIME_RUNS       (5)
+#define MATH_INPUTS     (4096)
+#define MATH_PASSES     (200)
+#define WIRE_BAUD       (9600)
+#define WIRE_BITS       (10)	// Per byte: start, 8 data, stop
+
+int drawingMemory[LEDS_PER_STRIP * 6];
+OctoWS2811 leds(LEDS_PER_STRIP, NULL, drawingMemory, WS2811_RBG | WS2811_800kHz);
+
+typedef struct {
+	char code;
+	const char * name;
+} BenchOp;
+
+// Wire codes, as decoded by serial_read_op()
+const BenchOp BENCH_OPS[] = {
+	{'+', "add"},      {'-', "subtract"}, {'*', "multiply"}, {'/', "divide"},
+	{'%', "mod"},      {'<', "lt"},       {'>', "gt"},       {'{', "lte"},
+	{'}', "gte"},      {'=', "equal"},    {'!', "notequal"}, {'?', "ternary"},
+	{'S', "sin"},      {'C', "cos"},      {'s', "sin01"},    {'c', "cos01"},
+	{'q', "sinq"},     {'Q', "cosq"},     {'T', "tan"},      {'P', "pow"},
+	{'|', "abs"},      {'A', "atan2"},    {'_', "floor"},    {'`', "ceil"},
+	{'r', "round"},    {'.', "frac"},     {'R', "sqrt"},     {'L', "log"},
+	{'B', "logBase"},  {'z', "rand"},     {'Z', "randRange"},{'1', "noise1"},
+	{'2', "noise2"},   {'3', "noise3"},   {'4', "noise1q"},  {'5', "noise2q"},
+	{'6', "noise3q"},  {'m', "min"},      {'M', "max"},      {'l', "lerp"},
+	{'x', "clamp"},    {'t', "tri"},      {'p', "peak"},     {'b', "uni2bi"},
+	{'u', "bi2uni"},   {'0', "accum0"},   {'[', "rgb"},      {']', "hsv"}
+};
+
+#define BENCH_OP_COUNT  (sizeof(BENCH_OPS) / sizeof(BENCH_OPS[0]))
+
+void send_line(const char * line) {
+	computer_input_from_usb('1');	// lifespan
+	while (*line) {
+		computer_input_from_usb(*line);
+		line++;
+	}
+	computer_input_from_usb('\n');
+}
+
+// Three per-LED, per-frame inputs (so nothing can be
+// precomputed), followed by `repeat` copies of the op.
+// Every copy reads the same inputs.
+void load_op_program(char code, uint8_t repeat) {
+	char line[MAX_LINE_LEN];
+
+	send_line("c!");
+	send_line("s!+X_,T_");
+	send_line("s\"+Y_,T_");
+	send_line("s#+A_,T_");
+
+	for (uint8_t i = 0; i < repeat; i++) {
+		snprintf(line, sizeof(line), "s%c%cv!,v\",v#", '$' + i, code);
+		send_line(line);
+	}
+
+	snprintf(line, sizeof(line), "c%c", '$' + repeat);
+	send_line(line);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+	return d.count();
+}
+
+// Best of TIME_RUNS, to shrug off scheduler noise
+double time_frames(uint32_t frames) {
+	computer_run(FRAME_MILLIS);	// warm up
+
+	double best = 1e9;
+
+	for (uint8_t r = 0; r < TIME_RUNS; r++) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < frames / TIME_RUNS; i++) {
+			computer_run(FRAME_MILLIS);
+		}
+		best = min(best, seconds_since(start) * TIME_RUNS);
+	}
+
+	return best;
+}
+
+// FNV-1a over the drawing buffer. Compare between commits
+// to check that an optimization didn't change the output.
+uint32_t pixel_hash() {
+	uint32_t h = 2166136261u;
+	for (uint32_t px : leds.drawing) {
+		for (uint8_t i = 0; i < 4; i++) {
+			h = (h ^ ((px >> (i * 8)) & 0xff)) * 16777619u;
+		}
+	}
+	return h;
+}
+
+void bench_ops() {
+	set_station_id(6);	// The huge M has the most LEDs
+	uint16_t ledCount = led_count;
+
+	printf("ops: station 6, %u LEDs, %u frames, %u copies per program\n",
+		ledCount, OP_FRAMES, OP_REPEAT);
+	printf("%-10s %10s\n", "op", "ns/LED/step");
+
+	load_op_program('+', 0);
+	double base = time_frames(OP_FRAMES);
+
+	for (uint8_t i = 0; i < BENCH_OP_COUNT; i++) {
+		reset_time_and_accumulators();
+		load_op_program(BENCH_OPS[i].code, OP_REPEAT);
+		double t = time_frames(OP_FRAMES) - base;
+		double ns = t * 1e9 / ((double)OP_FRAMES * ledCount * OP_REPEAT);
+		printf("%-10s %10.2f\n", BENCH_OPS[i].name, ns);
+	}
+}
+
+void bench_attract() {
+	printf("\nattract: %u frames, %u ms per frame\n", ATTRACT_FRAMES, FRAME_MILLIS);
+	printf("%-8s %6s %6s %6s %12s %10s\n", "program", "LEDs", "steps", "loop", "frames/sec", "pixels");
+
+	for (uint8_t i = 0; i < ATTRACT_MODES_LEN; i++) {
+		set_station_id(i);
+		reset_time_and_accumulators();
+		randomSeed(4242);
+		leds.drawing.assign(leds.drawing.size(), 0);
+
+		const char * str = ATTRACT_MODES[i];
+		while (*str) {
+			computer_input_from_usb(*str);
+			str++;
+		}
+
+		double t = time_frames(ATTRACT_FRAMES);
+		printf("%-8u %6u %6u %6u %12.0f %10.8x\n", i, led_count, program->step_count,
+			led_step_count, ATTRACT_FRAMES / t, pixel_hash());
+	}
+}
+
+typedef struct {
+	const char * name;
+	float (*fast)(float a, float b);
+	float (*libm)(float a, float b);
+	float lo[2];	// range of a and b
+	float hi[2];
+} BenchMath;
+
+const BenchMath BENCH_MATH[] = {
+	{"sin", [](float a, float b) { return fast_sin(a); }, [](float a, float b) { return sinf(a); }, {-100, 0}, {100, 0}},
+	{"cos", [](float a, float b) { return fast_cos(a); }, [](float a, float b) { return cosf(a); }, {-100, 0}, {100, 0}},
+	{"sin01", [](float a, float b) { return fast_sin_turns(a); }, [](float a, float b) { return sinf(a * (float)(M_PI * 2.0f)); }, {-10, 0}, {10, 0}},
+	{"tan", [](float a, float b) { return fast_tan(a); }, [](float a, float b) { return tanf(a); }, {-1.4f, 0}, {1.4f, 0}},
+	{"atan2", [](float a, float b) { return fast_atan2(a, b); }, [](float a, float b) { return atan2f(a, b); }, {-100, -100}, {100, 100}},
+	{"log", [](float a, float b) { return fast_log(a); }, [](float a, float b) { return logf(a); }, {0.01f, 0}, {1000, 0}},
+	{"logBase", [](float a, float b) { return fast_log(a) / fast_log(b); }, [](float a, float b) { return logf(a) / logf(b); }, {0.1f, 2}, {100, 10}},
+	{"pow", [](float a, float b) { return fast_pow(a, b); }, [](float a, float b) { return powf(a, b); }, {0.1f, -3}, {10, 3}},
+	{"sqrt", [](float a, float b) { return fast_sqrt(a); }, [](float a, float b) { return sqrtf(a); }, {0, 0}, {1000, 0}},
+};
+
+#define BENCH_MATH_COUNT  (sizeof(BENCH_MATH) / sizeof(BENCH_MATH[0]))
+
+double time_math(float (*fn)(float, float), const float * a, const float * b) {
+	double best = 1e9;
+	volatile float sink = 0.0f;
+
+	for (uint8_t run = 0; run < TIME_RUNS; run++) {
+		auto start = std::chrono::steady_clock::now();
+		float sum = 0.0f;
+		for (uint32_t p = 0; p < MATH_PASSES; p++) {
+			for (uint32_t i = 0; i < MATH_INPUTS; i++) {
+				sum += fn(a[i], b[i]);
+			}
+		}
+		sink = sum;
+		best = min(best, seconds_since(start));
+	}
+
+	(void)sink;
+	return best * 1e9 / ((double)MATH_PASSES * MATH_INPUTS);
+}
+
+void bench_math() {
+	static float a[MATH_INPUTS];
+	static float b[MATH_INPUTS];
+
+	printf("\nmath: fastmath.h against libm, %u inputs\n", MATH_INPUTS);
+	printf("%-10s %10s %10s %12s\n", "function", "libm ns", "fast ns", "worst error");
+
+	for (uint8_t m = 0; m < BENCH_MATH_COUNT; m++) {
+		const BenchMath * bm = &BENCH_MATH[m];
+		double worst = 0.0;
+
+		randomSeed(1);
+		for (uint32_t i = 0; i < MATH_INPUTS; i++) {
+			a[i] = bm->lo[0] + (bm->hi[0] - bm->lo[0]) * randf();
+			b[i] = bm->lo[1] + (bm->hi[1] - bm->lo[1]) * randf();
+
+			double ref = bm->libm(a[i], b[i]);
+			worst = max(worst, fabs(bm->fast(a[i], b[i]) - ref) / max(1.0, fabs(ref)));
+		}
+
+		printf("%-10s %10.2f %10.2f %12.2g\n", bm->name,
+			time_math(bm->libm, a, b), time_math(bm->fast, a, b), worst);
+	}
+}
+
+// Bytes of the program's 's' and 'c' lines, in an attract string
+uint32_t text_program_bytes(const char * str) {
+	uint32_t bytes = 0;
+
+	while (*str) {
+		const char * end = strchr(str, '\n');
+		uint32_t len = end ? (end - str + 1) : strlen(str);
+
+		if ((str[1] == 's') || (str[1] == 'c')) {
+			bytes += len;
+		}
+		str += len;
+	}
+
+	return bytes;
+}
+
+double upload_millis(uint32_t bytes) {
+	return bytes * WIRE_BITS * 1000.0 / WIRE_BAUD;
+}
+
+void bench_wire() {
+	printf("\nwire: program upload, text lines against binary frames, %u baud\n", WIRE_BAUD);
+	printf("%-8s %6s %10s %10s %8s %10s %10s\n", "program", "steps", "text B", "binary B", "frames", "text ms", "binary ms");
+
+	uint32_t textTotal = 0;
+	uint32_t binaryTotal = 0;
+
+	for (uint8_t i = 0; i < ATTRACT_MODES_LEN; i++) {
+		set_station_id(i);
+
+		const char * str = ATTRACT_MODES[i];
+		while (*str) {
+			computer_input_from_usb(*str);
+			str++;
+		}
+
+		std::vector<std::string> lines = encode_program(program, '1');
+		uint32_t binary = 0;
+		for (const std::string & line : lines) {
+			binary += line.size();
+		}
+
+		uint32_t text = text_program_bytes(ATTRACT_MODES[i]);
+		textTotal += text;
+		binaryTotal += binary;
+
+		printf("%-8u %6u %10u %10u %8zu %10.1f %10.1f\n", i, program->step_count, text, binary,
+			lines.size() - 1, upload_millis(text), upload_millis(binary));
+	}
+
+	printf("%-8s %6s %10u %10u %8s %10.1f %10.1f\n", "all", "", textTotal, binaryTotal, "",
+		upload_millis(textTotal), upload_millis(binaryTotal));
+}
+
+int main(int argc, char ** argv) {
+	computer_init(&leds);
+
+	bool runOps = true;
+	bool runAttract = true;
+	bool runMath = true;
+	bool runWire = true;
+
+	if (argc > 1) {
+		runOps = (strcmp(argv[1], "ops") == 0);
+		runAttract = (strcmp(argv[1], "attract") == 0);
+		runMath = (strcmp(argv[1], "math") == 0);
+		runWire = (strcmp(argv[1], "wire") == 0);
+	}
+
+	if (runOps) bench_ops();
+	if (runAttract) bench_attract();
+	if (runMath) bench_math();
+	if (runWire) bench_wire();
+
+	return 0;
+}
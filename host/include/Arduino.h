@@ -0,0 +1,169 @@
+//
+//  Arduino.h  (host stub)
+//
+//  Just enough of the Teensyduino core to compile the LexerMicro
+//  VM on a desktop machine. Included ahead of every source file
+//  (the Arduino IDE does the same thing with the real one).
+//
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Standard headers go first: the helpers below would
+// otherwise clash with names in the C++ library.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#define HIGH          (1)
+#define LOW           (0)
+#define OUTPUT        (1)
+#define INPUT         (0)
+
+#define SERIAL_8N1    (0x00)
+
+#define DMAMEM
+
+//
+//  Time
+//
+
+inline uint32_t micros() {
+	static const auto start = std::chrono::steady_clock::now();
+	auto d = std::chrono::steady_clock::now() - start;
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+inline uint32_t millis() {
+	return micros() / 1000;
+}
+
+// Cycle counter. On the Teensy this is the DWT register; here it is
+// the TSC on x86, or nanoseconds elsewhere.
+inline uint32_t host_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return (uint32_t)__builtin_ia32_rdtsc();
+#else
+	auto d = std::chrono::steady_clock::now().time_since_epoch();
+	return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+#endif
+}
+
+#define ARM_DWT_CYCCNT  (host_cycles())
+
+//
+//  Math helpers (Teensyduino flavor)
+//
+
+template <class A, class B>
+inline auto min(A a, B b) -> typename std::decay<decltype((a < b) ? a : b)>::type { return (a < b) ? a : b; }
+
+template <class A, class B>
+inline auto max(A a, B b) -> typename std::decay<decltype((a > b) ? a : b)>::type { return (a > b) ? a : b; }
+
+template <class A, class L, class H>
+inline A constrain(A amt, L low, H high) {
+	return (amt < low) ? (A)(low) : ((amt > high) ? (A)(high) : amt);
+}
+
+//
+//  Random (Park-Miller, same generator as the Teensy 3 core)
+//
+
+inline uint32_t & _host_random_seed() {
+	static uint32_t seed = 1;
+	return seed;
+}
+
+inline void randomSeed(uint32_t newseed) {
+	if (newseed > 0) _host_random_seed() = newseed;
+}
+
+inline int32_t _host_random_next() {
+	int32_t x = (int32_t)_host_random_seed();
+	int32_t hi = x / 127773;
+	int32_t lo = x % 127773;
+	x = 16807 * lo - 2836 * hi;
+	if (x < 0) x += 0x7FFFFFFF;
+	_host_random_seed() = (uint32_t)x;
+	return x;
+}
+
+inline int32_t random(uint32_t howbig) {
+	if (howbig == 0) return 0;
+	return (int32_t)((uint32_t)_host_random_next() % howbig);
+}
+
+//
+//  GPIO: ignored
+//
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+
+//
+//  Serial ports: bytes are queued in memory.
+//  rx is fed by the host program, tx is collected for inspection.
+//
+
+class HostSerial {
+public:
+	std::deque<uint8_t> rx;
+	std::vector<uint8_t> tx;
+	bool echo = false;	// Copy print()/println() text to stdout
+	int tx_depth = INT_MAX;	// availableForWrite(): tx counts as a transmit buffer this deep
+
+	void begin(uint32_t) {}
+	void begin(uint32_t, uint32_t) {}
+	void setTX(uint8_t) {}
+	void setRX(uint8_t) {}
+
+	int available() { return (int)rx.size(); }
+
+	int read() {
+		if (rx.empty()) return -1;
+		uint8_t b = rx.front();
+		rx.pop_front();
+		return b;
+	}
+
+	size_t write(uint8_t b) { tx.push_back(b); return 1; }
+
+	int availableForWrite() { return ((int)tx.size() < tx_depth) ? (tx_depth - (int)tx.size()) : 0; }
+
+	size_t write(const uint8_t * data, size_t len) {
+		tx.insert(tx.end(), data, data + len);
+		return len;
+	}
+
+	void print(const char * s) { _text(s); }
+	void print(char c) { char s[2] = {c, 0}; _text(s); }
+	void print(int v) { _text(std::to_string(v).c_str()); }
+	void print(unsigned int v) { _text(std::to_string(v).c_str()); }
+	void print(long v) { _text(std::to_string(v).c_str()); }
+	void print(unsigned long v) { _text(std::to_string(v).c_str()); }
+	void print(double v) { char s[32]; snprintf(s, sizeof(s), "%.2f", v); _text(s); }
+
+	template <class T>
+	void println(T v) { print(v); _text("\n"); }
+	void println() { _text("\n"); }
+
+private:
+	void _text(const char * s) {
+		write((const uint8_t *)s, strlen(s));
+		if (echo) fputs(s, stdout);
+	}
+};
+
+extern HostSerial Serial;	// defined in arduino_stub.cpp
+extern HostSerial Serial1;
+
+#endif
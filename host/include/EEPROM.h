@@ -0,0 +1,41 @@
+//
+//  EEPROM.h  (host stub)
+//
+//  The Teensy 3.2's 2 KB EEPROM, in memory. Starts erased (0xff),
+//  like a new Teensy. Counts the writes that change a byte.
+//
+
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define E2END   (0x7ff)
+
+class HostEEPROM {
+public:
+	uint8_t data[E2END + 1];
+	uint32_t writes = 0;
+
+	HostEEPROM() { erase(); }
+
+	void erase() { memset(data, 0xff, sizeof(data)); }
+
+	uint8_t read(int idx) { return data[idx]; }
+
+	void write(int idx, uint8_t val) {
+		data[idx] = val;
+		writes++;
+	}
+
+	void update(int idx, uint8_t val) {
+		if (data[idx] != val) write(idx, val);
+	}
+
+	uint16_t length() { return E2END + 1; }
+};
+
+static HostEEPROM EEPROM;
+
+#endif
@@ -0,0 +1,56 @@
+//
+//  OctoWS2811.h  (host stub)
+//
+//  Records setPixel() into memory instead of driving DMA.
+//  show() latches the drawing buffer into the "displayed" frame.
+//
+
+#ifndef HOST_OCTOWS2811_H
+#define HOST_OCTOWS2811_H
+
+#include <stdint.h>
+#include <vector>
+
+#define WS2811_RGB      (0)
+#define WS2811_RBG      (1)
+#define WS2811_GRB      (2)
+#define WS2811_GBR      (3)
+
+#define WS2811_800kHz   (0x00)
+#define WS2811_400kHz   (0x10)
+
+class OctoWS2811 {
+public:
+	OctoWS2811(uint32_t numPerStrip, void * frameBuf, void * drawBuf, uint8_t config = WS2811_GRB)
+		: stripLen(numPerStrip), drawing(numPerStrip * 8), displayed(numPerStrip * 8) {}
+
+	void begin() {}
+
+	void setPixel(uint32_t num, int color) {
+		if (num < drawing.size()) drawing[num] = (uint32_t)(color & 0xffffff);
+	}
+
+	void setPixel(uint32_t num, uint8_t red, uint8_t green, uint8_t blue) {
+		setPixel(num, (red << 16) | (green << 8) | blue);
+	}
+
+	int getPixel(uint32_t num) {
+		return (num < drawing.size()) ? (int)drawing[num] : 0;
+	}
+
+	void show() {
+		displayed = drawing;
+		showCount++;
+	}
+
+	int busy() { return 0; }
+
+	int numPixels() { return (int)drawing.size(); }
+
+	uint32_t stripLen;
+	uint32_t showCount = 0;
+	std::vector<uint32_t> drawing;
+	std::vector<uint32_t> displayed;
+};
+
+#endif
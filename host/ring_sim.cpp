@@ -0,0 +1,388 @@
+//
+//  ring_sim.cpp
+//
+//  Ring network simulator: Eight stations (sim_station.cpp), wired
+//  T -> O -> ... -> P, and optionally P -> T, each link a UART with
+//  a FIFO depth and bit error rate. The stations negotiate the baud
+//  rate (linkrate.h), or run at a fixed one. Uploads a program into
+//  T's USB port, and reports:
+//
+//    * upload latency: USB to the program going live, per station
+//    * forwarding delay: first byte of the upload, per hop
+//    * lost data: line errors, overlong lines, UART overruns and
+//      framing errors. Also ISR passes cut short by a full parse
+//      queue (qfull), and writes to a full transmit FIFO (stalls),
+//      which should both stay 0
+//    * frame rate: swaps dropped and frames over budget, during the
+//      upload
+//    * ring rate: baud at the end, and probes received (linkrate.h)
+//
+//  Time is simulated (nanoseconds), so runs are repeatable. The VM
+//  itself runs at host speed; its cost on the Teensy is an estimate
+//  (SimCosts), set with --run-us, --show-us and --parse-us.
+//
+//    lexer_ring_sim [--baud 0] [--fifo 64] [--ber 0] [--burst 1]
+//                   [--program 0] [--seconds 5] [--upload-at 1]
+//                   [--run-us 6000] [--show-us 100] [--parse-us 4]
+//                   [--closed 0] [--weak -1] [--weak-baud 57600]
+//                   [--expect-baud 0]
+//
+//  --burst n sends n programs back to back: --program, then the next
+//  attract modes. Stations count as live on the last one.
+//  --baud 0 negotiates. --closed 1 wires P back to T, which rates
+//  above 9600 need. --weak k gives the link from station k a bit
+//  error rate of SIM_WEAK_BER above --weak-baud, like a long cable.
+//
+//  Exits non-zero if, without bit errors, a station misses the
+//  program, or if a station doesn't end up at --expect-baud.
+//
+
+#include "attract.h"
+#include "ring_sim.h"
+#include <string>
+#include <vector>
+
+#define SIM_WEAK_BER       (1e-3)	// A probe line gets through 3 times in 4
+#define SIM_UART_BITS      (10)	// Per byte: start, 8 data, stop
+#define SIM_PUMP_MICROS    (250)	// RING_PUMP_MICROS
+#define SIM_LIFESPAN       ('0' + SIM_STATIONS - 1)	// Reaches every station, from T
+
+const SimStationApi * const STATIONS[SIM_STATIONS] = {
+	&sim_station_0_api, &sim_station_1_api, &sim_station_2_api, &sim_station_3_api,
+	&sim_station_4_api, &sim_station_5_api, &sim_station_6_api, &sim_station_7_api
+};
+
+const char STATION_NAMES[SIM_STATIONS + 1] = "TOORCAMP";
+
+typedef struct {
+	uint32_t baud;	// 0: Negotiate
+	size_t fifo;
+	double ber;	// Per bit
+	uint32_t burst;	// Programs, back to back
+	uint8_t program;	// ATTRACT_MODES index
+	double seconds;	// After the upload
+	double upload_at;	// Seconds: Stations have booted and settled
+	SimCosts costs;
+	bool closed;	// P -> T
+	int weak;	// Station whose downstream link is weak, or -1
+	uint32_t weak_baud;	// Fastest rate that link takes cleanly
+	uint32_t expect_baud;	// Or 0
+} SimConfig;
+
+// One UART: Station k's downstream to station k + 1's upstream.
+// rx is NULL after P, unless the ring is closed.
+typedef struct {
+	SimPort * tx;
+	SimPort * rx;
+	bool busy;
+	int64_t done;	// ns: The byte on the wire arrives
+	uint8_t byte;
+	uint32_t baud;	// Sent at
+	double ber;	// At that rate
+} SimLink;
+
+typedef struct {
+	SimPort usb;
+	SimPort upstream;	// Receive FIFO
+	SimPort downstream;	// Transmit FIFO
+	int64_t next_isr;
+	int64_t next_loop;
+
+	int64_t first_byte;	// ns: First byte of the upload arrived, or -1
+	int64_t live;	// ns: The upload went live, or -1
+	SimStationStats before;	// At the upload
+} SimStation;
+
+uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*, 0..1
+double sim_random() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (double)((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// The byte as received, or -1 for a framing error
+int16_t sim_wire(uint8_t b, double ber) {
+	if (ber <= 0.0) return b;
+
+	for (uint8_t bit = 0; bit < SIM_UART_BITS; bit++) {
+		if (sim_random() >= ber) continue;
+
+		if ((bit == 0) || (bit == SIM_UART_BITS - 1)) return -1;	// Start or stop bit
+		b ^= 1 << (bit - 1);
+	}
+
+	return b;
+}
+
+// A byte sent at one rate, received at another: Garbage, if anything
+int16_t sim_mismatch() {
+	if (sim_random() < 0.5) return -1;
+	return (uint8_t)(sim_random() * 256.0);
+}
+
+double link_ber(const SimConfig * cfg, uint8_t k, uint32_t baud) {
+	if (((int)k == cfg->weak) && (baud > cfg->weak_baud)) return max(cfg->ber, SIM_WEAK_BER);
+	return cfg->ber;
+}
+
+uint32_t fnv1a_bytes(uint32_t h, const uint8_t * data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ data[i]) * 16777619u;
+	}
+	return h;
+}
+
+// The program's 'c', 'g' and 's' lines, sent from T to every
+// station, with a checksum on the last commit. Sets the checksum
+// of the steps, as SimStationStats reports it.
+std::string upload_bytes(const char * str, uint32_t * checksum) {
+	std::string out;
+	uint32_t stepHashes[256] = {0};
+	uint8_t count = 0;
+
+	while (*str) {
+		const char * end = strchr(str, '\n');
+		size_t len = end ? (end - str + 1) : strlen(str);
+		std::string line(str, len);
+		str += len;
+
+		if ((len < 3) || !strchr("cgs", line[1])) continue;
+
+		line[0] = SIM_LIFESPAN;
+		if (line[1] == 's') {
+			stepHashes[(uint8_t)(line[2] - '!')] = fnv1a_bytes(2166136261u, (const uint8_t *)&line[1], len - 2);
+		}
+		if (line[1] == 'c') {
+			count = line[2] - '!';
+		}
+		out += line;
+	}
+
+	uint32_t h = 2166136261u;
+	for (uint8_t s = 0; s < count; s++) {
+		uint8_t le[4] = {(uint8_t)stepHashes[s], (uint8_t)(stepHashes[s] >> 8), (uint8_t)(stepHashes[s] >> 16), (uint8_t)(stepHashes[s] >> 24)};
+		h = fnv1a_bytes(h, le, 4);
+	}
+	*checksum = h;
+
+	// The last line is the commit: Add the checksum
+	char hex[9];
+	snprintf(hex, sizeof(hex), "%08x", h);
+	out.insert(out.size() - 1, hex);
+	return out;
+}
+
+uint32_t sim_micros(int64_t t) {
+	return (uint32_t)(t / 1000);
+}
+
+bool parse_args(int argc, char ** argv, SimConfig * cfg) {
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const char * key = argv[i];
+		const char * value = argv[i + 1];
+
+		if (strcmp(key, "--baud") == 0) cfg->baud = atoi(value);
+		else if (strcmp(key, "--fifo") == 0) cfg->fifo = atoi(value);
+		else if (strcmp(key, "--ber") == 0) cfg->ber = atof(value);
+		else if (strcmp(key, "--burst") == 0) cfg->burst = atoi(value);
+		else if (strcmp(key, "--program") == 0) cfg->program = atoi(value) % ATTRACT_MODES_LEN;
+		else if (strcmp(key, "--seconds") == 0) cfg->seconds = atof(value);
+		else if (strcmp(key, "--upload-at") == 0) cfg->upload_at = atof(value);
+		else if (strcmp(key, "--run-us") == 0) cfg->costs.run_micros = atoi(value);
+		else if (strcmp(key, "--show-us") == 0) cfg->costs.show_micros = atoi(value);
+		else if (strcmp(key, "--parse-us") == 0) cfg->costs.parse_byte_micros = atoi(value);
+		else if (strcmp(key, "--closed") == 0) cfg->closed = (atoi(value) != 0);
+		else if (strcmp(key, "--weak") == 0) cfg->weak = atoi(value);
+		else if (strcmp(key, "--weak-baud") == 0) cfg->weak_baud = atoi(value);
+		else if (strcmp(key, "--expect-baud") == 0) cfg->expect_baud = atoi(value);
+		else return false;
+	}
+
+	return ((argc % 2) == 1) && (cfg->fifo > 0) && (cfg->upload_at >= 0.0);
+}
+
+int main(int argc, char ** argv) {
+	SimConfig cfg = {0, 64, 0.0, 1, 0, 5.0, 1.0, {6000, 100, 4}, false, -1, 57600, 0};
+
+	if (!parse_args(argc, argv, &cfg)) {
+		fprintf(stderr, "usage: %s [--baud n] [--fifo n] [--ber x] [--burst n] [--program n] [--seconds x]\n"
+			"       [--upload-at x] [--run-us n] [--show-us n] [--parse-us n] [--closed 0|1]\n"
+			"       [--weak k] [--weak-baud n] [--expect-baud n]\n", argv[0]);
+		return 2;
+	}
+
+	static SimStation st[SIM_STATIONS];
+	SimLink links[SIM_STATIONS];
+
+	for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+		st[k].usb.depth = SIZE_MAX;	// USB: Flow controlled, never full
+		st[k].upstream.depth = cfg.fifo;
+		st[k].downstream.depth = cfg.fifo;
+		st[k].next_isr = 0;
+		st[k].next_loop = 0;
+		st[k].first_byte = -1;
+		st[k].live = -1;
+
+		STATIONS[k]->init(&st[k].usb, &st[k].upstream, &st[k].downstream, &cfg.costs, cfg.baud, 0);
+	}
+
+	for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+		links[k].tx = &st[k].downstream;
+		links[k].rx = (k + 1 < SIM_STATIONS) ? &st[k + 1].upstream : (cfg.closed ? &st[0].upstream : NULL);
+		links[k].busy = false;
+	}
+
+	// Checksum of the last program: The one that has to go live
+	uint32_t checksum = 0;
+	std::string upload;
+	for (uint32_t i = 0; i < cfg.burst; i++) {
+		upload += upload_bytes(ATTRACT_MODES[(cfg.program + i) % ATTRACT_MODES_LEN], &checksum);
+	}
+
+	const int64_t uploadAt = (int64_t)(cfg.upload_at * 1e9);
+	const int64_t end = uploadAt + (int64_t)(cfg.seconds * 1e9);
+	bool uploaded = false;
+	int64_t t = 0;
+
+	while (t < end) {
+		// Next event
+		int64_t next = uploaded ? end : uploadAt;
+		for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+			next = min(next, min(st[k].next_isr, st[k].next_loop));
+			if (links[k].busy) next = min(next, links[k].done);
+		}
+		t = next;
+
+		if (!uploaded && (t >= uploadAt)) {
+			for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+				STATIONS[k]->stats(&st[k].before);
+			}
+			st[0].usb.fifo.insert(st[0].usb.fifo.end(), upload.begin(), upload.end());
+			st[0].first_byte = t;
+			uploaded = true;
+		}
+
+		for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+			SimLink * link = &links[k];
+			if (!link->busy || (link->done > t)) continue;
+
+			link->busy = false;
+			if (!link->rx) continue;
+
+			int16_t b = (link->rx->baud == link->baud) ? sim_wire(link->byte, link->ber) : sim_mismatch();
+			if (b < 0) {
+				link->rx->framing++;
+			} else {
+				link->rx->receive((uint8_t)b);
+			}
+
+			if (uploaded && (k + 1 < SIM_STATIONS) && (st[k + 1].first_byte < 0)) {
+				st[k + 1].first_byte = t;
+			}
+		}
+
+		for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+			if (st[k].next_isr <= t) {
+				STATIONS[k]->isr(sim_micros(t));
+				st[k].next_isr += SIM_PUMP_MICROS * 1000LL;
+			}
+		}
+
+		for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+			if (st[k].next_loop > t) continue;
+
+			uint32_t spent = STATIONS[k]->loop(sim_micros(t));
+
+			if (spent || STATIONS[k]->backlog()) {
+				st[k].next_loop = t + max(spent, 1u) * 1000LL;
+			} else {
+				// Idle until the next swap, or new bytes from the ISR
+				int32_t untilFrame = (int32_t)(STATIONS[k]->next_frame() - sim_micros(t));
+				st[k].next_loop = min(st[k].next_isr, t + max(untilFrame, 1) * 1000LL);
+			}
+
+			if (uploaded && (st[k].live < 0)) {
+				SimStationStats now;
+				STATIONS[k]->stats(&now);
+				if ((now.step_count > 0) && (now.program_checksum == checksum)) {
+					st[k].live = t;
+				}
+			}
+		}
+
+		// Bytes waiting to go out
+		for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+			SimLink * link = &links[k];
+			if (link->busy || link->tx->fifo.empty()) continue;
+
+			link->byte = link->tx->fifo.front();
+			link->tx->fifo.pop_front();
+			link->busy = true;
+			link->baud = link->tx->baud;
+			link->ber = link_ber(&cfg, k, link->baud);
+			link->done = t + (int64_t)SIM_UART_BITS * 1000000000LL / link->baud;
+		}
+	}
+
+	char baud[16] = "negotiated";
+	if (cfg.baud) snprintf(baud, sizeof(baud), "%u", cfg.baud);
+
+	printf("ring: program %u x %u (%zu bytes) at %.1f s, %s baud, %s, FIFO %zu, BER %g, %.1f s\n",
+		cfg.program, cfg.burst, upload.size(), cfg.upload_at, baud, cfg.closed ? "closed" : "open",
+		cfg.fifo, cfg.ber, cfg.seconds);
+	if (cfg.weak >= 0) {
+		printf("weak link: from station %d, BER %g above %u baud\n", cfg.weak, SIM_WEAK_BER, cfg.weak_baud);
+	}
+	printf("costs: run %u us, show %u us, parse %u us/byte\n\n",
+		cfg.costs.run_micros, cfg.costs.show_micros, cfg.costs.parse_byte_micros);
+
+	printf("%-8s %9s %8s %7s %7s %7s %7s %7s %7s %7s %6s %6s %6s %7s %11s\n", "station", "live ms", "hop us",
+		"errors", "longB", "qfull", "overrun", "framing", "stalls", "backlog", "fps", "drops", "over",
+		"baud", "probes bad");
+
+	int missed = 0;
+	int wrongBaud = 0;
+	int64_t prevFirst = -1;
+
+	for (uint8_t k = 0; k < SIM_STATIONS; k++) {
+		SimStationStats s;
+		STATIONS[k]->stats(&s);
+
+		char live[16] = "-";
+		if (st[k].live >= 0) {
+			snprintf(live, sizeof(live), "%.1f", (st[k].live - uploadAt) / 1e6);
+		} else {
+			missed++;
+		}
+
+		char hop[16] = "-";
+		if ((k > 0) && (prevFirst >= 0) && (st[k].first_byte >= 0)) {
+			snprintf(hop, sizeof(hop), "%.0f", (st[k].first_byte - prevFirst) / 1e3);
+		}
+		prevFirst = st[k].first_byte;
+
+		if (cfg.expect_baud && (s.baud != cfg.expect_baud)) wrongBaud++;
+
+		printf("%c %-6u %9s %8s %7u %7u %7u %7u %7u %7u %7u %6.1f %6u %6u %7u %6u %4u\n", STATION_NAMES[k], k, live, hop,
+			s.line_errors - st[k].before.line_errors,
+			s.bytes_dropped - st[k].before.bytes_dropped,
+			s.queue_overflows - st[k].before.queue_overflows,
+			st[k].upstream.overruns, st[k].upstream.framing, st[k].downstream.stalls,
+			s.backlog_max, s.fps,
+			s.frames_dropped - st[k].before.frames_dropped,
+			s.over_budget - st[k].before.over_budget,
+			s.baud, s.probes_ok, s.probes_bad);
+	}
+
+	if (missed) {
+		printf("\n%d station(s) missed the program\n", missed);
+	}
+	if (wrongBaud) {
+		printf("\n%d station(s) not at %u baud\n", wrongBaud, cfg.expect_baud);
+	}
+
+	return ((missed && (cfg.ber <= 0.0)) || wrongBaud) ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+//
+//  ring_sim.h
+//
+//  Shared by ring_sim.cpp (the wires) and sim_station.cpp (the
+//  firmware). Each station is sim_station.cpp built into its own
+//  namespace (-DSIM_STATION=n), so eight copies of the VM's globals
+//  can live in one program.
+//
+
+#ifndef RING_SIM_H
+#define RING_SIM_H
+
+#include <stdint.h>
+#include <deque>
+
+#define SIM_STATIONS    (8)
+
+// One end of a UART: The Teensy side of its FIFO. Bytes written to
+// a full transmit FIFO still go in (the Teensy write() blocks until
+// there's room), and are counted as stalls.
+class SimPort {
+public:
+	std::deque<uint8_t> fifo;
+	size_t depth = 64;
+	uint32_t baud = 9600;	// Set by the station (RINGSERIAL.begin())
+
+	// Stats
+	uint32_t overruns = 0;	// Receive: Bytes lost, the FIFO was full
+	uint32_t framing = 0;	// Receive: Bytes lost, bad start/stop bit
+	uint32_t stalls = 0;	// Transmit: Bytes written while full
+
+	int available() { return (int)fifo.size(); }
+
+	int read() {
+		if (fifo.empty()) return -1;
+		uint8_t b = fifo.front();
+		fifo.pop_front();
+		return b;
+	}
+
+	size_t write(uint8_t b) {
+		if (fifo.size() >= depth) stalls++;
+		fifo.push_back(b);
+		return 1;
+	}
+
+	size_t write(const uint8_t * data, size_t len) {
+		for (size_t i = 0; i < len; i++) write(data[i]);
+		return len;
+	}
+
+	int availableForWrite() {
+		return (fifo.size() < depth) ? (int)(depth - fifo.size()) : 0;
+	}
+
+	// From the wire
+	void receive(uint8_t b) {
+		if (fifo.size() >= depth) {
+			overruns++;
+		} else {
+			fifo.push_back(b);
+		}
+	}
+};
+
+// CPU time the simulated Teensy spends, in micros. The VM runs at
+// host speed, so these are estimates, set from the command line.
+typedef struct {
+	uint32_t run_micros;	// computer_run(), per frame
+	uint32_t show_micros;	// leds.show()
+	uint32_t parse_byte_micros;	// computer_input_from_*(), per byte
+} SimCosts;
+
+typedef struct {
+	uint32_t frames;
+	uint32_t frames_dropped;	// Swaps skipped: a frame ran late
+	uint32_t over_budget;
+	float fps;
+
+	uint32_t line_errors;
+	uint32_t bytes_received;
+	uint32_t bytes_dropped;	// Overlong lines
+	uint32_t queue_overflows;	// Pump passes cut short: Parse queue full (ring.h)
+	uint16_t backlog_max;
+
+	uint32_t program_checksum;	// Of the live program: upload_checksum() style
+	uint8_t step_count;
+
+	uint32_t baud;	// Ring rate, now (linkrate.h)
+	uint16_t probes_ok;
+	uint16_t probes_bad;
+	uint16_t baud_switches;
+} SimStationStats;
+
+typedef struct {
+	// baud: Fixed ring rate, or 0 to negotiate
+	void (*init)(SimPort * usb, SimPort * upstream, SimPort * downstream, const SimCosts * costs, uint32_t baud, uint32_t now);
+	void (*isr)(uint32_t now);	// ring_isr()
+	uint32_t (*loop)(uint32_t now);	// One pass of loop(). Returns the micros it took.
+	uint32_t (*next_frame)();	// micros: frames.due
+	uint16_t (*backlog)();	// Bytes waiting to be parsed
+	void (*stats)(SimStationStats * out);
+} SimStationApi;
+
+extern const SimStationApi sim_station_0_api;
+extern const SimStationApi sim_station_1_api;
+extern const SimStationApi sim_station_2_api;
+extern const SimStationApi sim_station_3_api;
+extern const SimStationApi sim_station_4_api;
+extern const SimStationApi sim_station_5_api;
+extern const SimStationApi sim_station_6_api;
+extern const SimStationApi sim_station_7_api;
+
+#endif
@@ -0,0 +1,208 @@
+//
+//  sim_station.cpp
+//
+//  One station of the ring simulator: The firmware's loop(), ring
+//  ISR and VM, on a simulated clock. Built once per station, with
+//  -DSIM_STATION=n, so each copy gets its own namespace. Mirrors
+//  LexerMicro.ino, which only builds for the Teensy.
+//
+
+#include <stdbool.h>
+#include <OctoWS2811.h>
+#include "ring_sim.h"
+
+// Stateless: Shared by every station. (Fixed's sin() and friends
+// would hide the float ones inside a namespace.)
+#include "fixed.h"
+#include "fastmath.h"
+#include "led_layout.h"
+
+#define SIM_CAT2(a, b)  a##b
+#define SIM_CAT(a, b)   SIM_CAT2(a, b)
+#define SIM_NS          SIM_CAT(sim_station_, SIM_STATION)
+#define SIM_API         SIM_CAT(SIM_NS, _api)
+
+namespace SIM_NS {
+
+// This station's clock. Hides the host's micros() from the VM.
+uint32_t sim_micros = 0;
+
+uint32_t micros() { return sim_micros; }
+uint32_t millis() { return sim_micros / 1000; }
+
+HostSerial Serial;	// USB replies ('q', 'p'): Unused
+
+// Mirror LexerMicro.ino
+#define STATION_ID      (SIM_STATION)
+#define LEDS_PER_STRIP  (76)
+#define LED_COUNT       (LEDS_PER_STRIP * 3)
+
+#include "computer.h"
+#include "frame.h"
+#include "ring.h"
+
+int drawingMemory[LEDS_PER_STRIP * 6];
+OctoWS2811 leds(LEDS_PER_STRIP, NULL, drawingMemory, WS2811_RBG | WS2811_800kHz);
+
+FrameScheduler frames;
+Ring ring;
+SimPort * usb = NULL;
+SimPort * upstream = NULL;
+SimPort * downstream = NULL;	// RINGSERIAL
+SimCosts costs;
+int ringTxIdle = 0;
+uint32_t syncDue = 0;
+
+// Parsing takes time, so queue_drain() sees its deadline coming
+void parse_usb(uint8_t b) {
+	computer_input_from_usb(b);
+	sim_micros += costs.parse_byte_micros;
+}
+
+void parse_upstream(uint8_t b) {
+	computer_input_from_upstream(b);
+	sim_micros += costs.parse_byte_micros;
+}
+
+void serial_input(uint32_t deadline) {
+	queue_drain(&ring.local[k_port_usb], parse_usb, deadline);
+	queue_drain(&ring.local[k_port_upstream], parse_upstream, deadline);
+}
+
+void send_time_sync() {
+	char line[SYNC_LINE_LEN];
+
+	if ((ring.owner == k_port_none) && (downstream->availableForWrite() >= ringTxIdle)) {
+		sync_line(line, micros());
+		downstream->write((const uint8_t *)line, SYNC_LINE_LEN);
+		syncDue = millis() + SYNC_INTERVAL_MILLIS;
+	}
+}
+
+// RINGSERIAL.begin(). (The Teensy's flush() first: Nothing is in
+// flight at a switch anyway.)
+void ring_begin(uint32_t baud) {
+	upstream->baud = baud;
+	downstream->baud = baud;
+}
+
+void link_service() {
+	bool master = (computer_get_station_id() == 0);
+	uint8_t step = link_rate.step;
+
+	LinkSend what = link_update(&link_rate, master, time_sync_now(&time_sync, micros()), millis());
+
+	if ((what != k_link_send_none) && (ring.owner == k_port_none) && (downstream->availableForWrite() >= ringTxIdle)) {
+		char line[LINK_LINE_MAX];
+		uint8_t len = link_line(line, what);
+		downstream->write((const uint8_t *)line, len);
+		link_sent(&link_rate, what, millis());
+	}
+
+	ring.hold = master && link_holding(&link_rate);
+
+	if (link_rate.step != step) {
+		ring_begin(link_baud(&link_rate));
+	}
+}
+
+void init(SimPort * inUsb, SimPort * inUpstream, SimPort * inDownstream, const SimCosts * inCosts, uint32_t baud, uint32_t now) {
+	sim_micros = now;
+	usb = inUsb;
+	upstream = inUpstream;
+	downstream = inDownstream;
+	costs = *inCosts;
+	ringTxIdle = downstream->availableForWrite();
+
+	computer_init(&leds);
+	frame_init(&frames, FRAME_TARGET_FPS, micros());
+	ring_init(&ring);
+	syncDue = millis();
+
+	// Fixed rate: As if built with LINK_NEGOTIATE off, at that rate
+	if (baud) {
+		link_rate.cap = 0;
+		for (uint8_t s = 0; s < LINK_STEPS; s++) {
+			if (LINK_BAUDS[s] == baud) link_rate.step = link_rate.cap = s;
+		}
+	}
+	ring_begin(baud ? baud : link_baud(&link_rate));
+}
+
+void isr(uint32_t now) {
+	sim_micros = now;
+	ring_pump(&ring, *usb, *upstream, *downstream);
+}
+
+uint32_t loop(uint32_t start) {
+	sim_micros = start;
+
+	serial_input(frames.due - FRAME_SHOW_MICROS);
+	link_service();
+
+	uint32_t now = micros();
+	if (!frame_due(&frames, now)) {
+		return micros() - start;
+	}
+
+	sim_micros += costs.show_micros;
+
+	uint32_t elapsed = frame_swap(&frames, now);
+
+	sim_micros += costs.run_micros;
+	computer_run(elapsed);
+
+	frame_drawn(&frames, micros());
+
+	if ((computer_get_station_id() == 0) && !link_holding(&link_rate) && ((int32_t)(millis() - syncDue) >= 0)) {
+		send_time_sync();
+	}
+
+	return micros() - start;
+}
+
+uint32_t next_frame() {
+	return frames.due;
+}
+
+uint16_t backlog() {
+	return queue_count(&ring.local[k_port_usb]) + queue_count(&ring.local[k_port_upstream]);
+}
+
+void stats(SimStationStats * out) {
+	out->frames = frames.frames;
+	out->frames_dropped = frames.dropped;
+	out->over_budget = frames.over_budget;
+	out->fps = frames.fps;
+
+	out->line_errors = telemetry.line_errors;
+	out->bytes_received = telemetry.bytes_received;
+	out->bytes_dropped = telemetry.bytes_dropped;
+	out->queue_overflows = ring.local[k_port_usb].overflows + ring.local[k_port_upstream].overflows;
+	out->backlog_max = max(ring.local[k_port_usb].backlog_max, ring.local[k_port_upstream].backlog_max);
+
+	uint32_t h = FNV1A_START;
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		uint32_t lh = program->step_hashes[s];
+		uint8_t le[4] = {(uint8_t)lh, (uint8_t)(lh >> 8), (uint8_t)(lh >> 16), (uint8_t)(lh >> 24)};
+		h = fnv1a(h, le, 4);
+	}
+	out->program_checksum = h;
+	out->step_count = program->step_count;
+
+	out->baud = upstream->baud;
+	out->probes_ok = link_rate.probes_ok;
+	out->probes_bad = link_rate.probes_bad;
+	out->baud_switches = link_rate.switches;
+}
+
+}	// namespace
+
+const SimStationApi SIM_API = {
+	SIM_NS::init,
+	SIM_NS::isr,
+	SIM_NS::loop,
+	SIM_NS::next_frame,
+	SIM_NS::backlog,
+	SIM_NS::stats
+};
@@ -0,0 +1,1457 @@
+//
+//  test_vm.cpp
+//
+//  Host checks for the LexerMicro VM. Exits non-zero on failure.
+//
+
+// Mirror LexerMicro.ino
+#define STATION_ID      (0)
+#define LEDS_PER_STRIP  (76)
+#define LED_COUNT       (LEDS_PER_STRIP * 3)
+
+#include <float.h>
+
+#include "attract.h"
+#include "computer.h"
+#include "frame.h"
+#include "wire_encode.h"
+#include "ring.h"
+
+#define FRAME_MILLIS    (16)
+#define FUSED_TOLERANCE (1e-5f)
+#define OP_SAMPLES      (20000)
+
+int drawingMemory[LEDS_PER_STRIP * 6];
+OctoWS2811 leds(LEDS_PER_STRIP, NULL, drawingMemory, WS2811_RBG | WS2811_800kHz);
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		failures++; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+void send_line(const char * line) {
+	computer_input_from_usb('1');	// lifespan
+	while (*line) {
+		computer_input_from_usb(*line);
+		line++;
+	}
+	computer_input_from_usb('\n');
+}
+
+// Lines are step bodies ("+X_,T_"), numbered from '!'
+void load_steps(const char * const * lines, uint8_t count) {
+	char buf[MAX_LINE_LEN];
+
+	send_line("c!");
+	for (uint8_t i = 0; i < count; i++) {
+		snprintf(buf, sizeof(buf), "s%c%s", '!' + i, lines[i]);
+		send_line(buf);
+	}
+	snprintf(buf, sizeof(buf), "c%c", '!' + count);
+	send_line(buf);
+}
+
+bool has_run_code(uint8_t code) {
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		if (run_codes[s] == code) return true;
+	}
+	return false;
+}
+
+//
+//  Peephole fusion: same result as the unfused program
+//
+
+typedef struct {
+	const char * name;
+	uint8_t code;	// fused op we expect to see
+	const char * steps[8];
+	uint8_t count;
+} FusionCase;
+
+// a = X + T, b = Y + T: per LED and per frame, so the steps
+// stay in the LED loop. The last step stores the result with
+// accum0, so every LED's value can be compared.
+const FusionCase FUSION_CASES[] = {
+	{"madd", OP_MADD,
+		{"+X_,T_", "+Y_,T_", "*v!,v\"", "+v#,A_", "0v$"}, 5},
+	{"madd (product second)", OP_MADD,
+		{"+X_,T_", "+Y_,T_", "*v!,v\"", "+A_,v#", "0v$"}, 5},
+	{"fracmadd", OP_FRACMADD,
+		{"+X_,T_", "+Y_,T_", "*v!,v\"", "+v#,A_", ".v$", "0v%"}, 6},
+	{"rfrac", OP_RFRAC,
+		{"+X_,T_", ".v!", "-1,v\"", "0v#"}, 4},
+	{"rfracmadd", OP_RFRACMADD,
+		{"+X_,T_", "+Y_,T_", "*v!,v\"", "+v#,A_", ".v$", "-1,v%", "0v&"}, 7},
+	{"hsvsinq", OP_HSVSINQ,
+		{"+X_,T_", "qv!", "]v!,1,v\"", "0v!"}, 4},
+};
+
+void run_case(const FusionCase * fc, bool fuse, Num * accumOut, std::vector<uint32_t> * pixelsOut) {
+	fusion_enabled = fuse;
+	load_steps(fc->steps, fc->count);
+	reset_time_and_accumulators();
+	leds.drawing.assign(leds.drawing.size(), 0);
+
+	for (uint8_t i = 0; i < 3; i++) {
+		computer_run(FRAME_MILLIS);
+	}
+
+	memcpy(accumOut, accum[0], sizeof(accum[0]));
+	*pixelsOut = leds.drawing;
+}
+
+void test_fusion() {
+	static Num plain[LED_COUNT];
+	static Num fused[LED_COUNT];
+	std::vector<uint32_t> plainPixels;
+	std::vector<uint32_t> fusedPixels;
+
+	set_station_id(6);
+
+	for (const FusionCase & fc : FUSION_CASES) {
+		run_case(&fc, false, plain, &plainPixels);
+		CHECK(!has_run_code(fc.code), "%s: fused with fusion disabled", fc.name);
+
+		run_case(&fc, true, fused, &fusedPixels);
+		CHECK(has_run_code(fc.code), "%s: not fused", fc.name);
+
+		float worst = 0.0f;
+		for (uint16_t i = 0; i < led_count; i++) {
+			worst = max(worst, (float)fabs(num_float(fused[i] - plain[i])));
+		}
+		CHECK(worst <= FUSED_TOLERANCE, "%s: off by %g", fc.name, worst);
+		CHECK(fusedPixels == plainPixels, "%s: pixels differ", fc.name);
+	}
+
+	// A product read by two steps must stay a separate step
+	const char * const shared[] = {"+X_,T_", "*v!,v!", "+v\",1", "+v\",v#", "0v$"};
+	fusion_enabled = true;
+	load_steps(shared, 5);
+	computer_run(FRAME_MILLIS);
+	CHECK(!has_run_code(OP_MADD), "shared product was fused");
+}
+
+//
+//  LED cache: LED-invariant steps run once per plan
+//
+
+void test_led_cache() {
+	set_station_id(6);
+
+	// Geometry only: Cached, and read from the cache per LED
+	const char * const invariant[] = {"*X_,2", "+v!,T_", "0v\""};
+	load_steps(invariant, 3);
+	reset_time_and_accumulators();
+	computer_run(FRAME_MILLIS);
+	CHECK(step_cache[0] >= 0, "invariant step not cached");
+	CHECK(step_cache[1] < 0, "step reading T cached");
+
+	// A step only read through a forward reference still runs per
+	// LED: Step 0 sees step 1 for the previous LED
+	const char * const forward[] = {"+v\",0", "*X_,2", "0v!"};
+	load_steps(forward, 3);
+	reset_time_and_accumulators();
+	computer_run(FRAME_MILLIS);
+	bool previous = true;
+	for (uint16_t i = 1; i < led_count; i++) {
+		if (accum[0][i] != led_vars[k_layout_x][i - 1] * 2.0f) previous = false;
+	}
+	CHECK(previous, "forward reference read a stale value");
+}
+
+//
+//  Lane engine: same pixels as the LED-major order
+//
+
+void run_attract(uint8_t mode, bool lanes, Num * accumOut, std::vector<uint32_t> * pixelsOut) {
+	lanes_enabled = lanes;
+	randomSeed(1);
+	for (const char * str = ATTRACT_MODES[mode]; *str; str++) {
+		computer_input_from_usb(*str);
+	}
+	reset_time_and_accumulators();
+	leds.drawing.assign(leds.drawing.size(), 0);
+
+	for (uint8_t i = 0; i < 10; i++) {
+		computer_run(FRAME_MILLIS);
+	}
+
+	memcpy(accumOut, accum[0], sizeof(accum[0]));
+	*pixelsOut = leds.drawing;
+}
+
+void test_lanes() {
+	static Num plain[LED_COUNT];
+	static Num laned[LED_COUNT];
+	std::vector<uint32_t> plainPixels;
+	std::vector<uint32_t> lanedPixels;
+
+	fusion_enabled = true;
+
+	for (uint8_t station = 0; station < STATION_COUNT; station++) {
+		set_station_id(station);
+
+		for (uint8_t mode = 0; mode < ATTRACT_MODES_LEN; mode++) {
+			run_attract(mode, false, plain, &plainPixels);
+			run_attract(mode, true, laned, &lanedPixels);
+
+			CHECK(memcmp(plain, laned, sizeof(plain)) == 0, "station %u, mode %u: accum differs", station, mode);
+			CHECK(lanedPixels == plainPixels, "station %u, mode %u: pixels differ", station, mode);
+		}
+	}
+
+	if (!LANE_ENGINE) return;
+
+	// Reading a later step sees the previous LED's value
+	const char * const backward[] = {"+X_,v\"", "*v!,0.5", "0v\""};
+	load_steps(backward, 3);
+	computer_run(FRAME_MILLIS);
+	CHECK(!lanes_ok, "back-reference ran in lanes");
+
+	const char * const forward[] = {"+X_,T_", "*v!,0.5", "0v\""};
+	load_steps(forward, 3);
+	computer_run(FRAME_MILLIS);
+	CHECK(lanes_ok, "plain program did not run in lanes");
+}
+
+//
+//  Kernel accuracy: Num kernels against libm, in double.
+//  For FIXED_POINT, these are the bounds listed in fixed.h.
+//
+
+typedef struct {
+	const char * name;
+	Num (*kernel)(Num a, Num b);
+	double (*ref)(double a, double b);
+	double lo[2];	// range of a and b
+	double hi[2];
+	double bound;	// |error| / max(1, |ref|)
+} OpAccuracy;
+
+const OpAccuracy OP_ACCURACY[] = {
+	{"multiply", [](Num a, Num b) { return _multiply(a, b); }, [](double a, double b) { return a * b; }, {-100, -100}, {100, 100}, 2e-5},
+	{"divide", [](Num a, Num b) { return _divide(a, b); }, [](double a, double b) { return a / b; }, {-100, 0.5}, {100, 100}, 2e-5},
+	{"mod", [](Num a, Num b) { return _mod(a, b); }, [](double a, double b) { return a - floor(a / b) * b; }, {-100, 0.5}, {100, 10}, 2e-5},
+	{"frac", [](Num a, Num b) { return _frac(a); }, [](double a, double b) { return a - floor(a); }, {-100, 0}, {100, 0}, 1e-7},
+	{"round", [](Num a, Num b) { return _round(a); }, [](double a, double b) { return round(a); }, {-100, 0}, {100, 0}, 1e-7},
+	{"sin", [](Num a, Num b) { return _sin(a); }, [](double a, double b) { return sin(a); }, {-100, 0}, {100, 0}, 5e-5},
+	{"cos", [](Num a, Num b) { return _cos(a); }, [](double a, double b) { return cos(a); }, {-100, 0}, {100, 0}, 5e-5},
+	{"sin01", [](Num a, Num b) { return _sin01(a); }, [](double a, double b) { return (sin(a * M_PI * 2.0) + 1.0) * 0.5; }, {-10, 0}, {10, 0}, 3e-5},
+	{"cos01", [](Num a, Num b) { return _cos01(a); }, [](double a, double b) { return (cos(a * M_PI * 2.0) + 1.0) * 0.5; }, {-10, 0}, {10, 0}, 3e-5},
+	{"tan", [](Num a, Num b) { return _tan(a); }, [](double a, double b) { return tan(a); }, {-1.4, 0}, {1.4, 0}, 2e-4},
+	{"atan2", [](Num a, Num b) { return _atan2(a, b); }, [](double a, double b) { return atan2(a, b); }, {-100, -100}, {100, 100}, 4e-5},
+	{"log", [](Num a, Num b) { return _log(a); }, [](double a, double b) { return log(a); }, {0.01, 0}, {1000, 0}, 4e-5},
+	{"sqrt", [](Num a, Num b) { return _sqrt(a); }, [](double a, double b) { return sqrt(a); }, {0, 0}, {1000, 0}, 2e-5},
+	{"pow", [](Num a, Num b) { return _pow(a, b); }, [](double a, double b) { return pow(a, b); }, {0.1, -3}, {10, 3}, 2e-4},
+	{"logBase", [](Num a, Num b) { return _logBase(a, b); }, [](double a, double b) { return log(a) / log(b); }, {0.1, 2}, {100, 10}, 2e-4},
+};
+
+// Exact value of a Num
+double num_double(float a) { return a; }
+double num_double(Fixed a) { return a.raw * (1.0 / FIXED_ONE); }
+
+// Deterministic samples, independent of random()
+double sample(uint32_t * state, double lo, double hi) {
+	*state = (*state * 1664525u) + 1013904223u;
+	return lo + (hi - lo) * ((*state >> 8) * (1.0 / (1 << 24)));
+}
+
+void test_op_accuracy() {
+	for (const OpAccuracy & op : OP_ACCURACY) {
+		uint32_t state = 1;
+		double worst = 0.0;
+
+		for (uint32_t i = 0; i < OP_SAMPLES; i++) {
+			// Error of the kernel alone: the reference gets the same (rounded) inputs
+			Num a = sample(&state, op.lo[0], op.hi[0]);
+			Num b = sample(&state, op.lo[1], op.hi[1]);
+			double ref = op.ref(num_double(a), num_double(b));
+			double err = fabs(num_double(op.kernel(a, b)) - ref) / max(1.0, fabs(ref));
+
+			worst = max(worst, err);
+		}
+
+		CHECK(worst <= op.bound, "%s: off by %g, bound is %g", op.name, worst, op.bound);
+	}
+
+	// Float sqrt over the whole exponent range, odd and even
+	// exponents (the ops above only cover 0..1000)
+	double worst = 0.0;
+	for (int e = -125; e <= 125; e++) {
+		for (uint8_t k = 0; k < 64; k++) {
+			float a = ldexpf(1.0f + k / 64.0f + k / 8192.0f, e);
+			worst = max(worst, fabs(math_sqrt(a) / sqrt((double)a) - 1.0));
+		}
+	}
+	CHECK(worst <= 2e-5, "float sqrt: off by %g, bound is 2e-05", worst);
+	CHECK((math_sqrt(0.0f) == 0.0f) && (math_sqrt(-1.0f) != math_sqrt(-1.0f)), "float sqrt: 0 or negative");
+
+#if FIXED_POINT
+	// Out of range conversions saturate
+	CHECK((Num(1e6f).raw == INT32_MAX) && (Num(-1e6f).raw == INT32_MIN) && (Num(NAN).raw == 0), "fixed: float conversion doesn't saturate");
+#endif
+}
+
+// hsv: each channel within 1 level of the exact color
+void test_hsv_accuracy() {
+	uint32_t state = 1;
+	uint8_t worst = 0;
+
+	set_gamma_and_brightness(false, 0xff);
+
+	for (uint32_t i = 0; i < OP_SAMPLES; i++) {
+		Num h = sample(&state, -4, 4);
+		Num s = sample(&state, 0, 1);
+		Num v = sample(&state, 0, 1);
+
+		computeLED = 0;
+		_hsv(h, s, v);
+		uint32_t px = leds.getPixel(led_strip[0]);
+
+		// Same formula as _hsv(), in double
+		double hd = num_double(h) - floor(num_double(h));
+		double h6 = hd * 6.0;
+		double ramp = h6 - floor(h6);
+		double vd = num_double(v) * 0xff;
+		double pd = num_double(v) * (1.0 - num_double(s)) * 0xff;
+		double rise = pd + (vd - pd) * ramp;
+		double fall = vd + (pd - vd) * ramp;
+		const double rgb[6][3] = {
+			{vd, rise, pd}, {fall, vd, pd}, {pd, vd, rise},
+			{pd, fall, vd}, {rise, pd, vd}, {vd, pd, fall}
+		};
+		const double * want = rgb[min((int)h6, 5)];
+
+		for (uint8_t c = 0; c < 3; c++) {
+			uint8_t got = (px >> (16 - c * 8)) & 0xff;
+			worst = max(worst, (uint8_t)abs(got - (int)want[c]));
+		}
+	}
+
+	set_gamma_and_brightness(DEFAULT_GAMMA, DEFAULT_BRIGHT);
+	CHECK(worst <= 1, "hsv: off by %u levels", worst);
+}
+
+//
+//  Noise: noise[] holds the octave sum it was built from, and
+//  every lookup is 0..1
+//
+
+#define NOISE_TOLERANCE (1e-4)
+
+void test_noise() {
+#if !NOISE_HASH
+	double _min = NOISE_OCTAVE_MAX;
+	double _max = 0.0;
+
+	for (uint8_t i = 0; i < NOISE_SIZE; i++) {
+		for (uint8_t j = 0; j < NOISE_SIZE; j++) {
+			for (uint8_t k = 0; k < NOISE_SIZE; k++) {
+				double v = num_double(noise_octaves<3>(i, j, k));
+				_min = min(_min, v);
+				_max = max(_max, v);
+			}
+		}
+	}
+
+	// Each octave is rounded down to a cell unit, then the sum is stretched
+	double bound = 8.0 / NOISE_CELL_MAX + NOISE_TOLERANCE;
+	double worst = 0.0;
+
+	for (uint8_t i = 0; i < NOISE_SIZE; i++) {
+		for (uint8_t j = 0; j < NOISE_SIZE; j++) {
+			for (uint8_t k = 0; k < NOISE_SIZE; k++) {
+				double want = (num_double(noise_octaves<3>(i, j, k)) - _min) / (_max - _min);
+				worst = max(worst, fabs(num_double(noise_at(i, j, k)) - want));
+			}
+		}
+	}
+
+	CHECK(worst <= bound, "noise[]: off by %g, bound is %g", worst, bound);
+#endif
+
+	uint32_t state = 1;
+	uint32_t outside = 0;
+	double worstDims = 0.0;
+
+	for (uint32_t i = 0; i < OP_SAMPLES; i++) {
+		Num x = sample(&state, -4, 4);
+		Num y = sample(&state, -4, 4);
+		Num z = sample(&state, -4, 4);
+
+		Num got[6] = {
+			_noise1(x), _noise2(x, y), _noise3(x, y, z),
+			_noise1q(x), _noise2q(x, y), _noise3q(x, y, z)
+		};
+
+		for (Num v : got) {
+			if ((num_double(v) < -NOISE_TOLERANCE) || (num_double(v) > 1.0 + NOISE_TOLERANCE)) outside++;
+		}
+
+		// noise1 and noise2 are slices of noise3
+		worstDims = max(worstDims, fabs(num_double(_noise1(x)) - num_double(_noise3(x, 0.0f, 0.0f))));
+		worstDims = max(worstDims, fabs(num_double(_noise2(x, y)) - num_double(_noise3(x, y, 0.0f))));
+	}
+
+	CHECK(outside == 0, "noise: %u lookups outside 0..1", outside);
+	CHECK(worstDims <= NOISE_TOLERANCE, "noise1/2: off from noise3 by %g", worstDims);
+}
+
+//
+//  Layouts: The compile-time tables match the runtime decoder
+//
+
+void test_layout() {
+	static uint16_t strip[LAYOUT_MAX_LEDS];
+	static Num vars[k_layout_var_count][LAYOUT_MAX_LEDS];
+
+	for (uint8_t id = 0; id < STATION_COUNT; id++) {
+		// volatile: Make sure this really runs at runtime
+		volatile uint8_t runtimeId = id;
+		LedList list = {0, strip, {vars[0], vars[1], vars[2], vars[3], vars[4], vars[5], vars[6]}};
+		led_layout_set_all(runtimeId, &list);
+
+		const StationLayout * layout = &STATION_LAYOUTS[id];
+		uint16_t n = list.count;
+
+		CHECK(layout->count == n, "station %u: %u LEDs, decoder has %u", id, layout->count, n);
+		if (layout->count != n) continue;
+
+		CHECK(memcmp(layout->strip, strip, n * sizeof(uint16_t)) == 0, "station %u: strip indices differ", id);
+
+		for (uint8_t v = 0; v < k_layout_var_count; v++) {
+			CHECK(memcmp(layout->vars[v], vars[v], n * sizeof(Num)) == 0, "station %u: var %u differs", id, v);
+		}
+
+		for (uint16_t i = 1; i < n; i++) {
+			CHECK(strip[i - 1] < strip[i], "station %u: strip indices out of order", id);
+		}
+	}
+
+	// The VM reads them: GR into accum0
+	const char * const globalRadius[] = {"+GR,0", "0v!"};
+	set_station_id(3);
+	load_steps(globalRadius, 2);
+	reset_time_and_accumulators();
+	computer_run(FRAME_MILLIS);
+	CHECK(memcmp(accum[0], led_vars[k_layout_global_radius], led_count * sizeof(Num)) == 0, "GR: accum0 differs");
+
+	// The constexpr helpers track libm over the sign
+	double worstLayout = 0.0;
+	for (int gy = -12; gy <= 12; gy++) {
+		for (int gx = -70; gx <= 70; gx++) {
+			double dy = gy * 0.75, dx = gx * 0.75;
+			worstLayout = fmax(worstLayout, fabs(layout_atan2(dy, dx) - atan2(dy, dx)));
+			worstLayout = fmax(worstLayout, fabs(layout_sqrt(dx * dx + dy * dy) - sqrt(dx * dx + dy * dy)));
+		}
+	}
+	CHECK(worstLayout < 1e-12, "layout_atan2/sqrt: off from libm by %g", worstLayout);
+
+	// Global X runs left to right across the letters
+	CHECK(STATION_LAYOUTS[0].vars[k_layout_global_x][0] < STATION_LAYOUTS[7].vars[k_layout_global_x][0], "GX: T is right of P");
+}
+
+//
+//  Frame scheduler: Steady swaps, animation time in whole periods
+//
+
+void test_frame_scheduler() {
+	FrameScheduler fs;
+	uint32_t start = 0xfffff000;	// Check that micros() can wrap
+	frame_init(&fs, 60, start);
+
+	uint32_t now = start;
+	uint32_t animMillis = 0;
+
+	// Two seconds, drawing takes 5 ms. Poll every 100 us, like loop().
+	for (uint32_t t = 0; t < 2000000; t += 100) {
+		now = start + t;
+		if (!frame_due(&fs, now)) continue;
+
+		animMillis += frame_swap(&fs, now);
+		frame_drawn(&fs, now + 5000);
+	}
+
+	CHECK(fs.frames == 120, "frame scheduler: %u frames in 2 s", fs.frames);
+	CHECK((fs.dropped == 0) && (fs.over_budget == 0), "frame scheduler: dropped %u, over budget %u", fs.dropped, fs.over_budget);
+	CHECK(fabs(fs.fps - 60.0f) < 0.1f, "frame scheduler: measured %g fps", fs.fps);
+	CHECK(fs.draw_max == 5000, "frame scheduler: draw max %u us", fs.draw_max);
+
+	// Animation time tracks the ticks: 120 frames of 16666 us
+	CHECK(animMillis == 1999, "frame scheduler: %u ms of animation", animMillis);
+
+	// A frame 2.5 periods late: Skip 2 swaps, stay on the tick
+	uint32_t due = fs.due;
+	now = due + fs.period * 5 / 2;
+	CHECK(frame_due(&fs, now), "frame scheduler: late frame not due");
+	uint32_t elapsed = frame_swap(&fs, now);
+	frame_drawn(&fs, now + fs.budget + 1);
+
+	CHECK(fs.dropped == 2, "frame scheduler: dropped %u, expected 2", fs.dropped);
+	CHECK(fs.due == due + fs.period * 3, "frame scheduler: next swap off the tick");
+	CHECK((elapsed >= 49) && (elapsed <= 50), "frame scheduler: late frame advanced %u ms", elapsed);
+	CHECK(fs.over_budget == 1, "frame scheduler: over budget %u, expected 1", fs.over_budget);
+
+	// A 100 s stall (a debugger, a long EEPROM format): All of it
+	// goes to the animation, more than a uint16_t holds
+	now = fs.due + 100000000;
+	elapsed = frame_swap(&fs, now);
+	CHECK((elapsed >= 99999) && (elapsed <= 100017), "frame scheduler: 100 s stall advanced %u ms", elapsed);
+}
+
+//
+//  Program slots: Steps go live only on a commit, with a good checksum
+//
+
+// Commit checksum, as the editor computes it: FNV-1a over the FNV-1a
+// of each 's' line (without lifespan and newline), little-endian
+uint32_t fnv_bytes(uint32_t h, const uint8_t * p, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+uint32_t program_checksum(const char * const * lines, uint8_t count) {
+	uint32_t h = 2166136261u;
+	for (uint8_t i = 0; i < count; i++) {
+		uint32_t lh = fnv_bytes(2166136261u, (const uint8_t *)lines[i], strlen(lines[i]));
+		uint8_t le[4] = {(uint8_t)lh, (uint8_t)(lh >> 8), (uint8_t)(lh >> 16), (uint8_t)(lh >> 24)};
+		h = fnv_bytes(h, le, 4);
+	}
+	return h;
+}
+
+void test_program_slots() {
+	static const char * const before[] = {"+X_,T_", "0v!"};
+	load_steps(before, 2);
+	computer_run(FRAME_MILLIS);
+
+	// Upload, no commit yet: Frames still run the old program
+	static const char * const lines[] = {"s!*X_,Y_", "s\"+v!,1", "s#0v\""};
+	for (uint8_t i = 0; i < 3; i++) {
+		send_line(lines[i]);
+	}
+	computer_run(FRAME_MILLIS);
+	CHECK((program->step_count == 2) && (program->op_codes[0] == '+'), "program slots: upload went live before commit");
+
+	// Bad checksum: Keep the old program
+	char commit[16];
+	uint32_t checksum = program_checksum(lines, 3);
+	uint16_t errors = telemetry.line_errors;
+	snprintf(commit, sizeof(commit), "c$%08x", checksum ^ 1);
+	send_line(commit);
+	CHECK(program->step_count == 2, "program slots: committed with a bad checksum");
+	CHECK(telemetry.line_errors == errors + 1, "program slots: bad checksum not counted");
+
+	// Good checksum: Swap
+	snprintf(commit, sizeof(commit), "c$%08x", checksum);
+	send_line(commit);
+	reset_time_and_accumulators();
+	computer_run(FRAME_MILLIS);
+	CHECK((program->step_count == 3) && (program->op_codes[0] == '*'), "program slots: good checksum not committed");
+	CHECK(accum[0][0] == led_vars[k_layout_x][0] * led_vars[k_layout_y][0] + 1.0f, "program slots: new program not run");
+
+	// A repeated 'c' keeps the live program: The upload slot holds
+	// the one before it
+	errors = telemetry.line_errors;
+	send_line("c#");
+	CHECK((program->step_count == 3) && (program->op_codes[0] == '*'), "program slots: repeated commit swapped in the old program");
+	CHECK(telemetry.line_errors == errors, "program slots: repeated commit counted as an error");
+
+	// A station that missed a line has a different checksum
+	send_line(lines[0]);
+	send_line(lines[2]);
+	send_line(commit);
+	CHECK(program->op_codes[1] == '+', "program slots: committed with a missing line");
+}
+
+//
+//  Binary frames: Same program as the text lines
+//
+
+void send_raw(const std::string & line) {
+	for (char c : line) {
+		computer_input_from_usb((uint8_t)c);
+	}
+}
+
+uint32_t attract_pixels(uint8_t mode, const std::vector<std::string> * binary) {
+	set_station_id(mode);
+	randomSeed(4242);
+
+	if (binary) {
+		for (const std::string & line : *binary) send_raw(line);
+	} else {
+		send_raw(ATTRACT_MODES[mode]);
+	}
+
+	reset_time_and_accumulators();
+	leds.drawing.assign(leds.drawing.size(), 0);
+	for (uint8_t i = 0; i < 3; i++) {
+		computer_run(FRAME_MILLIS);
+	}
+
+	uint32_t h = 2166136261u;
+	for (uint32_t px : leds.drawing) {
+		h = (h ^ px) * 16777619u;
+	}
+	return h;
+}
+
+void test_wire() {
+	for (uint8_t mode = 0; mode < ATTRACT_MODES_LEN; mode++) {
+		uint32_t text = attract_pixels(mode, NULL);
+		std::vector<std::string> lines = encode_program(program, '1');
+
+		// Clear the upload slot, so the frames must carry it all
+		memset(upload, 0, sizeof(Program));
+		uint16_t errors = telemetry.line_errors;
+		uint32_t binary = attract_pixels(mode, &lines);
+
+		CHECK(telemetry.line_errors == errors, "wire: mode %u: frame rejected", mode);
+		CHECK(binary == text, "wire: mode %u: pixels differ from the text program", mode);
+	}
+	set_station_id(STATION_ID);
+
+	// Negative and full float constants: Text lines can't say these
+	Program prog;
+	prog.step_count = 2;
+	prog.op_codes[0] = '+';
+	prog.args[0][0].type = k_array_of_floats;
+	prog.args[0][0].fp = led_vars[k_layout_x];
+	prog.args[0][1].type = k_float;
+	prog.args[0][1].f = -0.5f;
+	prog.args[0][2].type = k_float;
+	prog.args[0][2].f = 0.0f;
+	prog.op_codes[1] = '*';
+	prog.args[1][0].type = k_float_ptr;
+	prog.args[1][0].fp = &values[0];
+	prog.args[1][1].type = k_float;
+	prog.args[1][1].f = 0.1f;
+	prog.args[1][2].type = k_float;
+	prog.args[1][2].f = 0.0f;
+
+	std::vector<std::string> lines = encode_program(&prog, '1');
+	CHECK(lines.size() == 2, "wire: %zu lines, expected one frame and a commit", lines.size());
+	for (const std::string & line : lines) send_raw(line);
+	CHECK(program->args[0][1].f == Num(-0.5f), "wire: half float constant");
+	CHECK(program->args[1][1].f == Num(0.1f), "wire: full float constant");
+	CHECK(program->args[1][0].fp == &values[0], "wire: step reference");
+
+#if FIXED_POINT
+	// More bits than a float holds: Raw Q16.16, exact
+	prog.args[1][1].f = Fixed::from_raw(1000 * FIXED_ONE + 7);
+	lines = encode_program(&prog, '1');
+	for (const std::string & line : lines) send_raw(line);
+	CHECK(program->args[1][1].f == prog.args[1][1].f, "wire: Q16.16 constant came back as %d", program->args[1][1].f.raw);
+#endif
+
+	// A bad CRC: Rejected, nothing committed
+	std::string bad = encode_program(&prog, '1')[0];
+	bad[3] ^= 0x01;
+	uint16_t errors = telemetry.line_errors;
+	upload->op_codes[0] = '-';
+	send_raw(bad);
+	CHECK(telemetry.line_errors == errors + 1, "wire: bad CRC not counted");
+	CHECK(upload->op_codes[0] == '-', "wire: bad frame decoded");
+}
+
+//
+//  Program store: Programs in EEPROM, and a playlist
+//
+
+// The live program's step hashes, as sim_station.cpp reports them
+uint32_t live_checksum() {
+	uint32_t h = FNV1A_START;
+	for (uint8_t s = 0; s < program->step_count; s++) {
+		uint32_t lh = program->step_hashes[s];
+		uint8_t le[4] = {(uint8_t)lh, (uint8_t)(lh >> 8), (uint8_t)(lh >> 16), (uint8_t)(lh >> 24)};
+		h = fnv1a(h, le, 4);
+	}
+	return h;
+}
+
+void test_program_store() {
+	static const char * const other[] = {"+X_,T_", "0v!"};
+	uint32_t loaded[STORE_SLOTS];
+
+	EEPROM.erase();
+	CHECK(!store_boot() && store_valid(), "store: new EEPROM not formatted");
+
+	// Save each attract program, then recall it over something else:
+	// Same pixels as the text program
+	for (uint8_t mode = 0; mode < ATTRACT_MODES_LEN; mode++) {
+		uint8_t slot = mode % STORE_SLOTS;
+		uint32_t text = attract_pixels(mode, NULL);
+		CHECK(store_save(slot), "store: mode %u didn't fit", mode);
+
+		load_steps(other, 2);
+		set_gamma_and_brightness(!gamma_on, brightness / 2);
+
+		std::vector<std::string> recall = {std::string("1r") + (char)('0' + slot) + "\n"};
+		uint16_t errors = telemetry.line_errors;
+		uint32_t stored = attract_pixels(mode, &recall);
+		CHECK(telemetry.line_errors == errors, "store: mode %u: recall failed", mode);
+		CHECK(stored == text, "store: mode %u: pixels differ from the text program", mode);
+		loaded[slot] = live_checksum();
+	}
+	set_station_id(STATION_ID);
+
+	// Saving it again only writes the slot's empty mark and count
+	uint32_t writes = EEPROM.writes;
+	CHECK(store_save(3), "store: second save failed");
+	CHECK(EEPROM.writes == writes + 2, "store: %u bytes written for the same program", EEPROM.writes - writes);
+
+	// Playlist: 5 s each, on the synced clock. Survives a reboot.
+	send_line("l00050123");
+	memset(&playlist, 0, sizeof(playlist));
+	CHECK(store_boot() && (playlist.count == 4) && (playlist.seconds == 5), "store: playlist not kept");
+
+	time_sync_reset(&time_sync, micros());
+	computer_run(FRAME_MILLIS);
+	CHECK(live_checksum() == loaded[0], "store: playlist didn't start with slot 0");
+
+	time_sync.millis = 5000 * 6;
+	computer_run(FRAME_MILLIS);
+	CHECK(live_checksum() == loaded[2], "store: playlist not at slot 2 after 30 s");
+
+	// A recall pauses it
+	send_line("r1");
+	time_sync.millis = 5000 * 7;
+	computer_run(FRAME_MILLIS);
+	CHECK(live_checksum() == loaded[1], "store: playlist ran over a recall");
+
+	// An upload pauses it too, from its first frame: A rollover
+	// between the frames doesn't load a slot over them
+	static Program up;
+	memset(&up, 0, sizeof(up));
+	up.step_count = MAX_STEPS;
+	for (uint8_t s = 0; s < MAX_STEPS; s++) {
+		up.op_codes[s] = '+';
+		up.args[s][0].type = k_float;
+		up.args[s][0].f = 0.1f * s;
+	}
+	std::vector<std::string> frames = encode_program(&up, '1');
+
+	send_line("l00050123");
+	time_sync.millis = 5000 * 8;
+	computer_run(FRAME_MILLIS);
+	CHECK(live_checksum() == loaded[0], "store: playlist didn't resume at slot 0");
+
+	send_raw(frames[0]);
+	time_sync.millis = 5000 * 9;
+	computer_run(FRAME_MILLIS);
+	CHECK(live_checksum() == loaded[0], "store: playlist loaded over an upload");
+
+	for (size_t i = 1; i < frames.size(); i++) send_raw(frames[i]);
+	CHECK((program->step_count == MAX_STEPS) && (live_checksum() == commit_checksum), "store: upload lost to the playlist");
+
+	send_line("r1");
+
+	// Damaged, empty or missing slots: Rejected, nothing loaded
+	EEPROM.data[store_slot_addr(3) + STORE_SLOT_HEADER + 6] ^= 0x01;
+	uint16_t errors = telemetry.line_errors;
+	send_line("r3");
+	send_line("r7");
+	send_line("l0005019");
+	CHECK(telemetry.line_errors == errors + 3, "store: %u line errors, expected 3", telemetry.line_errors - errors);
+	CHECK(live_checksum() == loaded[1], "store: damaged slot loaded");
+
+	// Decoded, then the checksum is wrong: Nothing for a plain 'c'
+	// to commit
+	EEPROM.data[store_slot_addr(0) + 3] ^= 0x01;
+	CHECK(!store_load(0) && !upload_written, "store: bad checksum left the steps to commit");
+	char commit[4] = {'c', (char)('!' + EEPROM.data[store_slot_addr(0)]), 0};
+	send_line(commit);
+	CHECK(live_checksum() == loaded[1], "store: plain 'c' committed a bad slot");
+	EEPROM.data[store_slot_addr(0) + 3] ^= 0x01;
+
+	// Too big for a slot: Every step needs full floats
+	Program * live = program;
+	live->step_count = MAX_STEPS;
+	for (uint8_t s = 0; s < MAX_STEPS; s++) {
+		live->op_codes[s] = '+';
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			live->args[s][a].type = k_float;
+			live->args[s][a].f = 0.1f;
+		}
+	}
+	CHECK(!store_save(2) && !store_load(2), "store: oversized program saved");
+
+	EEPROM.erase();
+	memset(&playlist, 0, sizeof(playlist));
+	load_steps(other, 2);
+	set_gamma_and_brightness(DEFAULT_GAMMA, DEFAULT_BRIGHT);
+	reset_time_and_accumulators();
+}
+
+//
+//  Program cache: 'a' switches back to a recent upload
+//
+
+void test_program_cache() {
+	const uint8_t uploads = CACHE_PROGRAMS + 1;
+	uint32_t text[uploads];
+	uint32_t hashes[uploads];
+	bool gamma[uploads];
+	uint8_t bright[uploads];
+	char line[16];
+
+	memset(program_cache, 0, sizeof(program_cache));
+	cache_clock = 0;
+	uint16_t hits = telemetry.cache_hits;
+	uint16_t misses = telemetry.cache_misses;
+
+	// Upload the first CACHE_PROGRAMS attract programs as frames,
+	// with their checksums
+	for (uint8_t mode = 0; mode < CACHE_PROGRAMS; mode++) {
+		text[mode] = attract_pixels(mode, NULL);
+		gamma[mode] = gamma_on;
+		bright[mode] = brightness;
+		std::vector<std::string> frames = encode_program(program, '1');
+		attract_pixels(mode, &frames);
+		hashes[mode] = commit_checksum;
+	}
+
+	// Back to each, newest first: Same pixels, no upload. (Gamma
+	// isn't part of the program: The attract strings set it.)
+	for (int8_t mode = CACHE_PROGRAMS - 1; mode >= 0; mode--) {
+		snprintf(line, sizeof(line), "1a%08x\n", hashes[mode]);
+		std::vector<std::string> activate = {line};
+		set_gamma_and_brightness(gamma[mode], bright[mode]);
+		uint32_t cached = attract_pixels(mode, &activate);
+		CHECK(cached == text[mode], "cache: mode %d: pixels differ from the text program", mode);
+	}
+	CHECK(telemetry.cache_hits == hits + CACHE_PROGRAMS, "cache: %u hits, expected %u", telemetry.cache_hits - hits, CACHE_PROGRAMS);
+
+	// One more upload replaces the least recent: The last one
+	// activated above was mode 0, so that's CACHE_PROGRAMS - 1
+	uint8_t mode = CACHE_PROGRAMS;
+	text[mode] = attract_pixels(mode, NULL);
+	std::vector<std::string> frames = encode_program(program, '1');
+	attract_pixels(mode, &frames);
+	hashes[mode] = commit_checksum;
+
+	uint32_t live = live_checksum();
+	uint16_t errors = telemetry.line_errors;
+	snprintf(line, sizeof(line), "a%08x", hashes[CACHE_PROGRAMS - 1]);
+	send_line(line);
+	CHECK(telemetry.cache_misses == misses + 1, "cache: evicted program still cached");
+	CHECK(live_checksum() == live, "cache: a miss changed the program");
+
+	snprintf(line, sizeof(line), "a%08x", hashes[0]);
+	send_line(line);
+	CHECK(telemetry.cache_hits == hits + CACHE_PROGRAMS + 1, "cache: mode 0 not cached");
+
+	// Entries take what they need from the pool. A program as big
+	// as they come pushes out all but the most recent (mode 4, the
+	// smallest), and still fits.
+	snprintf(line, sizeof(line), "a%08x", hashes[CACHE_PROGRAMS]);
+	send_line(line);
+	Program * big = program;
+	uint8_t savedCount = big->step_count;
+	big->step_count = MAX_STEPS;
+	for (uint8_t s = 0; s < MAX_STEPS; s++) {
+		big->op_codes[s] = '+';
+		for (uint8_t a = 0; a < ARG_COUNT; a++) {
+			big->args[s][a].type = k_float;
+			big->args[s][a].f = 0.1f;
+		}
+	}
+	CHECK(cache_pool_used() < CACHE_POOL_SIZE / 2, "cache: %u bytes for %u attract programs", cache_pool_used(), CACHE_PROGRAMS);
+	cache_insert(0x12345678);
+	CacheEntry * entry = cache_find(0x12345678);
+	CHECK(entry && (entry->len == MAX_STEPS * FRAME_STEP_MAX), "cache: big program not cached");
+	CHECK(cache_pool_used() <= CACHE_POOL_SIZE, "cache: %u bytes in the pool", cache_pool_used());
+	big->step_count = savedCount;
+
+	// Mode 4 was moved down, over the evicted ones: Still decodes
+	CacheEntry * left = cache_find(hashes[CACHE_PROGRAMS]);
+	CHECK(left && (cache_pool_used() == left->len + entry->len), "cache: mode 4 not kept alone");
+	CHECK(cache_activate(hashes[CACHE_PROGRAMS]) && (live_checksum() == hashes[CACHE_PROGRAMS]), "cache: mode 4 damaged by the eviction");
+
+	// Too few digits: A bad line, not a miss
+	send_line("a1234");
+	CHECK(telemetry.line_errors == errors + 1, "cache: short 'a' line not rejected");
+	CHECK(telemetry.cache_misses == misses + 1, "cache: short 'a' line counted as a miss");
+
+	set_station_id(STATION_ID);
+	memset(program_cache, 0, sizeof(program_cache));
+	set_gamma_and_brightness(DEFAULT_GAMMA, DEFAULT_BRIGHT);
+	reset_time_and_accumulators();
+}
+
+//
+//  Telemetry: 'q' reports a fixed-size record over USB
+//
+
+uint32_t read32(const uint8_t * p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void test_telemetry() {
+	static const char * const steps[] = {"+X_,T_", "*@!,Y_"};
+	load_steps(steps, 2);
+
+	for (uint8_t i = 0; i < 3; i++) {
+		computer_run(FRAME_MILLIS);
+	}
+
+	uint16_t errors = telemetry.line_errors;
+	send_line("Z");	// Not a data type
+
+	Serial.tx.clear();
+	send_line("q");
+
+	const std::vector<uint8_t> & rec = Serial.tx;
+	CHECK(rec.size() == TELEMETRY_SIZE, "telemetry: %zu bytes, expected %d", rec.size(), TELEMETRY_SIZE);
+	if (rec.size() != TELEMETRY_SIZE) return;
+
+	uint8_t sum = 0;
+	for (uint8_t i = 2; i < TELEMETRY_SIZE - 1; i++) {
+		sum += rec[i];
+	}
+
+	CHECK((rec[0] == TELEMETRY_MAGIC0) && (rec[1] == TELEMETRY_MAGIC1), "telemetry: bad magic");
+	CHECK(rec[TELEMETRY_SIZE - 1] == sum, "telemetry: bad checksum");
+	CHECK(rec[2] == station_id, "telemetry: station %u", rec[2]);
+	CHECK(rec[3] == 2, "telemetry: %u steps, expected 2", rec[3]);
+
+	uint32_t runMin = read32(&rec[8]);
+	uint32_t runMax = read32(&rec[12]);
+	uint32_t runAvg = read32(&rec[16]);
+	CHECK((runMin <= runAvg) && (runAvg <= runMax), "telemetry: run min %u avg %u max %u", runMin, runAvg, runMax);
+	CHECK(read32(&rec[26]) == telemetry.bytes_received, "telemetry: bytes received");
+	CHECK((rec[38] | (rec[39] << 8)) == errors + 1, "telemetry: line errors %u, expected %u", rec[38] | (rec[39] << 8), errors + 1);
+	CHECK(read32(&rec[40]) >= 3, "telemetry: %u frames", read32(&rec[40]));
+	CHECK(read32(&rec[44]) == telemetry.usb_overflows, "telemetry: usb overflows");
+	CHECK((rec[52] | (rec[53] << 8)) == telemetry.backlog_max, "telemetry: backlog max");
+	CHECK(read32(&rec[54]) == link_baud(&link_rate), "telemetry: ring baud %u", read32(&rec[54]));
+	CHECK((rec[62] | (rec[63] << 8)) == telemetry.cache_hits, "telemetry: cache hits");
+	CHECK((rec[64] | (rec[65] << 8)) == telemetry.cache_misses, "telemetry: cache misses");
+
+	// Run stats start over after a report
+	CHECK(telemetry.run_frames == 0, "telemetry: run stats not reset");
+	Serial.tx.clear();
+}
+
+//
+//  Profiler: 'p' reports cycles per step (PROFILE_STEPS only)
+//
+
+void test_profile() {
+	static const char * const steps[] = {"+X_,T_", "S@!,_", "*@\",Y_"};
+	load_steps(steps, 3);
+
+	for (uint8_t i = 0; i < 4; i++) {
+		computer_run(FRAME_MILLIS);
+	}
+
+	Serial.tx.clear();
+	uint16_t errors = telemetry.line_errors;
+	send_line("p");
+	CHECK(telemetry.line_errors == errors, "profile: 'p' is a line error");
+
+	const std::vector<uint8_t> & rec = Serial.tx;
+
+#if PROFILE_STEPS
+	uint8_t count = 3;
+	size_t size = 9 + 4 * count;
+	CHECK(rec.size() == size, "profile: %zu bytes, expected %zu", rec.size(), size);
+	if (rec.size() != size) return;
+
+	uint8_t sum = 0;
+	for (size_t i = 2; i < size - 1; i++) {
+		sum += rec[i];
+	}
+
+	CHECK((rec[0] == TELEMETRY_MAGIC0) && (rec[1] == PROFILE_MAGIC1), "profile: bad magic");
+	CHECK(rec[size - 1] == sum, "profile: bad checksum");
+	CHECK(rec[3] == count, "profile: %u steps, expected %u", rec[3], count);
+	CHECK(read32(&rec[4]) == 4, "profile: %u frames, expected 4", read32(&rec[4]));
+
+	// Each step runs for every LED, so each costs something
+	for (uint8_t s = 0; s < count; s++) {
+		CHECK(read32(&rec[8 + s * 4]) > 0, "profile: step %u costs nothing", s);
+	}
+
+	CHECK(profile_frames == 0, "profile: not reset");
+#else
+	// Compiled out: No record
+	CHECK(rec.empty(), "profile: %zu bytes without PROFILE_STEPS", rec.size());
+#endif
+
+	Serial.tx.clear();
+}
+
+//
+//  Ring forwarding: Cut-through, lifespan decremented on the fly
+//
+
+std::string drain(std::vector<uint8_t> * tx) {
+	std::string s(tx->begin(), tx->end());
+	tx->clear();
+	return s;
+}
+
+void feed(HostSerial * port, const std::string & bytes) {
+	port->rx.insert(port->rx.end(), bytes.begin(), bytes.end());
+}
+
+void test_ring() {
+	static Ring ring;
+	HostSerial usb, upstream, out;
+	ring_init(&ring);
+
+	// Lifespans go down by one. '0' lines, and lines without a
+	// lifespan, stop here.
+	feed(&usb, "3cX\n");
+	feed(&upstream, "2t\n0q\nxyz\n");
+	ring_pump(&ring, usb, upstream, out);
+	std::string sent = drain(&out.tx);
+	CHECK(sent == "2cX\n1t\n", "ring: forwarded '%s'", sent.c_str());
+	CHECK(ring.forwarded == 7, "ring: %u bytes forwarded", ring.forwarded);
+
+	// Every byte still reaches this station
+	uint8_t b;
+	std::string local;
+	while (queue_pop(&ring.local[k_port_upstream], &b)) local += (char)b;
+	CHECK(local == "2t\n0q\nxyz\n", "ring: local copy '%s'", local.c_str());
+
+	// Half a line goes out at once. The other port waits for its newline.
+	feed(&usb, "4ab");
+	feed(&upstream, "5cd\n");
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent == "3ab", "ring: partial line '%s'", sent.c_str());
+	CHECK(upstream.rx.size() == 4, "ring: upstream line interleaved");
+
+	feed(&usb, "\n");
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent == "\n4cd\n", "ring: after the newline '%s'", sent.c_str());
+
+	// A runaway line is cut off with a newline, one byte too long
+	// for the next parser, and lets go of the link
+	feed(&usb, "1" + std::string(RING_MAX_LINE + 10, 'a'));
+	feed(&upstream, "2t\n");
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent.size() == RING_MAX_LINE + 5, "ring: runaway line sent %zu bytes", sent.size());
+	CHECK(sent.substr(RING_MAX_LINE) == "a\n1t\n", "ring: line after a runaway line '%s'", sent.substr(RING_MAX_LINE).c_str());
+
+	uint32_t dropped = telemetry.bytes_dropped;
+	for (size_t i = 0; i < RING_MAX_LINE + 2; i++) {
+		computer_input_from_upstream(sent[i]);
+	}
+	CHECK(telemetry.bytes_dropped == dropped + RING_MAX_LINE + 2, "ring: cut line not dropped downstream");
+
+	// A line that stops halfway (the host died mid-write) is ended
+	// after RING_OWNER_TIMEOUT quiet passes, here and downstream.
+	// Then the other port's line goes.
+	ring_init(&ring);
+	feed(&usb, "3cX");
+	feed(&upstream, "2t\n");
+	for (uint8_t i = 0; i < RING_OWNER_TIMEOUT - 1; i++) {
+		ring_pump(&ring, usb, upstream, out);
+	}
+	sent = drain(&out.tx);
+	CHECK((sent == "2cX") && (ring.owner == k_port_usb), "ring: quiet line ended early, sent '%s'", sent.c_str());
+
+	ring_pump(&ring, usb, upstream, out);
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent == "\n1t\n", "ring: after a quiet line '%s'", sent.c_str());
+
+	local.clear();
+	while (queue_pop(&ring.local[k_port_usb], &b)) local += (char)b;
+	CHECK(local == "3cX\n", "ring: quiet line ended locally as '%s'", local.c_str());
+
+	// The rest of it, late: Stops here
+	feed(&usb, "Y\n");
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent.empty(), "ring: rest of a quiet line forwarded '%s'", sent.c_str());
+
+	// Downstream transmit buffer full: Bytes wait in the port
+	ring_init(&ring);
+	out.tx_depth = 4;
+	feed(&usb, "3abcdef\n");
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK((sent == "2abc") && (usb.rx.size() == 4), "ring: wrote '%s' to a full buffer", sent.c_str());
+
+	ring_pump(&ring, usb, upstream, out);
+	sent = drain(&out.tx);
+	CHECK(sent == "def\n", "ring: after the buffer drained '%s'", sent.c_str());
+	out.tx_depth = INT_MAX;
+
+	// Full queue: Bytes wait in the port, so USB flow control holds
+	// the host back. Counted.
+	ring_init(&ring);
+	feed(&upstream, "1" + std::string(RING_QUEUE_SIZE + 9, 'a'));
+	ring_pump(&ring, usb, upstream, out);
+	CHECK(upstream.rx.size() == 10, "ring: %zu bytes left in the port, expected 10", upstream.rx.size());
+	CHECK(ring.local[k_port_upstream].overflows == 1, "ring: %u overflows, expected 1", ring.local[k_port_upstream].overflows);
+
+	// Parse budget: The minimum even when out of time, the maximum
+	// when there's time to spare. The rest waits in the queue.
+	ByteQueue * q = &ring.local[k_port_upstream];
+	uint16_t parsed = 0;
+	auto count = [&](uint8_t) { parsed++; };
+
+	uint16_t n = queue_drain(q, count, micros() - 1);
+	CHECK((n == PARSE_MIN_BYTES) && (parsed == n), "ring: %u bytes parsed late, expected %d", n, PARSE_MIN_BYTES);
+	CHECK(q->backlog_max == RING_QUEUE_SIZE, "ring: backlog max %u", q->backlog_max);
+
+	n = queue_drain(q, count, micros() + 1000000);
+	CHECK(n == PARSE_MAX_BYTES, "ring: %u bytes parsed, expected %d", n, PARSE_MAX_BYTES);
+	CHECK(queue_count(q) == RING_QUEUE_SIZE - PARSE_MIN_BYTES - PARSE_MAX_BYTES, "ring: %u bytes left", queue_count(q));
+
+	// Room again: The rest comes in
+	ring_pump(&ring, usb, upstream, out);
+	CHECK(upstream.rx.empty(), "ring: %zu bytes stuck in the port", upstream.rx.size());
+	drain(&out.tx);
+
+	// Lines that stop here don't jam the parser's line buffer
+	Serial.tx.clear();
+	for (uint8_t i = 0; i < 20; i++) {
+		const char * line = "0q\n";
+		while (*line) computer_input_from_usb(*line++);
+	}
+	CHECK(Serial.tx.size() == 20 * TELEMETRY_SIZE, "ring: %zu telemetry bytes for 20 '0q' lines", Serial.tx.size());
+	Serial.tx.clear();
+}
+
+//
+//  Time sync: A ring of stations with skewed clocks stays in step
+//
+
+#define SIM_DAYS         (2)
+#define SIM_WARMUP       (30000000)	// micros, before errors count
+#define SIM_MAX_ERROR    (3)	// millis, between any station and station 0
+
+// One station: Its own crystal, frame scheduler and TimeSync. Times
+// are true micros (int64_t), or the station's micros() (uint32_t).
+typedef struct {
+	double rate;	// Local micros per true micro
+	int64_t boot;
+	uint32_t start;	// micros() at boot
+	FrameScheduler fs;
+	TimeSync ts;
+	Num vtime;	// What programs read
+	int64_t next;	// Next swap
+	bool sync_waiting;	// A 'y' line arrived, not parsed yet
+	int64_t sync_arrival;
+	uint32_t sync_ref;
+} SimStation;
+
+uint32_t sim_micros(const SimStation * st, int64_t t) {
+	return st->start + (uint32_t)(int64_t)((t - st->boot) * st->rate);
+}
+
+// True time of the station's next swap
+int64_t sim_next_swap(const SimStation * st, int64_t t) {
+	int32_t wait = (int32_t)(st->fs.due - sim_micros(st, t));
+	return t + (int64_t)ceil(wait / st->rate) + 1;
+}
+
+void test_time_sync_ring() {
+	static const double ppm[STATION_COUNT] = {20, -80, 60, -30, 100, -50, 10, -100};
+	SimStation ring[STATION_COUNT];
+	uint32_t rng = 1;
+
+	for (uint8_t k = 0; k < STATION_COUNT; k++) {
+		SimStation * st = &ring[k];
+		memset(st, 0, sizeof(SimStation));
+		st->rate = 1.0 + ppm[k] * 1e-6;
+		st->boot = k * 700000;	// Booted at different times
+		st->start = 0xf0000000 + k * 12345;	// micros() wraps within the hour
+		frame_init(&st->fs, FRAME_TARGET_FPS, st->start);
+		time_sync_init(&st->ts, st->start);
+		st->next = st->boot;
+	}
+
+	const int64_t end = (int64_t)SIM_DAYS * 86400 * 1000000;
+	uint32_t syncDue = 0;
+	int32_t maxError = 0;
+	int32_t maxVtimeError = 0;
+	int64_t t = 0;
+
+	while (t < end) {
+		uint8_t k = 0;
+		for (uint8_t i = 1; i < STATION_COUNT; i++) {
+			if (ring[i].next < ring[k].next) k = i;
+		}
+
+		SimStation * st = &ring[k];
+		t = st->next;
+		uint32_t now = sim_micros(st, t);
+
+		// Parsed between frames
+		if (st->sync_waiting && (st->sync_arrival <= t)) {
+			time_sync_receive(&st->ts, st->sync_ref, k, SERIAL_BYTE_MICROS, sim_micros(st, st->sync_arrival), now);
+			st->sync_waiting = false;
+		}
+
+		vtime_advance(&st->ts, &st->vtime, frame_swap(&st->fs, now), now);
+		frame_drawn(&st->fs, now + 5000);
+		st->next = sim_next_swap(st, t);
+
+		if ((k == 0) && ((int32_t)(time_sync_now(&st->ts, now) - syncDue) >= 0)) {
+			syncDue = time_sync_now(&st->ts, now) + SYNC_INTERVAL_MILLIS;
+
+			// The line, then each hop: a byte, and 0..250 us for the pump
+			int64_t arrival = t + (SYNC_LINE_LEN - 1) * SERIAL_BYTE_MICROS;
+			for (uint8_t d = 1; d < STATION_COUNT; d++) {
+				rng = rng * 1103515245 + 12345;
+				arrival += SERIAL_BYTE_MICROS + (rng >> 16) % 251;
+
+				ring[d].sync_waiting = true;
+				ring[d].sync_arrival = arrival;
+				ring[d].sync_ref = time_sync_now(&st->ts, now);
+			}
+		}
+
+		if ((k != 0) && (t > SIM_WARMUP)) {
+			int32_t error = (int32_t)(time_sync_now(&st->ts, now) - time_sync_now(&ring[0].ts, sim_micros(&ring[0], t)));
+			maxError = max(maxError, abs(error));
+
+			// vTime too, in millis: Against station 0's synced clock
+			uint32_t ref = time_sync_now(&ring[0].ts, sim_micros(&ring[0], t));
+#if FIXED_POINT
+			// Across the wrap
+			ref &= VTIME_WRAP_MILLIS - 1;
+			int32_t vtError = (int32_t)lround(num_double(st->vtime) * 1000.0) - (int32_t)ref;
+			if (vtError > (int32_t)VTIME_WRAP_MILLIS / 2) vtError -= VTIME_WRAP_MILLIS;
+			if (vtError < -(int32_t)VTIME_WRAP_MILLIS / 2) vtError += VTIME_WRAP_MILLIS;
+#else
+			// Less the float's rounding, which grows with vTime
+			int32_t vtError = (int32_t)lround(num_double(st->vtime) * 1000.0) - (int32_t)ref;
+			vtError = max(0, abs(vtError) - (int32_t)ceil(ref * FLT_EPSILON));
+#endif
+			maxVtimeError = max(maxVtimeError, abs(vtError));
+		}
+	}
+
+	CHECK(maxError <= SIM_MAX_ERROR, "time sync: %d ms apart after %d days, expected <= %d", maxError, SIM_DAYS, SIM_MAX_ERROR);
+	CHECK(maxVtimeError <= SIM_MAX_ERROR + 1, "time sync: vTime %d ms apart after %d days, expected <= %d", maxVtimeError, SIM_DAYS, SIM_MAX_ERROR + 1);
+
+	for (uint8_t k = 1; k < STATION_COUNT; k++) {
+		// Jumps once, when the first sync arrives. Slews after that.
+		CHECK(ring[k].ts.jumps == 1, "time sync: station %u jumped %u times", k, ring[k].ts.jumps);
+		CHECK(ring[k].ts.syncs >= SIM_DAYS * 86000, "time sync: station %u got %u syncs", k, ring[k].ts.syncs);
+	}
+}
+
+// The 'y' line, through the ring pump and parser
+void test_time_sync_line() {
+	static Ring ring;
+	HostSerial usb, upstream, out;
+	ring_init(&ring);
+
+	// Station 0's line: lifespan, 'y', its time in hex
+	char line[SYNC_LINE_LEN + 1] = {0};
+	sync_line(line, micros());
+	char expected[SYNC_LINE_LEN + 1];
+	snprintf(expected, sizeof(expected), "%cy%08x\n", '0' + STATION_COUNT - 2, time_sync_now(&time_sync, micros()));
+	CHECK(strcmp(line, expected) == 0, "time sync: line '%s', expected '%s'", line, expected);
+
+	// Two hops down: 10 s, plus the line and the hops
+	set_station_id(2);
+	uint32_t syncs = time_sync.syncs;
+
+	feed(&usb, "5y00002710\n");
+	ring_pump(&ring, usb, upstream, out);
+	queue_drain(&ring.local[k_port_usb], computer_input_from_usb, micros() + 1000000);
+
+	uint32_t target = 10000 + time_sync_delay(2, SERIAL_BYTE_MICROS) / 1000;
+	uint32_t synced = time_sync_now(&time_sync, micros());
+	CHECK(time_sync.syncs == syncs + 1, "time sync: 'y' line not applied");
+	CHECK((synced >= target) && (synced <= target + 2), "time sync: %u ms, expected %u", synced, target);
+	CHECK(fabs(num_float(vTime) - time_sync.millis / 1000.0f) < 0.001f, "time sync: vTime %g, expected %g", num_float(vTime), time_sync.millis / 1000.0f);
+
+	uint32_t saved = time_sync.millis;
+#if FIXED_POINT
+	// Three wraps and an hour in: vTime has wrapped to an hour. When
+	// millis rolls over, it wraps just the same.
+	time_sync.millis = 3 * VTIME_WRAP_MILLIS + 3601500;
+	set_vtime_from_millis();
+	CHECK(fabs(num_float(vTime) - 3601.5f) < 0.001f, "time sync: vTime %g after three wraps, expected 3601.5", num_float(vTime));
+	CHECK(vtime_from_millis(0xffffffff) == vtime_from_millis(VTIME_WRAP_MILLIS - 1), "time sync: millis rollover isn't a wrap");
+#else
+	// Two days in: A float doesn't need to wrap
+	time_sync.millis = 49 * 60 * 60 * 1000 + 1500;
+	set_vtime_from_millis();
+	CHECK(fabs(num_float(vTime) - 176401.5f) < 0.001f, "time sync: vTime %g after two days, expected 176401.5", num_float(vTime));
+#endif
+	time_sync.millis = saved;
+	set_vtime_from_millis();
+
+	// Arrival unknown (not through the queue): Ignored
+	const char * direct = "5y00004e20\n";
+	while (*direct) computer_input_from_usb(*direct++);
+	CHECK(time_sync.syncs == syncs + 1, "time sync: line without an arrival time applied");
+
+	// Station 0 is the reference
+	set_station_id(STATION_ID);
+	feed(&usb, "5y00004e20\n");
+	ring_pump(&ring, usb, upstream, out);
+	queue_drain(&ring.local[k_port_usb], computer_input_from_usb, micros() + 1000000);
+	CHECK(time_sync.syncs == syncs + 1, "time sync: station 0 synced");
+
+	reset_time_and_accumulators();
+}
+
+// Ring baud rate: Station 0 and one other station, stepping
+// together, then the lines through the parser
+void test_link_rate() {
+	LinkRate m, o;	// Station 0, and another
+	uint32_t t = 1000;	// millis. Synced time is the same, here.
+	link_init(&m, t);
+	link_init(&o, t);
+
+	CHECK(link_update(&m, true, t, t) == k_link_send_none, "link: started before LINK_START_MILLIS");
+	t += LINK_START_MILLIS;
+	link_update(&m, true, t, t);
+	CHECK(link_update(&m, true, t, t) == k_link_send_announce, "link: no announce");
+	CHECK(link_holding(&m), "link: station 0 not holding");
+	link_sent(&m, k_link_send_announce, t);
+	link_announced(&o, m.next, m.switch_at, m.final, t);
+	CHECK(m.switch_at == t + LINK_LEAD_MILLIS, "link: switch at %u", m.switch_at);
+
+	// Switch, probe, commit
+	t += LINK_LEAD_MILLIS;
+	link_update(&m, true, t, t);
+	link_update(&o, false, t, t);
+	CHECK((m.step == 1) && (o.step == 1), "link: steps %u, %u after the switch", m.step, o.step);
+	CHECK(link_update(&m, true, t, t) == k_link_send_none, "link: probed inside the guard time");
+
+	t += LINK_GUARD_MILLIS;
+	for (uint8_t i = 0; i < LINK_PROBES; i++) {
+		CHECK(link_update(&m, true, t, t) == k_link_send_probe, "link: probe %u not sent", i);
+		link_sent(&m, k_link_send_probe, t);
+		link_probe(&o, true, false, t);
+		link_probe(&m, true, true, t);
+	}
+	CHECK(link_update(&m, true, t, t) == k_link_send_none, "link: committed before LINK_DECIDE_MILLIS");
+
+	t = m.switch_at + LINK_DECIDE_MILLIS;
+	for (uint8_t i = 0; i < LINK_COMMITS; i++) {
+		CHECK(link_update(&m, true, t, t) == k_link_send_commit, "link: commit %u not sent", i);
+		link_sent(&m, k_link_send_commit, t);
+	}
+	link_committed(&o, 1, t);
+	CHECK(!link_holding(&m) && (o.state == k_link_steady), "link: still in the trial after the commit");
+
+	t += LINK_TRIAL_MILLIS;
+	link_update(&m, true, t, t);
+	link_update(&o, false, t, t);
+	CHECK((link_baud(&m) == 19200) && (link_baud(&o) == 19200), "link: %u, %u baud after the commit", link_baud(&m), link_baud(&o));
+
+	// Next step: No probes come back. Both go back, and station 0 stops there.
+	t += LINK_CLIMB_MILLIS;
+	link_update(&m, true, t, t);
+	link_update(&m, true, t, t);
+	link_sent(&m, k_link_send_announce, t);
+	link_announced(&o, m.next, m.switch_at, m.final, t);
+	t += LINK_LEAD_MILLIS;
+	link_update(&m, true, t, t);
+	link_update(&o, false, t, t);
+	CHECK((m.step == 2) && (o.step == 2), "link: trial steps %u, %u", m.step, o.step);
+
+	t += LINK_TRIAL_MILLIS;
+	link_update(&m, true, t, t);
+	link_update(&o, false, t, t);
+	CHECK((m.step == 1) && (o.step == 1), "link: steps %u, %u after a failed trial", m.step, o.step);
+	CHECK(m.cap == 1, "link: cap %u after a failed trial", m.cap);
+
+	// Health check: Probes lost, so the ring falls back to 9600
+	t += LINK_CHECK_MILLIS;
+	CHECK(link_update(&m, true, t, t) == k_link_send_none, "link: check without a probe");
+	for (uint8_t i = 0; i < LINK_CHECK_PROBES; i++) {
+		CHECK(link_update(&m, true, t, t) == k_link_send_probe, "link: check probe %u not sent", i);
+		link_sent(&m, k_link_send_probe, t);
+	}
+	t += LINK_DECIDE_MILLIS;
+	link_update(&m, true, t, t);
+	CHECK(link_update(&m, true, t, t) == k_link_send_announce, "link: no fallback announce");
+	CHECK(m.final && (m.next == 0) && (m.cap == 0), "link: fallback to step %u, cap %u", m.next, m.cap);
+
+	// A station that hears nothing falls back by itself
+	link_heard(&o, t);	// A sync line
+	link_update(&o, false, t, t);
+	CHECK(o.step == 1, "link: fell back too soon");
+	t += LINK_WATCHDOG_MILLIS + 1;
+	link_update(&o, false, t, t);
+	CHECK(o.step == 0, "link: no fallback without sync lines");
+
+	// The lines, through the parser
+	set_station_id(2);
+	link_init(&link_rate, millis());
+	uint16_t errors = telemetry.line_errors;
+	const char * announce = "5n2000003e8t\n";
+	while (*announce) computer_input_from_upstream(*announce++);
+	CHECK((link_rate.state == k_link_announced) && (link_rate.next == 2) && (link_rate.switch_at == 1000) && !link_rate.final,
+		"link: 'n' line not parsed");
+
+	// Station 0 builds the lines
+	LinkRate saved = link_rate;
+	link_rate.probes_sent = 5;
+	char line[LINK_LINE_MAX + 1] = {0};
+	uint8_t len = link_line(line, k_link_send_probe);
+	CHECK((len == LINK_LINE_MAX) && (line[0] == '0' + STATION_COUNT - 1) && (line[1] == 'v') && (line[2] == '5'),
+		"link: probe line '%s'", line);
+	CHECK(!strchr(line, '\n') || (strchr(line, '\n') == &line[len - 1]), "link: newline inside the probe");
+	link_rate = saved;
+
+	for (uint8_t i = 0; i < len; i++) computer_input_from_upstream(line[i]);
+	CHECK((link_rate.probes_ok == 1) && (link_rate.probes_bad == 0), "link: probe not received");
+
+	line[10] ^= 1;	// Garbled on the wire
+	for (uint8_t i = 0; i < len; i++) computer_input_from_upstream(line[i]);
+	CHECK(link_rate.probes_bad == 1, "link: garbled probe passed the CRC");
+	CHECK(telemetry.line_errors == errors + 1, "link: %u line errors", telemetry.line_errors - errors);
+
+	set_station_id(STATION_ID);
+	link_init(&link_rate, millis());
+}
+
+int main() {
+	computer_init(&leds);
+
+	test_layout();
+	test_fusion();
+	test_led_cache();
+	test_lanes();
+	test_op_accuracy();
+	test_hsv_accuracy();
+	test_noise();
+	test_frame_scheduler();
+	test_program_slots();
+	test_wire();
+	test_program_store();
+	test_program_cache();
+	test_telemetry();
+	test_ring();
+	test_time_sync_ring();
+	test_time_sync_line();
+	test_link_rate();
+	test_profile();
+
+	if (failures) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,80 @@
+//
+//  wire_encode.h
+//
+//  Host-side encoder for binary program frames ('B' lines, see
+//  serial_read_frame() in computer.h), so bench.cpp and test_vm.cpp
+//  can compare them against the text lines. Steps are encoded by
+//  frame_write_step(), which the program store uses too. The
+//  editor's encoder is encodeFrames() in html/src/index.js.
+//
+
+#ifndef WIRE_ENCODE_H
+#define WIRE_ENCODE_H
+
+#include <string>
+#include <vector>
+
+// Step s: op, kinds, operands (see frame_write_step())
+std::vector<uint8_t> encode_step(const Program * prog, uint8_t s) {
+	uint8_t out[FRAME_STEP_MAX];
+	uint8_t len = frame_write_step(prog, s, out);
+	return std::vector<uint8_t>(out, out + len);
+}
+
+// Whole line: lifespan, 'B', escaped frame, newline
+std::string frame_line(char lifespan, uint8_t first, const std::vector<std::vector<uint8_t>> & steps) {
+	std::vector<uint8_t> frame = {FRAME_VERSION, first, (uint8_t)steps.size()};
+	for (const auto & step : steps) {
+		frame.insert(frame.end(), step.begin(), step.end());
+	}
+
+	uint16_t crc = crc16(frame.data(), frame.size());
+	frame.push_back(crc >> 8);
+	frame.push_back(crc & 0xff);
+
+	std::string line = {lifespan, 'B'};
+	for (uint8_t b : frame) {
+		if ((b == '\n') || (b == FRAME_ESC)) {
+			line += (char)FRAME_ESC;
+			b ^= FRAME_ESC_XOR;
+		}
+		line += (char)b;
+	}
+	return line + '\n';
+}
+
+// Frames holding as many steps as fit in MAX_LINE_LEN, then the
+// commit line, with its checksum
+std::vector<std::string> encode_program(const Program * prog, char lifespan) {
+	std::vector<std::string> lines;
+	std::vector<std::vector<uint8_t>> pending;
+	uint8_t first = 0;
+	uint32_t checksum = FNV1A_START;
+
+	for (uint8_t s = 0; s < prog->step_count; s++) {
+		std::vector<uint8_t> step = encode_step(prog, s);
+
+		uint32_t h = fnv1a(FNV1A_START, step.data(), step.size());
+		uint8_t le[4] = {(uint8_t)h, (uint8_t)(h >> 8), (uint8_t)(h >> 16), (uint8_t)(h >> 24)};
+		checksum = fnv1a(checksum, le, 4);
+
+		pending.push_back(step);
+		if (frame_line(lifespan, first, pending).size() > MAX_LINE_LEN) {
+			pending.pop_back();
+			lines.push_back(frame_line(lifespan, first, pending));
+			first = s;
+			pending = {step};
+		}
+	}
+
+	if (!pending.empty()) {
+		lines.push_back(frame_line(lifespan, first, pending));
+	}
+
+	char commit[16];
+	snprintf(commit, sizeof(commit), "%cc%c%08x\n", lifespan, '!' + prog->step_count, checksum);
+	lines.push_back(commit);
+	return lines;
+}
+
+#endif
@@ -784,11 +784,14 @@ const SPECIAL_VARS = {
 	"I": "index of LED on strand",
 	"C": "number of LEDs on strand",
 	"P": "ratio of LED on strand (==I/C)",
-	"X": "global X position",
-	"Y": "global Y position",
-	"A": "global angle (from center of sign)"
-	//"LX": "X position within the letter",
-	//"LA": "local angle (from center of letter)",
+	"X": "X position within the letter",
+	"Y": "Y position",
+	"A": "angle from center of letter",
+	"LR": "distance from center of letter (1 == top edge)",
+	"GX": "global X position (0..1 across the sign)",
+	"GY": "global Y position (same as Y)",
+	"GA": "global angle (from center of sign)",
+	"GR": "distance from center of sign (1 == left edge)"
 	//"IN": "true if inside letter (hole)",
 	//"OT": "true if outside letter (outer edge)",
 };
@@ -803,6 +806,10 @@ var varNames = {};
 
 var client = null;
 
+// Commit checksums of the programs the stations have cached, most
+// recent first (from server.js). These go live with an 'a' line.
+var residentPrograms = [];
+
 String.prototype.hexEncode = function () {
 	var hex, i;
 
@@ -1143,7 +1150,7 @@ function parseInput(input) {
 
 	// Show the steps
 	var table = "<table>";
-	table += '<tr class="title"><td></td><td class="title_op">op</td><td colspan="3" class="title_args">args . . .</td></tr>';
+	table += '<tr class="title"><td></td><td class="title_op">op</td><td colspan="3" class="title_args">args . . .</td><td class="title_cost">cycles</td></tr>';
 
 	_.each(steps, function (step, i) {
 		table += '<tr><td class="step_name">step_' + i + '</td>';
@@ -1151,6 +1158,7 @@ function parseInput(input) {
 			var clss = step[key] === 0 ? "dim" : "";
 			table += '<td class="' + clss + '">' + step[key] + '</td>';
 		});
+		table += '<td class="step_cost" id="step_cost_' + i + '"></td>';
 		table += '</tr>';
 	});
 	table += "</table>";
@@ -1173,14 +1181,211 @@ function parseInput(input) {
 	sendToServer();
 }
 
+// FNV-1a of a string (char codes) or array of bytes
+function fnv1a(h, bytes) {
+	for (var i = 0; i < bytes.length; i++) {
+		var b = (typeof bytes === 'string') ? bytes.charCodeAt(i) : bytes[i];
+		h = Math.imul(h ^ b, 16777619) >>> 0;
+	}
+	return h;
+}
+
+var FNV1A_START = 2166136261;
+
+// Commit checksum (see upload_checksum() in computer.h): FNV-1a over
+// the FNV-1a of each 's' line (or binary step), little-endian.
+// 8 hex digits.
+function programChecksum(lines) {
+	var h = FNV1A_START;
+	_.each(lines, function (line) {
+		var lh = fnv1a(FNV1A_START, line);
+		h = fnv1a(h, [lh & 0xff, (lh >>> 8) & 0xff, (lh >>> 16) & 0xff, lh >>> 24]);
+	});
+	return ('0000000' + h.toString(16)).substr(-8);
+}
+
+//
+//  Binary program frames ('B' lines): See serial_read_frame() in
+//  computer.h. Several steps per line, so uploads are faster.
+//
+
+var FRAME_VERSION = 1;
+var FRAME_ESC = 0x1b;
+var FRAME_ESC_XOR = 0x20;
+var FRAME_FULL_FLOATS = 0x40;
+var MAX_LINE_LEN = 128;
+var FRAME_VARS = ['T_','S_','I_','C_','P_','X_','Y_','A_','LX','LY','LA','LR','GX','GY','GA','GR'];
+
+var OPERAND_ZERO = 0;
+var OPERAND_STEP = 1;
+var OPERAND_VAR = 2;
+var OPERAND_CONST = 3;
+
+function floatBits(v) {
+	var view = new DataView(new ArrayBuffer(4));
+	view.setFloat32(0, v);
+	return view.getUint32(0);
+}
+
+// Exact half float bits for v, or null
+function floatToHalf(v) {
+	var b = floatBits(v);
+	var sign = (b >>> 16) & 0x8000;
+	var e = ((b >>> 23) & 0xff) - 127;
+	var m = b & 0x7fffff;
+
+	if ((b & 0x7fffffff) === 0) return sign;
+	if ((e > 15) || (e < -24)) return null;
+
+	if (e >= -14) {
+		if (m & 0x1fff) return null;	// Needs more than 10 bits
+		return sign | ((e + 15) << 10) | (m >>> 13);
+	}
+
+	// Subnormal half
+	var full = m | 0x800000;
+	var shift = 13 + (-14 - e);
+	if (full & ((1 << shift) - 1)) return null;
+	return sign | (full >>> shift);
+}
+
+function crc16(bytes) {
+	var crc = 0xffff;
+	_.each(bytes, function (byte) {
+		crc ^= byte << 8;
+		for (var b = 0; b < 8; b++) {
+			crc = (crc & 0x8000) ? (((crc << 1) ^ 0x1021) & 0xffff) : ((crc << 1) & 0xffff);
+		}
+	});
+	return crc;
+}
+
+// Op, kinds, operands. Null (and barf()) for an arg it can't encode.
+function encodeStep(step) {
+	var keys = ['a','b','c'];
+
+	var fullFloats = _.some(keys, function (key) {
+		var thing = step[key];
+		return ((typeof thing) === 'number') && (floatToHalf(thing) === null);
+	});
+
+	var kinds = fullFloats ? FRAME_FULL_FLOATS : 0;
+	var operands = [];
+	var bad = false;
+
+	_.each(keys, function (key, a) {
+		var thing = step[key];
+		var kind = OPERAND_ZERO;
+
+		if (!thing) {
+			kind = OPERAND_ZERO;
+
+		} else if ((typeof thing) === 'number') {
+			kind = OPERAND_CONST;
+
+			if (fullFloats) {
+				var bits = floatBits(thing);
+				operands.push(bits & 0xff, (bits >>> 8) & 0xff, (bits >>> 16) & 0xff, bits >>> 24);
+			} else {
+				var half = floatToHalf(thing);
+				operands.push(half & 0xff, half >>> 8);
+			}
+
+		} else {
+			var stepMatch = thing.match(/step_(\d+)/);
+			var specialMatch = thing.match(/var_([A-Z][A-Z]?)/);
+
+			if (stepMatch) {
+				// varint
+				kind = OPERAND_STEP;
+				var n = parseInt(stepMatch[1]);
+				do {
+					operands.push((n & 0x7f) | ((n > 0x7f) ? 0x80 : 0));
+					n >>>= 7;
+				} while (n);
+
+			} else if (specialMatch && (FRAME_VARS.indexOf((specialMatch[1] + '_').substr(0, 2)) >= 0)) {
+				kind = OPERAND_VAR;
+				operands.push(FRAME_VARS.indexOf((specialMatch[1] + '_').substr(0, 2)));
+
+			} else {
+				barf(specialMatch ? "Invalid variable" : "Can't encode this arg", thing);
+				bad = true;
+			}
+		}
+
+		kinds |= kind << (a * 2);
+	});
+
+	if (bad) return null;
+
+	var op = step.op;
+	var code = (op.length == 1) ? op : opWithName(op)['code'];
+
+	return [code.charCodeAt(0), kinds].concat(operands);
+}
+
+// Whole line: lifespan, 'B', escaped frame, newline
+function frameLine(lifespan, first, stepBytes) {
+	var frame = [FRAME_VERSION, first, stepBytes.length].concat(_.flatten(stepBytes));
+	var crc = crc16(frame);
+	frame.push(crc >>> 8, crc & 0xff);
+
+	var line = [lifespan.charCodeAt(0), 'B'.charCodeAt(0)];
+	_.each(frame, function (b) {
+		if ((b === 0x0a) || (b === FRAME_ESC)) {
+			line.push(FRAME_ESC, b ^ FRAME_ESC_XOR);
+		} else {
+			line.push(b);
+		}
+	});
+	line.push(0x0a);
+
+	return new Uint8Array(line);
+}
+
+// Frames holding as many steps as fit in MAX_LINE_LEN, and the
+// commit line, with its checksum
+function encodeFrames(steps, lifespan) {
+	var lines = [];
+	var pending = [];
+	var first = 0;
+	var stepBytes = _.map(steps, encodeStep);
+	if (_.includes(stepBytes, null)) return null;
+
+	_.each(stepBytes, function (bytes, i) {
+		pending.push(bytes);
+
+		if (frameLine(lifespan, first, pending).length > MAX_LINE_LEN) {
+			pending.pop();
+			lines.push(frameLine(lifespan, first, pending));
+			first = i;
+			pending = [bytes];
+		}
+	});
+
+	if (pending.length) {
+		lines.push(frameLine(lifespan, first, pending));
+	}
+
+	var commit = "c" + String.fromCharCode(33 + steps.length) + programChecksum(stepBytes);
+	return {lines: lines, commit: commit};
+}
+
+function sendFrameToRing(bytes) {
+	var status = isClientOpen() ? "(open)" : "(closed)";
+	if (!isSendEnabledChecked()) status = "(send_disabled)";
+	console.log(status, bytes);
+
+	if (isClientAvailable()) {
+		client.send(bytes.buffer);
+	}
+}
+
 function sendToServer() {
 	// Temporarily skip expecution
 	var bytecodeAr = [];
 
-	var zeroSteps = "c!";
-	sendMessageToRing(zeroSteps);
-	bytecodeAr.push(zeroSteps);
-
 	for (var i = 0; i < steps.length; i++) {
 		var line = 's' + String.fromCharCode(33 + i);
 
@@ -1214,18 +1419,33 @@ function sendToServer() {
 
 		line += args.join(',');
 
-		sendMessageToRing(line);
 		bytecodeAr.push(line);
 	}
 
-	// Send the number of steps
-	var stepCount = "c" + String.fromCharCode(33 + steps.length);
-	sendMessageToRing(stepCount);
-	bytecodeAr.push(stepCount);
+	// Text lines, for the copy box (attract.h)
+	bytecodeAr.push("c" + String.fromCharCode(33 + steps.length) + programChecksum(bytecodeAr));
+
+	// Send binary frames. The commit swaps the stations to the new
+	// program together, if they got every frame (see
+	// serial_read_step_count() in computer.h). A program they have
+	// cached only needs its checksum (see cache_activate()). The
+	// server forgets the list when station 0 misses or restarts
+	// (see checkPrograms() in server.js), so then it goes in full.
+	var frames = encodeFrames(steps, "8");
+	if (!frames) return;
+
+	var checksum = frames.commit.substr(2);
+
+	if (_.includes(residentPrograms, checksum)) {
+		sendMessageToRing('a' + checksum);
+	} else {
+		_.each(frames.lines, sendFrameToRing);
+		sendMessageToRing(frames.commit);
+	}
 
 	// Inject gamma & brightness
 	var gammaInjection = getGammaBrightInstruction();
-	bytecodeAr.splice(1, 0, gammaInjection);
+	bytecodeAr.splice(0, 0, gammaInjection);
 
 	// Prepend each message with a lifespan byte.
 	// We're not going to overheal the entire communications
@@ -1288,6 +1508,28 @@ function blinkChange(event) {
 	sendMessageToRing(msg);
 }
 
+// Program store (see store_save() in computer.h). Each station saves
+// or recalls its own program.
+function storeSaveClick(event) {
+	sendMessageToRing('w' + $('#storeSlot').val());
+}
+
+function storeRecallClick(event) {
+	sendMessageToRing('r' + $('#storeSlot').val());
+}
+
+// 'l', seconds per slot (4 hex digits), then up to 8 slot digits
+function playlistPlayClick(event) {
+	var slots = $('#playlist').val().replace(/[^0-3]/g, '').substr(0, 8);
+	if (!slots.length) return;
+
+	var seconds = parseInt($('#playlistSeconds').val()) || 30;
+	seconds = Math.max(1, Math.min(0xffff, seconds));
+
+	var msg = 'l' + ('000' + seconds.toString(16)).substr(-4) + slots;
+	sendMessageToRing(msg);
+}
+
 function showConnectionStatus(b) {
 	$('#connectionStatus').text(b ? "Connected" : "Not connected").toggleClass("connected", b).toggleClass("notConnected", !b);
 }
@@ -1321,11 +1563,51 @@ function startSocket() {
 
 	client.onmessage = function (e) {
 		if (typeof e.data === 'string') {
-			console.log("Received: '" + e.data + "'");
+			var msg = null;
+			try {
+				msg = JSON.parse(e.data);
+			} catch (err) {}
+
+			if (msg && msg.telemetry) {
+				showTelemetry(msg.telemetry);
+			} else if (msg && msg.profile) {
+				showProfile(msg.profile);
+			} else if (msg && msg.cache) {
+				residentPrograms = msg.cache;
+
+				// The stations may not have what's showing: Upload it again
+				if (msg.reset) parseInput($('#input').val());
+			} else {
+				console.log("Received: '" + e.data + "'");
+			}
 		}
 	};
 }
 
+// Station stats, from server.js (see send_telemetry() in computer.h)
+function showTelemetry(t) {
+	var text = 'Station ' + t.stationID + ': ' + t.fps.toFixed(1) + ' fps, ' + t.stepCount + ' steps\n';
+	text += 'run ' + t.runLastMicros + ' us (min ' + t.runMinMicros + ', avg ' + t.runAvgMicros + ', max ' + t.runMaxMicros + '), show ' + t.showMicros + ' us\n';
+	text += 'bytes in ' + t.bytesReceived + ', forwarded ' + t.bytesForwarded + ', dropped ' + t.bytesDropped + ', line errors ' + t.lineErrors + '\n';
+	text += 'parse queue: full ' + t.usbOverflows + ' usb, ' + t.upstreamOverflows + ' upstream, backlog max ' + t.backlogMax + '\n';
+	text += 'ring: ' + t.ringBaud + ' baud, link probes ' + t.probesOK + ' ok, ' + t.probesBad + ' bad\n';
+	text += 'program cache: ' + t.cacheHits + ' hits, ' + t.cacheMisses + ' misses';
+
+	$('#telemetry').text(text);
+}
+
+// Cycles per frame for each step, from server.js (see send_profile()
+// in computer.h). Empty unless the station is built with PROFILE_STEPS.
+function showProfile(p) {
+	var total = _.sum(p.cyclesPerFrame);
+
+	$('.step_cost').text('');
+	_.each(p.cyclesPerFrame, function (cycles, i) {
+		var pct = total ? Math.round(cycles * 100 / total) : 0;
+		$('#step_cost_' + i).text(cycles + ' (' + pct + '%)');
+	});
+}
+
 function sendStationID() {
 	//sendMessageToRing("i");
 
@@ -1358,6 +1640,9 @@ $(document).ready(function () {
 	$('#bright').on('input', gammaBrightChange);
 	$('#blink').on('change', blinkChange);
 	$('#copyBytecode').on('click', copyBytecodeClick);
+	$('#storeSave').on('click', storeSaveClick);
+	$('#storeRecall').on('click', storeRecallClick);
+	$('#playlistPlay').on('click', playlistPlayClick);
 
 	startSocket();
 
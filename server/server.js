@@ -8,9 +8,31 @@ const fs = require("fs");
 const _ = require("lodash");
 
 // Arduino Uno: 19200 baud works, 57600 definitely does not.
+// (The Teensy's USB serial ignores it. The ring sets its own rate:
+// see linkrate.h.)
 const WEBSERVER_PORT = 8080;
 const BAUD_RATE = 9600;
 
+// Telemetry: Ask the station for stats ('q' line) and its step
+// profile ('p' line) this often. See send_telemetry() and
+// send_profile() in computer.h for the record layouts.
+const TELEMETRY_INTERVAL_MS = 1000;
+const TELEMETRY_QUERY = "0q\n0p\n";
+const RECORD_MAGIC = 0xff;
+const TELEMETRY_TYPE = 0x51;	// 'Q'
+const TELEMETRY_SIZE = 67;
+const PROFILE_TYPE = 0x50;	// 'P'
+const PROFILE_HEADER_SIZE = 8;
+
+// Program cache: The stations keep the last PROGRAM_CACHE_COUNT
+// programs committed with a checksum, and switch back to one for an
+// 'a' line (see cache_insert() in computer.h). This list follows the
+// same rules, from the lines going to the ring, so the editor knows
+// which programs it doesn't have to upload again.
+const PROGRAM_CACHE_COUNT = 4;	// CACHE_PROGRAMS
+let residentPrograms = [];	// Commit checksums, most recent first
+let lastTelemetry = null;
+
 // Try to auto-detect the device
 let dirs = fs.readdirSync("/dev/");
 let devices = [];
@@ -40,11 +62,14 @@ socket.on('open', function open(){
 });
 
 socket.on('connection', function connection(ws) {
+	ws.send(JSON.stringify({cache: residentPrograms}));
+
 	ws.on('message', function incoming(message) {
 		console.log(':::::', message);
 
 		if (port) {
 			port.write(message);
+			trackPrograms(message);
 		} else {
 			console.warn("PORT NOT OPEN, can't send");
 		}
@@ -86,9 +111,180 @@ port.on('error', function(err){
 	console.log("port general error:", err);
 });
 
-port.on('data', function (data) {
-  console.log('<<<<<', data.toString('ascii'));
-});
+//
+//  TELEMETRY
+//
+
+let portData = Buffer.alloc(0);
+
+// Whole record size, or 0 if more bytes are needed to tell
+function recordSize(buf) {
+	if (buf.length < 2) return 0;
+
+	switch (buf[1]) {
+		case TELEMETRY_TYPE: return TELEMETRY_SIZE;
+		case PROFILE_TYPE: return (buf.length < 4) ? 0 : (PROFILE_HEADER_SIZE + buf[3] * 4 + 1);
+	}
+	return -1;	// Not a record
+}
+
+function checksumOK(rec) {
+	let sum = 0;
+	for (let i = 2; i < rec.length - 1; i++) {
+		sum = (sum + rec[i]) & 0xff;
+	}
+	return sum === rec[rec.length - 1];
+}
+
+function decodeTelemetry(rec) {
+	return {
+		stationID: rec.readUInt8(2),
+		stepCount: rec.readUInt8(3),
+		runLastMicros: rec.readUInt32LE(4),
+		runMinMicros: rec.readUInt32LE(8),
+		runMaxMicros: rec.readUInt32LE(12),
+		runAvgMicros: rec.readUInt32LE(16),
+		showMicros: rec.readUInt32LE(20),
+		fps: rec.readUInt16LE(24) / 100,
+		bytesReceived: rec.readUInt32LE(26),
+		bytesForwarded: rec.readUInt32LE(30),
+		bytesDropped: rec.readUInt32LE(34),
+		lineErrors: rec.readUInt16LE(38),
+		frames: rec.readUInt32LE(40),
+		usbOverflows: rec.readUInt32LE(44),
+		upstreamOverflows: rec.readUInt32LE(48),
+		backlogMax: rec.readUInt16LE(52),
+		ringBaud: rec.readUInt32LE(54),
+		probesOK: rec.readUInt16LE(58),
+		probesBad: rec.readUInt16LE(60),
+		cacheHits: rec.readUInt16LE(62),
+		cacheMisses: rec.readUInt16LE(64)
+	};
+}
+
+function decodeProfile(rec) {
+	let cycles = [];
+	for (let i = 0; i < rec[3]; i++) {
+		cycles.push(rec.readUInt32LE(PROFILE_HEADER_SIZE + i * 4));
+	}
+
+	return {
+		stationID: rec.readUInt8(2),
+		frames: rec.readUInt32LE(4),
+		cyclesPerFrame: cycles	// By step number
+	};
+}
+
+function broadcast(obj) {
+	let msg = JSON.stringify(obj);
+
+	socket.clients.forEach(function each(ws) {
+		if (ws.readyState === WebSocket.OPEN) {
+			ws.send(msg);
+		}
+	});
+}
+
+//
+//  PROGRAM CACHE
+//
+
+function touchProgram(checksum) {
+	residentPrograms = [checksum].concat(_.without(residentPrograms, checksum)).slice(0, PROGRAM_CACHE_COUNT);
+}
+
+// Lines for the whole ring (lifespan '8'): Commits with a checksum
+// are cached, activations that hit move to the front
+function trackPrograms(message) {
+	let changed = false;
+
+	_.each(Buffer.from(message).toString('latin1').split('\n'), (line) => {
+		let commit = line.match(/^8c.([0-9a-f]{8})$/);
+		let activate = line.match(/^8a([0-9a-f]{8})$/);
+
+		if (commit) {
+			touchProgram(commit[1]);
+			changed = true;
+		} else if (activate && _.includes(residentPrograms, activate[1])) {
+			touchProgram(activate[1]);
+			changed = true;
+		}
+	});
+
+	if (changed) broadcast({cache: residentPrograms});
+}
+
+// A miss at station 0 (it lost its cache, or never got the upload),
+// or station 0 restarted: Forget them all, so the editor uploads in
+// full. The telemetry is station 0's: A letter further down that
+// misses keeps its old program, and counts it, until a full upload.
+function checkPrograms(t) {
+	let last = lastTelemetry;
+	lastTelemetry = t;
+	if (!last || !residentPrograms.length) return;
+
+	if ((t.cacheMisses !== last.cacheMisses) || (t.bytesReceived < last.bytesReceived)) {
+		residentPrograms = [];
+		broadcast({cache: residentPrograms, reset: true});
+	}
+}
+
+// Port data is text (debug prints), with binary records mixed in.
+// Pull out the records, log the rest.
+function readPortData(data) {
+	portData = Buffer.concat([portData, data]);
+
+	while (true) {
+		let start = portData.indexOf(RECORD_MAGIC);
+
+		if (start < 0) {
+			if (portData.length) console.log('<<<<<', portData.toString('ascii'));
+			portData = Buffer.alloc(0);
+			return;
+		}
+
+		if (start > 0) {
+			console.log('<<<<<', portData.slice(0, start).toString('ascii'));
+			portData = portData.slice(start);
+		}
+
+		let size = recordSize(portData);
+
+		// Not a record: Skip the magic
+		if (size < 0) {
+			portData = portData.slice(1);
+			continue;
+		}
+
+		// Wait for the rest of the record
+		if ((size === 0) || (portData.length < size)) {
+			return;
+		}
+
+		let rec = portData.slice(0, size);
+		if (!checksumOK(rec)) {
+			portData = portData.slice(1);
+			continue;
+		}
+
+		if (rec[1] === TELEMETRY_TYPE) {
+			let t = decodeTelemetry(rec);
+			checkPrograms(t);
+			broadcast({telemetry: t});
+		} else {
+			broadcast({profile: decodeProfile(rec)});
+		}
+		portData = portData.slice(size);
+	}
+}
+
+port.on('data', readPortData);
+
+const telemetryInterval = setInterval(function queryTelemetry() {
+	if (port && port.isOpen && socket.clients.size) {
+		port.write(TELEMETRY_QUERY);
+	}
+}, TELEMETRY_INTERVAL_MS);
 
 port.open(function(err){
 	if (err) {